@@ -0,0 +1,284 @@
+// Distributed File System - Server Configuration Implementation
+// Parses the configuration file shared by all programs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // for strcasecmp()
+#include <netdb.h> // for getaddrinfo()
+#include <arpa/inet.h>
+
+#include "config.h"
+
+// Default ports of S1, S2, S3, S4
+static const int default_ports[DFS_NUM_SERVERS] = { 4307, 4308, 4309, 4310 };
+
+struct dfs_server_config dfs_servers[DFS_MAX_NODES];
+int dfs_num_nodes;
+int dfs_replicas;
+
+// Function to parse an address[:port] field into a server's configuration
+static int parse_address(const char *field, struct dfs_server_config *srv)
+{
+    const char *colon = strrchr(field, ':');
+    size_t host_len = (colon != NULL) ? (size_t)(colon - field) : strlen(field);
+
+    if (host_len >= sizeof(srv->host))
+    {
+        return -1;
+    }
+    if (colon != NULL)
+    {
+        char *end;
+        long port = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || port <= 0 || port > 65535)
+        {
+            return -1;
+        }
+        srv->port = (int)port;
+    }
+    memcpy(srv->host, field, host_len);
+    srv->host[host_len] = '\0';
+    return 0;
+}
+
+// Function to parse a weight=N field into a server's configuration
+static int parse_weight(const char *field, struct dfs_server_config *srv)
+{
+    if (strncmp(field, "weight=", strlen("weight=")) != 0)
+    {
+        return -1;
+    }
+
+    char *end;
+    long weight = strtol(field + strlen("weight="), &end, 10);
+    if (end == field + strlen("weight=") || *end != '\0' || weight < 0 || weight > DFS_MAX_WEIGHT)
+    {
+        return -1;
+    }
+    srv->weight = (int)weight;
+    return 0;
+}
+
+// Function to set up an instance of a server with its defaults
+static void set_defaults(struct dfs_server_config *srv, enum dfs_server server, int instance)
+{
+    const char *home = getenv("HOME");
+
+    srv->server = server;
+    srv->instance = instance;
+    srv->host[0] = '\0';
+    srv->port = default_ports[server];
+    srv->weight = 1;
+    if (instance == 1)
+    {
+        snprintf(srv->root, sizeof(srv->root), "%s/S%d", home ? home : ".", server + 1);
+    }
+    else
+    {
+        snprintf(srv->root, sizeof(srv->root), "%s/S%d-%d", home ? home : ".", server + 1, instance);
+    }
+}
+
+// Function to read a server configuration into servers, *num_nodes and *replicas
+// Every server starts out with its defaults; the first line for a server overrides them and each
+// further line for it adds an instance.
+static int read_config(const char *path, struct dfs_server_config servers[], int *num_nodes, int *replicas)
+{
+    int instances[DFS_NUM_SERVERS] = { 0 };
+
+    for (int i = 0; i < DFS_NUM_SERVERS; i++)
+    {
+        set_defaults(&servers[i], i, 1);
+    }
+    *num_nodes = DFS_NUM_SERVERS;
+    *replicas = 1;
+
+    if (path == NULL)
+    {
+        return 0;
+    }
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    char line[1024];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char name[16], address[DFS_MAX_HOST_LEN + 8], root[DFS_MAX_ROOT_LEN], weight[32];
+        lineno++;
+
+        // Skip comments and blank lines
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0')
+        {
+            continue;
+        }
+
+        int fields = sscanf(p, "%15s %263s %511s %31s", name, address, root, weight);
+        if (fields == 2 && strcasecmp(name, "replicas") == 0)
+        {
+            char *end;
+            long copies = strtol(address, &end, 10);
+            if (end == address || *end != '\0' || copies < 1 || copies > DFS_MAX_NODES)
+            {
+                fprintf(stderr, "%s:%d: invalid replicas line\n", path, lineno);
+                fclose(fp);
+                return -1;
+            }
+            *replicas = (int)copies;
+            continue;
+        }
+
+        int server = -1;
+        for (int i = 0; i < DFS_NUM_SERVERS && fields >= 2; i++)
+        {
+            char expected[4];
+            snprintf(expected, sizeof(expected), "S%d", i + 1);
+            if (strcasecmp(name, expected) == 0)
+            {
+                server = i;
+            }
+        }
+
+        // Only S2, S3 and S4 can have several instances
+        int node = server;
+        if (server >= 0 && instances[server] > 0)
+        {
+            node = (server != DFS_S1 && *num_nodes < DFS_MAX_NODES) ? (*num_nodes)++ : -1;
+        }
+        if (node >= 0)
+        {
+            instances[server]++;
+            set_defaults(&servers[node], server, instances[server]);
+        }
+
+        // The storage directory and the weight may follow the address, the weight last
+        int invalid = (node < 0 || parse_address(address, &servers[node]) < 0);
+        if (!invalid && fields == 3 && strncmp(root, "weight=", strlen("weight=")) == 0)
+        {
+            invalid = (parse_weight(root, &servers[node]) < 0);
+        }
+        else if (!invalid && fields >= 3)
+        {
+            snprintf(servers[node].root, sizeof(servers[node].root), "%s", root);
+            invalid = (fields == 4 && parse_weight(weight, &servers[node]) < 0);
+        }
+        if (invalid)
+        {
+            fprintf(stderr, "%s:%d: invalid server line\n", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+// Function to load the server configuration
+int dfs_load_config(const char *path)
+{
+    return read_config(path, dfs_servers, &dfs_num_nodes, &dfs_replicas);
+}
+
+// Function to apply a changed configuration file to a running server
+// The instances already configured must keep their place, address and storage directory, since
+// they are known by their place; only their weights, instances added after them and the number of
+// copies can change. New instances are filled in before dfs_num_nodes counts them.
+int dfs_reload_config(const char *path)
+{
+    static struct dfs_server_config servers[DFS_MAX_NODES];
+    int num_nodes, replicas;
+
+    if (read_config(path, servers, &num_nodes, &replicas) < 0)
+    {
+        return -1;
+    }
+    for (int node = 0; node < dfs_num_nodes; node++)
+    {
+        const struct dfs_server_config *old = &dfs_servers[node], *new = &servers[node];
+        if (node >= num_nodes || new->server != old->server || new->instance != old->instance ||
+            new->port != old->port || strcmp(new->host, old->host) != 0 || strcmp(new->root, old->root) != 0)
+        {
+            fprintf(stderr, "%s: instances can only be added after the existing ones, which must stay "
+                    "unchanged but for their weight\n", path);
+            return -1;
+        }
+    }
+
+    memcpy(&dfs_servers[dfs_num_nodes], &servers[dfs_num_nodes], (num_nodes - dfs_num_nodes) * sizeof(servers[0]));
+    for (int node = 0; node < dfs_num_nodes; node++)
+    {
+        dfs_servers[node].weight = servers[node].weight;
+    }
+    __atomic_store_n(&dfs_replicas, replicas, __ATOMIC_RELEASE);
+    __atomic_store_n(&dfs_num_nodes, num_nodes, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Function to find a server instance in the configuration
+int dfs_find_node(enum dfs_server server, int instance)
+{
+    for (int node = 0; node < dfs_num_nodes; node++)
+    {
+        if (dfs_servers[node].server == server && dfs_servers[node].instance == instance)
+        {
+            return node;
+        }
+    }
+    return -1;
+}
+
+// Function to get the address a server instance binds its listening socket to
+int dfs_listen_address(int node, struct sockaddr_in *addr)
+{
+    const struct dfs_server_config *srv = &dfs_servers[node];
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(srv->port);
+
+    if (srv->host[0] == '\0')
+    {
+        addr->sin_addr.s_addr = INADDR_ANY;
+        return 0;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(srv->host, NULL, &hints, &res) != 0)
+    {
+        return -1;
+    }
+    addr->sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return 0;
+}
+
+// Function to get the host to connect to for a server instance
+const char *dfs_server_host(int node)
+{
+    return (dfs_servers[node].host[0] != '\0') ? dfs_servers[node].host : "localhost";
+}
+
+// Function to name a server instance in messages
+void dfs_node_name(int node, char *buf, size_t size)
+{
+    const struct dfs_server_config *srv = &dfs_servers[node];
+    if (srv->instance == 1)
+    {
+        snprintf(buf, size, "S%d", srv->server + 1);
+    }
+    else
+    {
+        snprintf(buf, size, "S%d-%d", srv->server + 1, srv->instance);
+    }
+}
@@ -0,0 +1,82 @@
+// Distributed File System - Server Configuration
+// Addresses and storage directories of S1, S2, S3 and S4, so that each server can run on its own
+// host and disk. They are read from a configuration file with one line per server:
+//
+//   # server  address[:port]  [storage directory]  [weight=N]
+//   S1  0.0.0.0:4307
+//   S2  127.0.0.2:4308  /srv/dfs/S2
+//
+// Servers missing from the file, or started without one, keep the defaults: all interfaces (other
+// servers reach them on localhost), the standard ports and ~/S1 ... ~/S4 for storage.
+//
+// A second line for S2, S3 or S4 adds another instance of that server, which then stores part of
+// the server's files; its storage directory defaults to ~/S2-2 for the second S2 and so on. Every
+// instance is started with its number, e.g. ./S2 -c dfs.conf -i 2. An instance's weight (default 1)
+// sets its share of the server's files relative to the other instances, e.g. weight=2 for a host with
+// twice the disk space; weight=0 drains it, so its files move to the others.
+//
+// A line "replicas N" makes S1 keep N copies of every file of S2, S3 and S4, each on another instance
+// of the server (as many as there are, if there are fewer). The default is one copy.
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <netinet/in.h>
+
+#define DFS_MAX_HOST_LEN 256 // Longest host name or address in the configuration
+#define DFS_MAX_ROOT_LEN 512 // Longest storage directory in the configuration
+#define DFS_MAX_NODES 32 // Most server instances in the configuration, S1 included
+#define DFS_MAX_WEIGHT 100 // Largest weight of a server instance
+
+// The servers of the file system
+enum dfs_server
+{
+    DFS_S1, // Main server, stores .c files
+    DFS_S2, // PDF files
+    DFS_S3, // TXT files
+    DFS_S4, // ZIP files
+    DFS_NUM_SERVERS
+};
+
+// Configuration of one server instance
+struct dfs_server_config
+{
+    enum dfs_server server; // Server it is an instance of, which fixes the files it stores
+    int instance; // 1 for the first instance of the server, 2 for the second, ...
+    char host[DFS_MAX_HOST_LEN]; // Empty for the default
+    int port;
+    char root[DFS_MAX_ROOT_LEN]; // Storage directory
+    int weight; // Share of the server's files the instance stores, relative to the other instances
+};
+
+// Every server instance, in the order of the configuration file. dfs_servers[DFS_S1] ...
+// dfs_servers[DFS_S4] are always the first instances of S1 ... S4, so a server running alone is
+// found by its enum dfs_server value; the other instances follow them.
+extern struct dfs_server_config dfs_servers[DFS_MAX_NODES];
+extern int dfs_num_nodes;
+
+// Copies kept of each file of a server that has several instances
+extern int dfs_replicas;
+
+// Sets the defaults, then applies the configuration file at path unless it is NULL.
+// Returns -1 (after printing the problem) if the file cannot be read or has an invalid line.
+int dfs_load_config(const char *path);
+
+// Reads the configuration file at path again in a running server. Instances added at the end,
+// weights and the number of copies take effect; any other change is refused, returning -1 (after
+// printing the problem) and leaving the configuration as it was.
+int dfs_reload_config(const char *path);
+
+// Finds the entry of an instance of a server in dfs_servers. Returns -1 if it is not configured.
+int dfs_find_node(enum dfs_server server, int instance);
+
+// Fills in the address a server instance listens on. Returns -1 if its host cannot be resolved.
+int dfs_listen_address(int node, struct sockaddr_in *addr);
+
+// Host name other programs connect to for a server instance
+const char *dfs_server_host(int node);
+
+// Name of a server instance for messages: "S2" for a first instance, "S2-2" for the second
+void dfs_node_name(int node, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,552 @@
+// Distributed File System - Directory Listing Cache Implementation
+// Listings are kept in a hash table keyed by the directory's normalised path and on a list in order
+// of use. A listing is reference counted, so it can be dropped from the cache while a reply is still
+// walking it. Every invalidation moves a generation counter on; a listing read from disk is only
+// cached if the counter did not move while it was read, since the directory may have changed after
+// it was read but before it could be cached.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h> // for PATH_MAX
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dir_cache.h"
+#include "namespace.h"
+
+// Kinds of cached entries
+enum dir_entry_type
+{
+    ENTRY_OTHER,
+    ENTRY_DIR,
+    ENTRY_FILE
+};
+
+// An entry of a cached directory
+struct dir_entry
+{
+    const char *name;
+    size_t name_len;
+    enum dir_entry_type type;
+};
+
+// A directory's entries sorted by name, allocated in one block with them and the names
+struct dir_listing
+{
+    const char *path; // Normalised path of the directory
+    size_t path_len;
+    struct dir_entry *entries;
+    size_t count;
+    size_t bytes; // Size of the block
+    int refs; // One for the cache while the listing is in it, one for each reply walking it
+    struct dir_listing *hash_next;
+    struct dir_listing *prev; // Neighbours on the list in order of use, most recent first
+    struct dir_listing *next;
+};
+
+// Names read from a directory before they are sorted
+struct name_list
+{
+    char *names; // NUL-terminated names one after the other
+    size_t len;
+    size_t cap;
+    size_t *offsets;
+    enum dir_entry_type *types;
+    size_t count;
+    size_t capacity;
+};
+
+// A storage server's listing being sent
+struct disk_listing
+{
+    struct dfs_request *req;
+    const char *suffix;
+    size_t root_len; // Length of the storage directory at the start of each path
+    char *chunk; // Names not sent yet
+    size_t used;
+    size_t left; // Names still wanted
+};
+
+static struct dir_listing *buckets[DIR_CACHE_BUCKETS];
+static struct dir_listing *most_recent;
+static struct dir_listing *least_recent;
+static size_t cached_bytes;
+static uint64_t generation; // Number of invalidations
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to get the next component of a path, skipping empty and "." components
+// Returns NULL at the end of the path.
+static const char *next_component(const char **path, size_t *len)
+{
+    const char *p = *path;
+    while (1)
+    {
+        while (*p == '/')
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            *path = p;
+            return NULL;
+        }
+
+        const char *start = p;
+        while (*p != '\0' && *p != '/')
+        {
+            p++;
+        }
+        if (p - start != 1 || start[0] != '.')
+        {
+            *path = p;
+            *len = p - start;
+            return start;
+        }
+    }
+}
+
+// Function to append the normalised components of path to out, which holds len bytes
+// A relative path written to an empty out stays relative. Returns the new length, or -1 if the
+// result does not fit in PATH_MAX bytes.
+static ssize_t append_path(char *out, size_t len, const char *path)
+{
+    const char *comp;
+    size_t comp_len;
+    int slash = (len > 0 || path[0] == '/');
+    while ((comp = next_component(&path, &comp_len)) != NULL)
+    {
+        if (len + 1 + comp_len >= PATH_MAX)
+        {
+            return -1;
+        }
+        if (slash)
+        {
+            out[len++] = '/';
+        }
+        memcpy(out + len, comp, comp_len);
+        len += comp_len;
+        slash = 1;
+    }
+    out[len] = '\0';
+    return (ssize_t)len;
+}
+
+// Function to hash a directory path (FNV-1a)
+static size_t hash_path(const char *path, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t)(h ^ (h >> 32)) & (DIR_CACHE_BUCKETS - 1);
+}
+
+// Function to find a cached listing, with the cache locked
+static struct dir_listing *find_listing(const char *path, size_t len)
+{
+    struct dir_listing *dir = buckets[hash_path(path, len)];
+    while (dir != NULL && (dir->path_len != len || memcmp(dir->path, path, len) != 0))
+    {
+        dir = dir->hash_next;
+    }
+    return dir;
+}
+
+// Function to give up a reference to a listing, with the cache locked
+static void put_listing_locked(struct dir_listing *dir)
+{
+    if (--dir->refs == 0)
+    {
+        free(dir);
+    }
+}
+
+// Function to give up a reference to a listing
+static void put_listing(struct dir_listing *dir)
+{
+    pthread_mutex_lock(&cache_lock);
+    put_listing_locked(dir);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Function to take a listing off the list in order of use, with the cache locked
+static void unlink_recent(struct dir_listing *dir)
+{
+    if (dir->prev != NULL)
+    {
+        dir->prev->next = dir->next;
+    }
+    else
+    {
+        most_recent = dir->next;
+    }
+    if (dir->next != NULL)
+    {
+        dir->next->prev = dir->prev;
+    }
+    else
+    {
+        least_recent = dir->prev;
+    }
+}
+
+// Function to put a listing first on the list in order of use, with the cache locked
+static void link_recent(struct dir_listing *dir)
+{
+    dir->prev = NULL;
+    dir->next = most_recent;
+    if (most_recent != NULL)
+    {
+        most_recent->prev = dir;
+    }
+    else
+    {
+        least_recent = dir;
+    }
+    most_recent = dir;
+}
+
+// Function to drop a listing from the cache, with the cache locked
+static void drop_listing(struct dir_listing *dir)
+{
+    struct dir_listing **link = &buckets[hash_path(dir->path, dir->path_len)];
+    while (*link != dir)
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = dir->hash_next;
+    unlink_recent(dir);
+    cached_bytes -= dir->bytes;
+    put_listing_locked(dir);
+}
+
+// Function to add a name read from a directory to a list
+static int add_name(struct name_list *list, const char *name, enum dir_entry_type type)
+{
+    size_t len = strlen(name) + 1;
+    if (list->len + len > list->cap)
+    {
+        size_t cap = (list->cap == 0) ? 4096 : 2 * list->cap;
+        while (cap < list->len + len)
+        {
+            cap *= 2;
+        }
+        char *names = realloc(list->names, cap);
+        if (names == NULL)
+        {
+            return -1;
+        }
+        list->names = names;
+        list->cap = cap;
+    }
+    if (list->count == list->capacity)
+    {
+        size_t capacity = (list->capacity == 0) ? 64 : 2 * list->capacity;
+        size_t *offsets = realloc(list->offsets, capacity * sizeof(*offsets));
+        if (offsets == NULL)
+        {
+            return -1;
+        }
+        list->offsets = offsets;
+        enum dir_entry_type *types = realloc(list->types, capacity * sizeof(*types));
+        if (types == NULL)
+        {
+            return -1;
+        }
+        list->types = types;
+        list->capacity = capacity;
+    }
+
+    memcpy(list->names + list->len, name, len);
+    list->offsets[list->count] = list->len;
+    list->types[list->count] = type;
+    list->len += len;
+    list->count++;
+    return 0;
+}
+
+// Function to compare two entries by name for qsort()
+static int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct dir_entry *)a)->name, ((const struct dir_entry *)b)->name);
+}
+
+// Function to read a directory's entries from disk into a new listing holding one reference
+// Returns NULL if the directory cannot be read or memory runs out.
+static struct dir_listing *read_listing(const char *path, size_t path_len)
+{
+    DIR *d = opendir(path);
+    if (d == NULL)
+    {
+        return NULL;
+    }
+
+    struct name_list list = { 0 };
+    struct dirent *ent;
+    int failed = 0;
+    while (!failed && (ent = readdir(d)) != NULL)
+    {
+        // A name with a newline cannot be told apart from the next line of a listing
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 || strchr(ent->d_name, '\n') != NULL)
+        {
+            continue;
+        }
+
+        unsigned char d_type = ent->d_type;
+        struct stat st;
+        if (d_type == DT_UNKNOWN && fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            d_type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        enum dir_entry_type type = (d_type == DT_DIR) ? ENTRY_DIR : (d_type == DT_REG) ? ENTRY_FILE : ENTRY_OTHER;
+        failed = (add_name(&list, ent->d_name, type) < 0);
+    }
+    closedir(d);
+
+    struct dir_listing *dir = NULL;
+    size_t bytes = sizeof(*dir) + list.count * sizeof(struct dir_entry) + path_len + 1 + list.len;
+    if (!failed)
+    {
+        dir = calloc(1, bytes);
+    }
+    if (dir != NULL)
+    {
+        dir->entries = (struct dir_entry *)(dir + 1);
+        char *p = (char *)(dir->entries + list.count);
+        memcpy(p, path, path_len + 1);
+        dir->path = p;
+        dir->path_len = path_len;
+        p += path_len + 1;
+        memcpy(p, list.names, list.len);
+
+        for (size_t i = 0; i < list.count; i++)
+        {
+            dir->entries[i].name = p + list.offsets[i];
+            dir->entries[i].name_len = strlen(dir->entries[i].name);
+            dir->entries[i].type = list.types[i];
+        }
+        qsort(dir->entries, list.count, sizeof(*dir->entries), compare_entries);
+        dir->count = list.count;
+        dir->bytes = bytes;
+        dir->refs = 1;
+    }
+    free(list.names);
+    free(list.offsets);
+    free(list.types);
+    return dir;
+}
+
+// Function to get the listing of a directory, from the cache or read from disk and then cached
+// path must be normalised. The caller gives the listing back with put_listing().
+static struct dir_listing *get_listing(const char *path, size_t len)
+{
+    pthread_mutex_lock(&cache_lock);
+    struct dir_listing *dir = find_listing(path, len);
+    if (dir != NULL)
+    {
+        unlink_recent(dir);
+        link_recent(dir);
+        dir->refs++;
+        pthread_mutex_unlock(&cache_lock);
+        return dir;
+    }
+    uint64_t gen = generation;
+    pthread_mutex_unlock(&cache_lock);
+
+    dir = read_listing(path, len);
+    if (dir == NULL || dir->bytes > DIR_CACHE_MAX_BYTES)
+    {
+        return dir;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (generation == gen && find_listing(path, len) == NULL)
+    {
+        size_t b = hash_path(path, len);
+        dir->hash_next = buckets[b];
+        buckets[b] = dir;
+        link_recent(dir);
+        dir->refs++;
+        cached_bytes += dir->bytes;
+        while (cached_bytes > DIR_CACHE_MAX_BYTES)
+        {
+            drop_listing(least_recent);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return dir;
+}
+
+// Function to drop the cached listing of the directory holding a path
+void dir_cache_invalidate(const char *path)
+{
+    char dir[PATH_MAX];
+    ssize_t len = append_path(dir, 0, path);
+    if (len < 0)
+    {
+        return;
+    }
+    while (len > 0 && dir[len - 1] != '/')
+    {
+        len--;
+    }
+    if (len > 0)
+    {
+        len--; // The slash before the last component
+    }
+    dir[len] = '\0';
+
+    pthread_mutex_lock(&cache_lock);
+    generation++;
+    struct dir_listing *cached = find_listing(dir, len);
+    if (cached != NULL)
+    {
+        drop_listing(cached);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Function to add a name to a storage server's listing, sending the names gathered so far when the
+// chunk is full
+static int disk_listing_add(struct disk_listing *out, const char *path, size_t len)
+{
+    size_t n = 3 + (len - out->root_len) + 1;
+    if (out->used + n > DFS_CHUNK_SIZE)
+    {
+        if (dfs_reply_data(out->req, out->chunk, out->used) < 0)
+        {
+            return -1;
+        }
+        out->used = 0;
+    }
+    memcpy(out->chunk + out->used, "~S1", 3);
+    memcpy(out->chunk + out->used + 3, path + out->root_len, len - out->root_len);
+    out->chunk[out->used + n - 1] = '\n';
+    out->used += n;
+    out->left--;
+    return 0;
+}
+
+// Function to compare an entry's name with a name, in the order of bytes as strcmp() does
+static int compare_name(const struct dir_entry *entry, const char *name, size_t len)
+{
+    size_t n = (entry->name_len < len) ? entry->name_len : len;
+    int cmp = memcmp(entry->name, name, n);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return (entry->name_len > len) - (entry->name_len < len);
+}
+
+// Function to list the files below a directory of a storage server, after the part of a cursor
+// below it
+// path holds the normalised directory. Returns 1 once the limit is reached, 0 at the end, -1 if
+// sending failed.
+static int list_dir(char *path, size_t len, const char *after, struct disk_listing *out)
+{
+    struct dir_listing *dir = get_listing(path, len);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    const char *comp = NULL;
+    size_t comp_len = 0, lo = 0, suffix_len = strlen(out->suffix);
+    if (after != NULL && (comp = next_component(&after, &comp_len)) != NULL)
+    {
+        // Entries before the cursor are skipped
+        size_t hi = dir->count;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (compare_name(&dir->entries[mid], comp, comp_len) < 0)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+    }
+
+    int ret = 0;
+    for (size_t i = lo; ret == 0 && i < dir->count; i++)
+    {
+        const struct dir_entry *e = &dir->entries[i];
+        if (len + 1 + e->name_len >= PATH_MAX)
+        {
+            continue;
+        }
+        int at_cursor = (comp != NULL && compare_name(e, comp, comp_len) == 0);
+        path[len] = '/';
+        memcpy(path + len + 1, e->name, e->name_len + 1);
+
+        if (e->type == ENTRY_DIR)
+        {
+            ret = list_dir(path, len + 1 + e->name_len, at_cursor ? after : NULL, out);
+        }
+        else if (e->type == ENTRY_FILE && !at_cursor && e->name_len >= suffix_len &&
+                 strcmp(e->name + e->name_len - suffix_len, out->suffix) == 0)
+        {
+            ret = (out->left == 0) ? 1 : disk_listing_add(out, path, len + 1 + e->name_len);
+        }
+    }
+    path[len] = '\0';
+    put_listing(dir);
+    return ret;
+}
+
+// Function to answer a dispfnames request from a storage server's own files
+// The names are sent as the directories are walked, in DATA frames of up to DFS_CHUNK_SIZE bytes.
+int dir_cache_reply(struct dfs_request *req, const char *root, const char *suffix, const char *dir,
+                    const char *after, size_t max)
+{
+    if (after != NULL && (after = ns_cursor_below(dir, after)) == NULL)
+    {
+        dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid dispfnames command format");
+        return -1;
+    }
+
+    // The directory on disk, normalised the way dir_cache_invalidate() does it
+    char path[PATH_MAX];
+    ssize_t root_len = append_path(path, 0, root);
+    ssize_t len = (root_len < 0) ? -1 : append_path(path, root_len, dir);
+    if (len < 0)
+    {
+        dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: Invalid directory path");
+        return -1;
+    }
+
+    struct disk_listing out = { req, suffix, root_len, malloc(DFS_CHUNK_SIZE), 0, max };
+    if (out.chunk == NULL)
+    {
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to list files");
+        return -1;
+    }
+
+    // A directory that does not exist here gives an empty listing
+    int ret = dfs_reply_begin(req, -1);
+    if (ret == 0)
+    {
+        ret = list_dir(path, len, after, &out);
+    }
+    if (ret >= 0 && out.used > 0)
+    {
+        ret = dfs_reply_data(req, out.chunk, out.used);
+    }
+    if (ret >= 0)
+    {
+        ret = dfs_reply_end(req, DFS_OK);
+    }
+    free(out.chunk);
+    return ret;
+}
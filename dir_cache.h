@@ -0,0 +1,33 @@
+// Distributed File System - Directory Listing Cache
+// Answers dispfnames requests on a storage server (S2, S3, S4) from directory listings kept in
+// memory. Used by S2, S3 and S4.
+//
+// The first listing of a directory reads it from disk once: the names of its entries, sorted, and
+// whether each is a directory or a regular file. Later listings walk these cached entries without a
+// system call per entry, and find where a continued listing resumes with a binary search.
+//
+// A cached directory stays valid until the server itself creates or removes an entry in it, which
+// every upload, removal and new directory reports through dir_cache_invalidate(). Changes made to
+// the storage directory by hand are not seen until the listing is dropped to make room for others;
+// the cache holds at most DIR_CACHE_MAX_BYTES, dropping the least recently used listings first.
+
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+#define DIR_CACHE_MAX_BYTES (64 * 1024 * 1024) // Memory the cached listings may take
+#define DIR_CACHE_BUCKETS 4096 // Hash table size, a power of two
+
+// Drops the cached listing of the directory holding path; called after creating or removing path
+void dir_cache_invalidate(const char *path);
+
+// Answers a dispfnames request for the directory dir (relative to root, as in "/folder1") with the
+// files below it whose names end in suffix, at most max of them after the cursor after (a path like
+// dir's, NULL for the start). The names are streamed while the directories are walked.
+int dir_cache_reply(struct dfs_request *req, const char *root, const char *suffix, const char *dir,
+                    const char *after, size_t max);
+
+#endif
@@ -0,0 +1,299 @@
+// Distributed File System - Parallel Gzip Compression Implementation
+// Blocks of a stream compressed by a shared pool of threads and sent in their original order.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "gzip_stream.h"
+#include "thread_pool.h"
+
+#define MAX_PENDING 16 // Most blocks of one stream being compressed or waiting to be sent
+#define COMPRESS_QUEUE_DEPTH 1024 // Blocks of all streams waiting for a compression thread
+
+// A block of the stream and its compressed form
+struct gzip_block
+{
+    struct gzip_stream *gz;
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_cap;
+    size_t out_len;
+    int done; // Compression finished, protected by the stream's lock
+    int failed;
+};
+
+// A compressed reply body
+struct gzip_stream
+{
+    struct tar_sink out; // Where the compressed members go
+    pthread_mutex_t lock;
+    pthread_cond_t block_done; // Signalled when a block has been compressed
+    struct gzip_block blocks[MAX_PENDING]; // Ring of blocks, used in order
+    int window; // Blocks in use by this stream
+    int head; // Oldest block submitted and not sent yet
+    int submitted; // Blocks submitted and not sent yet; the one after them is being filled
+    int failed;
+};
+
+// Threads compressing the blocks of all streams, started on first use
+static struct thread_pool *compress_pool;
+static int compress_workers;
+static pthread_once_t compress_once = PTHREAD_ONCE_INIT;
+
+// Function to start the compression threads, one per processor
+static void start_compress_pool(void)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    compress_workers = (ncpu > 1) ? (int)ncpu : 1;
+    compress_pool = pool_create(compress_workers, COMPRESS_QUEUE_DEPTH);
+}
+
+// Function run by a compression thread to turn a block into a gzip member
+static void compress_block(void *arg)
+{
+    struct gzip_block *b = arg;
+    z_stream zs;
+    int ok;
+
+    memset(&zs, 0, sizeof(zs));
+    ok = (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    if (ok)
+    {
+        zs.next_in = b->in;
+        zs.avail_in = b->in_len;
+        zs.next_out = b->out;
+        zs.avail_out = b->out_cap;
+        ok = (deflate(&zs, Z_FINISH) == Z_STREAM_END);
+        b->out_len = b->out_cap - zs.avail_out;
+        deflateEnd(&zs);
+    }
+
+    pthread_mutex_lock(&b->gz->lock);
+    b->failed = !ok;
+    b->done = 1;
+    pthread_cond_broadcast(&b->gz->block_done);
+    pthread_mutex_unlock(&b->gz->lock);
+}
+
+// Function to send the compressed blocks at the head of the ring that are finished
+// With wait set, first waits for the oldest block to be finished. After a failure the blocks are
+// still waited for, since the compression threads use them, but no longer sent.
+static void send_blocks(struct gzip_stream *gz, int wait)
+{
+    while (gz->submitted > 0)
+    {
+        struct gzip_block *b = &gz->blocks[gz->head];
+
+        pthread_mutex_lock(&gz->lock);
+        while (wait && !b->done)
+        {
+            pthread_cond_wait(&gz->block_done, &gz->lock);
+        }
+        int done = b->done;
+        pthread_mutex_unlock(&gz->lock);
+        if (!done)
+        {
+            break;
+        }
+
+        if (b->failed || (!gz->failed && gz->out.data(gz->out.ctx, b->out, b->out_len) < 0))
+        {
+            gz->failed = 1;
+        }
+        b->done = 0;
+        b->in_len = 0;
+        gz->head = (gz->head + 1) % gz->window;
+        gz->submitted--;
+        wait = 0;
+    }
+}
+
+// Function to get the block being filled, waiting for a free one if all are in use
+static struct gzip_block *fill_block(struct gzip_stream *gz)
+{
+    if (gz->submitted == gz->window)
+    {
+        send_blocks(gz, 1);
+    }
+    return &gz->blocks[(gz->head + gz->submitted) % gz->window];
+}
+
+// Function to hand the block being filled to the compression threads
+static void submit_block(struct gzip_stream *gz)
+{
+    struct gzip_block *b = &gz->blocks[(gz->head + gz->submitted) % gz->window];
+
+    if (pool_submit(compress_pool, compress_block, b) < 0)
+    {
+        compress_block(b);
+    }
+    gz->submitted++;
+
+    // Whatever is finished already goes out while the next block is filled
+    send_blocks(gz, 0);
+}
+
+// Function to append bytes to the stream
+static int gzip_data(void *ctx, const void *buf, size_t len)
+{
+    struct gzip_stream *gz = ctx;
+    const unsigned char *p = buf;
+
+    while (len > 0 && !gz->failed)
+    {
+        struct gzip_block *b = fill_block(gz);
+        size_t n = (len < GZIP_BLOCK_SIZE - b->in_len) ? len : GZIP_BLOCK_SIZE - b->in_len;
+        memcpy(b->in + b->in_len, p, n);
+        b->in_len += n;
+        p += n;
+        len -= n;
+        if (b->in_len == GZIP_BLOCK_SIZE)
+        {
+            submit_block(gz);
+        }
+    }
+    return gz->failed ? -1 : 0;
+}
+
+// Function to append the contents of a file or socket to the stream
+// The data is read straight into the blocks.
+static int gzip_copy(void *ctx, int fd, uint64_t len)
+{
+    struct gzip_stream *gz = ctx;
+
+    while (len > 0 && !gz->failed)
+    {
+        struct gzip_block *b = fill_block(gz);
+        size_t n = (len < GZIP_BLOCK_SIZE - b->in_len) ? (size_t)len : GZIP_BLOCK_SIZE - b->in_len;
+        if (dfs_read_full(fd, b->in + b->in_len, n) < 0)
+        {
+            gz->failed = 1;
+            break;
+        }
+        b->in_len += n;
+        len -= n;
+        if (b->in_len == GZIP_BLOCK_SIZE)
+        {
+            submit_block(gz);
+        }
+    }
+    return gz->failed ? -1 : 0;
+}
+
+// Function to start a compressed stream
+// Each stream may keep twice as many blocks in flight as there are compression threads, so the
+// threads stay busy while finished blocks are sent.
+struct gzip_stream *gzip_open(const struct tar_sink *out)
+{
+    pthread_once(&compress_once, start_compress_pool);
+    if (compress_pool == NULL)
+    {
+        return NULL;
+    }
+
+    struct gzip_stream *gz = calloc(1, sizeof(*gz));
+    if (gz == NULL)
+    {
+        return NULL;
+    }
+    gz->out = *out;
+    gz->window = (2 * compress_workers < MAX_PENDING) ? 2 * compress_workers : MAX_PENDING;
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->block_done, NULL);
+
+    for (int i = 0; i < gz->window; i++)
+    {
+        struct gzip_block *b = &gz->blocks[i];
+        b->gz = gz;
+        b->out_cap = compressBound(GZIP_BLOCK_SIZE) + 64; // Room for the gzip header and trailer
+        b->in = malloc(GZIP_BLOCK_SIZE);
+        b->out = malloc(b->out_cap);
+        if (b->in == NULL || b->out == NULL)
+        {
+            gz->failed = 1;
+            gzip_close(gz);
+            return NULL;
+        }
+    }
+    return gz;
+}
+
+// Function to set up a sink writing into the stream
+void gzip_sink(struct gzip_stream *gz, struct tar_sink *sink)
+{
+    sink->data = gzip_data;
+    sink->copy = gzip_copy;
+    sink->ctx = gz;
+}
+
+// Function to finish a compressed stream
+int gzip_close(struct gzip_stream *gz)
+{
+    struct gzip_block *b = &gz->blocks[(gz->head + gz->submitted) % gz->window];
+    if (!gz->failed && b->in_len > 0)
+    {
+        submit_block(gz);
+    }
+    while (gz->submitted > 0)
+    {
+        send_blocks(gz, 1);
+    }
+
+    int ret = gz->failed ? -1 : 0;
+    for (int i = 0; i < gz->window; i++)
+    {
+        free(gz->blocks[i].in);
+        free(gz->blocks[i].out);
+    }
+    pthread_mutex_destroy(&gz->lock);
+    pthread_cond_destroy(&gz->block_done);
+    free(gz);
+    return ret;
+}
+
+// Function to answer a request with a compressed archive
+int gzip_tar_reply(struct dfs_request *req, const char *root, const char *suffix, time_t since)
+{
+    if (!req->framed)
+    {
+        dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Compressed archives need the framed protocol");
+        return -1;
+    }
+
+    struct tar_list list;
+    if (tar_collect(&list, root, suffix, since) < 0)
+    {
+        tar_free(&list);
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to create tar file");
+        return -1;
+    }
+
+    struct tar_sink out, sink;
+    tar_reply_sink(req, &out);
+    struct gzip_stream *gz = gzip_open(&out);
+    if (gz == NULL)
+    {
+        tar_free(&list);
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to start compression");
+        return -1;
+    }
+    gzip_sink(gz, &sink);
+
+    int ret = dfs_reply_begin(req, -1);
+    if (ret == 0)
+    {
+        ret = tar_send(&sink, &list, 1);
+    }
+    if (gzip_close(gz) < 0)
+    {
+        ret = -1;
+    }
+    dfs_reply_end(req, (ret == 0) ? DFS_OK : DFS_ERR_IO);
+    tar_free(&list);
+    return ret;
+}
@@ -0,0 +1,41 @@
+// Distributed File System - Parallel Gzip Compression
+// Compresses the body of a reply on several threads at once, the way pigz does.
+// Used by S1, S2, S3 and S4 for compressed downltar archives.
+//
+// The input is cut into blocks of GZIP_BLOCK_SIZE bytes. Every block is compressed on its own by a
+// worker of a shared thread pool into a complete gzip member, and the members are written in order
+// to an output sink: the reply body, or a file when the archive is cached. A gzip file may consist
+// of several members, so the concatenation decompresses with any gzip tool. The thread filling the
+// blocks keeps reading files while earlier blocks are being compressed and sent.
+//
+// The compressed size is not known in advance, so replies streamed this way can only be sent to
+// framed clients.
+
+#ifndef GZIP_STREAM_H
+#define GZIP_STREAM_H
+
+#include <time.h>
+
+#include "protocol.h"
+#include "tar_stream.h"
+
+#define GZIP_BLOCK_SIZE (1024 * 1024) // Input compressed independently by one worker
+#define GZIP_LEVEL 6 // zlib compression level
+
+struct gzip_stream;
+
+// Starts a compressed stream writing to out, such as the body of a reply begun with
+// dfs_reply_begin(req, -1). Returns NULL on failure.
+struct gzip_stream *gzip_open(const struct tar_sink *out);
+
+// Sets up sink to write into the compressed stream
+void gzip_sink(struct gzip_stream *gz, struct tar_sink *sink);
+
+// Compresses and writes out what is left and frees the stream. Returns -1 if anything failed.
+int gzip_close(struct gzip_stream *gz);
+
+// Answers req with a compressed archive of the files below root whose names end in suffix,
+// modified at or after since
+int gzip_tar_reply(struct dfs_request *req, const char *root, const char *suffix, time_t since);
+
+#endif
@@ -0,0 +1,1647 @@
+// Distributed File System - Namespace Index Implementation
+// A tree of directory and file nodes. Each directory keeps its entries in an array sorted by name,
+// which fixes the listing order and lets a listing resume after any name with a binary search per
+// level; all nodes are also in one hash table keyed by parent and name for lookups. A read-write
+// lock lets any number of lookups and listings run together with one update at a time.
+//
+// Bulk loads (the scan, a manifest, the snapshot) append entries in whatever order they arrive and
+// sort the directories they touched once at the end, instead of inserting each entry in place.
+//
+// The journal and the snapshot hold the same fixed-size records, each followed by its path padded
+// to 8 bytes, so both are read by walking a mapping of the file. Journal records are appended with
+// the index locked for writing. A snapshot is copied into memory and a new journal started with it
+// locked for reading, so the two never disagree about which changes the snapshot already contains,
+// and is written to disk after the lock is released. Journals are numbered; the snapshot names the
+// first one written after it, and the older ones are removed once it is on disk.
+//
+// Each server also has a blocked Bloom filter of the paths of the files it holds a copy of, read
+// without the lock, so a lookup of a file that is in none of them costs one hash of the path and one
+// cache line per server.
+// Bits are only ever set; a filter that has taken as many changes (additions and removals) as it was
+// sized for is replaced by one built from the tree, and the old one is freed once no lookup reads it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h> // for PATH_MAX
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h> // for mmap()
+#include <sys/stat.h>
+
+#include "namespace.h"
+#include "tar_stream.h"
+
+#define INITIAL_BUCKETS 1024 // Hash table size before the first growth, a power of two
+#define MANIFEST_LINE_MAX (PATH_MAX + 64) // Longest manifest line: size, mtime and name
+#define SNAPSHOT_MAGIC "DFSNS004" // First bytes of a snapshot, changed with the record format
+#define SNAPSHOT_NAME "snapshot"
+#define JOURNAL_NAME "journal"
+#define META_NAME_MAX 32 // Longest "/name" of a file in the metadata directory, a journal's with its number
+#define FILTER_BITS_PER_FILE 10 // Bloom filter size, for about 1% false positives
+#define FILTER_MIN_FILES 1024 // Smallest number of files a filter is sized for
+#define FILTER_PROBES 7 // Bits set per path, all in one 512-bit block
+#define PATH_HASH_SEED 14695981039346656037ULL
+
+// Kinds of saved records
+enum ns_record_type
+{
+    REC_DIR = 1,
+    REC_FILE = 2,
+    REC_REMOVE = 3 // Only in the journal
+};
+
+// A saved change, followed by path_len bytes of path and padding to a multiple of 8 bytes
+struct ns_record
+{
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t path_len;
+    uint32_t servers;
+    int64_t size;
+    int64_t mtime;
+};
+
+// Start of a snapshot, followed by one record per directory and file
+struct ns_snapshot_header
+{
+    char magic[8];
+    uint32_t complete; // Bit set for each server whose files are all in the index
+    uint32_t layout; // Hash of the configured servers the records refer to
+    uint64_t records;
+    uint64_t journal; // First journal holding changes made after the snapshot
+};
+
+// Entries of a directory
+struct ns_dir
+{
+    struct ns_node **entries; // Sorted by name
+    size_t count;
+    size_t capacity;
+    size_t sorted; // Leading entries in order, the rest were appended by a bulk load
+    int dirty; // On the list of directories to sort
+    struct ns_node *dirty_next;
+};
+
+// A directory or file
+struct ns_node
+{
+    struct ns_node *parent;
+    struct ns_node *hash_next; // Next node in the same hash bucket
+    int is_dir;
+    union
+    {
+        struct ns_file file; // Files
+        struct ns_dir dir; // Directories
+    };
+    size_t name_len;
+    char name[];
+};
+
+// Bloom filter of the paths of a server's files
+struct ns_filter
+{
+    uint64_t *words; // Blocks of 8 words, one cache line each
+    size_t num_blocks; // A power of two
+    size_t room; // Changes it takes before it is rebuilt
+    struct ns_filter *retired_next;
+};
+
+// A page of a listing being collected
+struct ns_page
+{
+    char *buf;
+    size_t size;
+    size_t len;
+    size_t count;
+    size_t max;
+};
+
+static struct ns_node root_node = { .is_dir = 1 };
+static struct ns_node **buckets;
+static size_t num_buckets;
+static size_t num_nodes;
+static int complete[DFS_MAX_NODES]; // The index holds every file of the server
+static int bulk_load; // Entries are appended unsorted
+static struct ns_node *dirty_dirs; // Directories with entries appended by the current bulk load
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Filters, replaced with the index locked for writing and read without it
+static struct ns_filter *filters[DFS_MAX_NODES];
+static struct ns_filter *retired_filters; // Replaced filters lookups may still read
+static unsigned int filter_readers; // Lookups reading a filter
+static unsigned int filters_wanted; // Bit set for each server whose filter is rebuilt after a bulk load
+
+// Saving the index
+static char meta_dir[PATH_MAX]; // Empty while the index is not saved
+static int journal_fd = -1;
+static uint64_t journal_id; // Number of the journal being appended to
+static uint64_t saved_journal; // First journal the snapshot on disk needs
+static off_t journal_bytes;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER; // One snapshot written at a time
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER; // Signalled when the journal is too big
+static int compact_wanted;
+
+// Function to get the next component of a path, skipping empty and "." components
+// Returns NULL at the end of the path.
+static const char *next_component(const char **path, size_t *len)
+{
+    const char *p = *path;
+    while (1)
+    {
+        while (*p == '/')
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            *path = p;
+            return NULL;
+        }
+
+        const char *start = p;
+        while (*p != '\0' && *p != '/')
+        {
+            p++;
+        }
+        if (p - start != 1 || start[0] != '.')
+        {
+            *path = p;
+            *len = p - start;
+            return start;
+        }
+    }
+}
+
+// Function to hash a name within its directory (FNV-1a)
+static size_t hash_name(const struct ns_node *parent, const char *name, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL ^ (uint64_t)(uintptr_t)parent;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t)(h ^ (h >> 32));
+}
+
+// Function to find an entry of a directory
+static struct ns_node *find_child(const struct ns_node *parent, const char *name, size_t len)
+{
+    if (num_buckets == 0)
+    {
+        return NULL;
+    }
+
+    struct ns_node *node = buckets[hash_name(parent, name, len) & (num_buckets - 1)];
+    while (node != NULL &&
+           (node->parent != parent || node->name_len != len || memcmp(node->name, name, len) != 0))
+    {
+        node = node->hash_next;
+    }
+    return node;
+}
+
+// Function to double the hash table once it holds as many nodes as it has buckets
+static int grow_buckets(void)
+{
+    size_t count = (num_buckets == 0) ? INITIAL_BUCKETS : 2 * num_buckets;
+    struct ns_node **table = calloc(count, sizeof(*table));
+    if (table == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < num_buckets; i++)
+    {
+        struct ns_node *node = buckets[i];
+        while (node != NULL)
+        {
+            struct ns_node *next = node->hash_next;
+            size_t b = hash_name(node->parent, node->name, node->name_len) & (count - 1);
+            node->hash_next = table[b];
+            table[b] = node;
+            node = next;
+        }
+    }
+    free(buckets);
+    buckets = table;
+    num_buckets = count;
+    return 0;
+}
+
+// Function to compare an entry's name with a name, in the order of bytes as strcmp() does
+static int compare_name(const struct ns_node *node, const char *name, size_t len)
+{
+    size_t n = (node->name_len < len) ? node->name_len : len;
+    int cmp = memcmp(node->name, name, n);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return (node->name_len > len) - (node->name_len < len);
+}
+
+// Function to compare two entries for qsort()
+static int compare_nodes(const void *a, const void *b)
+{
+    const struct ns_node *y = *(struct ns_node *const *)b;
+    return compare_name(*(struct ns_node *const *)a, y->name, y->name_len);
+}
+
+// Function to find the position of the first sorted entry of a directory not before name
+static size_t lower_bound(const struct ns_dir *dir, const char *name, size_t len)
+{
+    size_t lo = 0, hi = dir->sorted;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare_name(dir->entries[mid], name, len) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Function to put the entries a bulk load appended to a directory in order
+// The appended entries are sorted on their own and merged into the sorted ones from the back.
+static void sort_dir(struct ns_dir *dir)
+{
+    size_t tail = dir->count - dir->sorted;
+    struct ns_node **appended = malloc(tail * sizeof(*appended));
+    if (appended == NULL)
+    {
+        qsort(dir->entries, dir->count, sizeof(*dir->entries), compare_nodes);
+        dir->sorted = dir->count;
+        return;
+    }
+    memcpy(appended, dir->entries + dir->sorted, tail * sizeof(*appended));
+    qsort(appended, tail, sizeof(*appended), compare_nodes);
+
+    size_t i = dir->sorted, j = tail, out = dir->count;
+    while (j > 0)
+    {
+        if (i > 0 && compare_nodes(&dir->entries[i - 1], &appended[j - 1]) > 0)
+        {
+            dir->entries[--out] = dir->entries[--i];
+        }
+        else
+        {
+            dir->entries[--out] = appended[--j];
+        }
+    }
+    free(appended);
+    dir->sorted = dir->count;
+}
+
+// Function to hash one more component of a path for the filters (FNV-1a)
+static uint64_t hash_component(uint64_t h, const char *name, size_t len)
+{
+    h ^= '/';
+    h *= 1099511628211ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Function to hash a path for the filters, component by component as the tree holds it
+static uint64_t hash_path(const char *path)
+{
+    uint64_t h = PATH_HASH_SEED;
+    const char *name;
+    size_t len;
+
+    while ((name = next_component(&path, &len)) != NULL)
+    {
+        h = hash_component(h, name, len);
+    }
+    return h;
+}
+
+// Function to spread the bits of a path hash (the splitmix64 finalizer)
+static uint64_t mix_hash(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+// Function to set the bits of a path in a filter
+static void filter_add(struct ns_filter *filter, uint64_t h)
+{
+    uint64_t *block = filter->words + (mix_hash(h) & (filter->num_blocks - 1)) * 8;
+    uint64_t bits = mix_hash(h ^ 0x9e3779b97f4a7c15ULL);
+    for (int i = 0; i < FILTER_PROBES; i++, bits >>= 9)
+    {
+        __atomic_fetch_or(&block[(bits >> 6) & 7], 1ULL << (bits & 63), __ATOMIC_RELEASE);
+    }
+}
+
+// Function to tell whether the bits of a path are all set in a filter
+static int filter_test(const struct ns_filter *filter, uint64_t h)
+{
+    const uint64_t *block = filter->words + (mix_hash(h) & (filter->num_blocks - 1)) * 8;
+    uint64_t bits = mix_hash(h ^ 0x9e3779b97f4a7c15ULL);
+    for (int i = 0; i < FILTER_PROBES; i++, bits >>= 9)
+    {
+        if ((__atomic_load_n(&block[(bits >> 6) & 7], __ATOMIC_ACQUIRE) & (1ULL << (bits & 63))) == 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to add the files of server below dir to filter (NULL to count them only)
+// h is the hash of dir's path. Returns the number of files.
+static size_t fill_filter(struct ns_filter *filter, const struct ns_node *dir, uint64_t h, int server)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < dir->dir.count; i++)
+    {
+        const struct ns_node *node = dir->dir.entries[i];
+        uint64_t node_hash = hash_component(h, node->name, node->name_len);
+        if (node->is_dir)
+        {
+            count += fill_filter(filter, node, node_hash, server);
+        }
+        else if (node->file.servers & (1u << server))
+        {
+            if (filter != NULL)
+            {
+                filter_add(filter, node_hash);
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+// Function to put filter (NULL for none) in place of a server's, with the index locked for writing
+// The old filter is kept until a replacement finds no lookup reading a filter; a lookup that starts
+// after the replacement reads the new one.
+static void replace_filter(int server, struct ns_filter *filter)
+{
+    struct ns_filter *old = filters[server];
+    __atomic_store_n(&filters[server], filter, __ATOMIC_SEQ_CST);
+    if (old != NULL)
+    {
+        old->retired_next = retired_filters;
+        retired_filters = old;
+    }
+
+    if (__atomic_load_n(&filter_readers, __ATOMIC_SEQ_CST) == 0)
+    {
+        while (retired_filters != NULL)
+        {
+            old = retired_filters;
+            retired_filters = old->retired_next;
+            free(old->words);
+            free(old);
+        }
+    }
+}
+
+// Function to build a server's filter from the tree, with the index locked for writing
+// It is sized for twice the server's files. Without memory for it lookups go to the tree.
+static void rebuild_filter(int server)
+{
+    size_t files = fill_filter(NULL, &root_node, PATH_HASH_SEED, server);
+    size_t capacity = (files < FILTER_MIN_FILES / 2) ? FILTER_MIN_FILES : 2 * files;
+    size_t num_blocks = 1;
+    while (num_blocks * 512 < capacity * FILTER_BITS_PER_FILE)
+    {
+        num_blocks *= 2;
+    }
+
+    struct ns_filter *filter = calloc(1, sizeof(*filter));
+    if (filter != NULL)
+    {
+        filter->words = aligned_alloc(64, num_blocks * 64);
+    }
+    if (filter == NULL || filter->words == NULL)
+    {
+        free(filter);
+        replace_filter(server, NULL);
+        return;
+    }
+    memset(filter->words, 0, num_blocks * 64);
+    filter->num_blocks = num_blocks;
+    filter->room = capacity - files;
+    fill_filter(filter, &root_node, PATH_HASH_SEED, server);
+    replace_filter(server, filter);
+}
+
+// Function to count a change to a server's files against its filter, with the index locked for
+// writing. path is the added file (NULL for a removal), already in the tree. A filter without room
+// is rebuilt, during a bulk load once it ends.
+static void filter_change(int server, const char *path)
+{
+    struct ns_filter *filter = filters[server];
+    if (filter != NULL && filter->room > 0)
+    {
+        filter->room--;
+        if (path != NULL)
+        {
+            filter_add(filter, hash_path(path));
+        }
+    }
+    else if (bulk_load)
+    {
+        filters_wanted |= 1u << server;
+    }
+    else
+    {
+        rebuild_filter(server);
+    }
+}
+
+// Function to start a bulk load, with the index locked for writing
+static void begin_bulk_load(void)
+{
+    bulk_load = 1;
+}
+
+// Function to sort the directories a bulk load appended to, with the index locked for writing
+// The filters it outgrew are then rebuilt, and those of servers without files yet built.
+static void end_bulk_load(void)
+{
+    while (dirty_dirs != NULL)
+    {
+        struct ns_dir *dir = &dirty_dirs->dir;
+        dirty_dirs = dir->dirty_next;
+        sort_dir(dir);
+        dir->dirty = 0;
+        dir->dirty_next = NULL;
+    }
+    bulk_load = 0;
+
+    for (int server = 0; server < dfs_num_nodes; server++)
+    {
+        if ((filters_wanted & (1u << server)) || filters[server] == NULL)
+        {
+            rebuild_filter(server);
+        }
+    }
+    filters_wanted = 0;
+}
+
+// Function to add an entry to a directory
+// Outside a bulk load the entry is inserted at its place; appending in order costs nothing extra.
+static struct ns_node *add_child(struct ns_node *parent, const char *name, size_t len, int is_dir)
+{
+    struct ns_dir *dir = &parent->dir;
+    if (num_nodes >= num_buckets && grow_buckets() < 0)
+    {
+        return NULL;
+    }
+    if (dir->count == dir->capacity)
+    {
+        size_t capacity = (dir->capacity == 0) ? 4 : 2 * dir->capacity;
+        struct ns_node **entries = realloc(dir->entries, capacity * sizeof(*entries));
+        if (entries == NULL)
+        {
+            return NULL;
+        }
+        dir->entries = entries;
+        dir->capacity = capacity;
+    }
+
+    struct ns_node *node = calloc(1, sizeof(*node) + len + 1);
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    node->parent = parent;
+    node->is_dir = is_dir;
+    node->name_len = len;
+    memcpy(node->name, name, len);
+
+    if (dir->sorted == dir->count &&
+        (dir->count == 0 || compare_name(dir->entries[dir->count - 1], name, len) < 0))
+    {
+        dir->entries[dir->count++] = node;
+        dir->sorted++;
+    }
+    else if (bulk_load)
+    {
+        dir->entries[dir->count++] = node;
+        if (!dir->dirty)
+        {
+            dir->dirty = 1;
+            dir->dirty_next = dirty_dirs;
+            dirty_dirs = parent;
+        }
+    }
+    else
+    {
+        size_t pos = lower_bound(dir, name, len);
+        memmove(dir->entries + pos + 1, dir->entries + pos, (dir->count - pos) * sizeof(*dir->entries));
+        dir->entries[pos] = node;
+        dir->count++;
+        dir->sorted++;
+    }
+
+    size_t b = hash_name(parent, name, len) & (num_buckets - 1);
+    node->hash_next = buckets[b];
+    buckets[b] = node;
+    num_nodes++;
+    return node;
+}
+
+// Function to take a file out of the tree and the hash table
+static void remove_node(struct ns_node *node)
+{
+    struct ns_dir *dir = &node->parent->dir;
+    size_t pos = lower_bound(dir, node->name, node->name_len);
+    if (pos == dir->sorted || dir->entries[pos] != node)
+    {
+        pos = dir->sorted;
+        while (dir->entries[pos] != node)
+        {
+            pos++;
+        }
+    }
+    else
+    {
+        dir->sorted--;
+    }
+    memmove(dir->entries + pos, dir->entries + pos + 1, (dir->count - pos - 1) * sizeof(*dir->entries));
+    dir->count--;
+
+    struct ns_node **link = &buckets[hash_name(node->parent, node->name, node->name_len) & (num_buckets - 1)];
+    while (*link != node)
+    {
+        link = &(*link)->hash_next;
+    }
+    *link = node->hash_next;
+    num_nodes--;
+    unsigned int servers = node->file.servers;
+    free(node);
+    for (int server = 0; server < dfs_num_nodes; server++)
+    {
+        if (servers & (1u << server))
+        {
+            filter_change(server, NULL);
+        }
+    }
+}
+
+// Function to empty the index
+static void clear_index(void)
+{
+    for (size_t i = 0; i < num_buckets; i++)
+    {
+        struct ns_node *node = buckets[i];
+        while (node != NULL)
+        {
+            struct ns_node *next = node->hash_next;
+            if (node->is_dir)
+            {
+                free(node->dir.entries);
+            }
+            free(node);
+            node = next;
+        }
+        buckets[i] = NULL;
+    }
+    free(root_node.dir.entries);
+    memset(&root_node.dir, 0, sizeof(root_node.dir));
+    dirty_dirs = NULL;
+    num_nodes = 0;
+    for (int server = 0; server < DFS_MAX_NODES; server++)
+    {
+        __atomic_store_n(&complete[server], 0, __ATOMIC_RELEASE);
+        replace_filter(server, NULL);
+    }
+    filters_wanted = 0;
+}
+
+// Function to find the node of a path, NULL if it is not in the index
+static struct ns_node *find_path(const char *path)
+{
+    struct ns_node *node = &root_node;
+    const char *name;
+    size_t len;
+
+    while (node != NULL && (name = next_component(&path, &len)) != NULL)
+    {
+        node = node->is_dir ? find_child(node, name, len) : NULL;
+    }
+    return node;
+}
+
+// Function to find or create the node of a path and its parent directories
+// Returns NULL if an entry of the other kind is in the way or memory runs out.
+static struct ns_node *add_path(const char *path, int is_dir)
+{
+    struct ns_node *node = &root_node;
+    size_t len, next_len;
+    const char *name = next_component(&path, &len);
+
+    while (name != NULL)
+    {
+        const char *next_name = next_component(&path, &next_len);
+        int dir = is_dir || next_name != NULL;
+
+        struct ns_node *child = find_child(node, name, len);
+        if (child == NULL)
+        {
+            child = add_child(node, name, len, dir);
+        }
+        if (child == NULL || child->is_dir != dir)
+        {
+            return NULL;
+        }
+        node = child;
+        name = next_name;
+        len = next_len;
+    }
+    return (node->is_dir == is_dir) ? node : NULL;
+}
+
+// Function to record a file, with the index locked for writing
+static int add_file_locked(const char *path, const struct ns_file *file)
+{
+    struct ns_node *node = add_path(path, 0);
+    if (node == NULL)
+    {
+        return -1;
+    }
+    node->file = *file;
+    for (int server = 0; server < dfs_num_nodes; server++)
+    {
+        if (file->servers & (1u << server))
+        {
+            filter_change(server, path);
+        }
+    }
+    return 0;
+}
+
+// Function to record a copy of a file on one more server, with the index locked for writing
+// A file already in the index keeps its other copies and the newest size and modification time.
+static int add_copy_locked(const char *path, const struct ns_file *file)
+{
+    struct ns_node *node = find_path(path);
+    if (node == NULL || node->is_dir)
+    {
+        return add_file_locked(path, file);
+    }
+
+    struct ns_file merged = node->file;
+    merged.servers |= file->servers;
+    if (file->mtime > merged.mtime)
+    {
+        merged.size = file->size;
+        merged.mtime = file->mtime;
+    }
+    return add_file_locked(path, &merged);
+}
+
+// Function to get the size of a saved record with a path of path_len bytes
+static size_t record_size(size_t path_len)
+{
+    return sizeof(struct ns_record) + ((path_len + 7) & ~(size_t)7);
+}
+
+// Function to encode a record into buf, which must hold record_size(path_len) bytes
+static size_t encode_record(char *buf, uint8_t type, const char *path, size_t path_len, const struct ns_file *file)
+{
+    struct ns_record rec = { .type = type, .path_len = (uint16_t)path_len };
+    if (file != NULL)
+    {
+        rec.servers = file->servers;
+        rec.size = file->size;
+        rec.mtime = file->mtime;
+    }
+
+    size_t len = record_size(path_len);
+    memset(buf, 0, len);
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), path, path_len);
+    return len;
+}
+
+// Function to apply saved records to the index, with the index locked for writing
+// Stops at the first record that is cut off or malformed. Returns the number of records applied and
+// sets *used to the bytes they take.
+static uint64_t apply_records(const char *data, size_t len, size_t *used)
+{
+    uint64_t count = 0;
+    size_t pos = 0;
+
+    while (len - pos >= sizeof(struct ns_record))
+    {
+        struct ns_record rec;
+        memcpy(&rec, data + pos, sizeof(rec));
+        size_t rec_len = record_size(rec.path_len);
+        if (rec.path_len == 0 || rec.path_len >= PATH_MAX || rec_len > len - pos ||
+            ((uint64_t)rec.servers >> dfs_num_nodes) != 0)
+        {
+            break;
+        }
+
+        char path[PATH_MAX];
+        memcpy(path, data + pos + sizeof(rec), rec.path_len);
+        path[rec.path_len] = '\0';
+
+        if (rec.type == REC_DIR)
+        {
+            if (add_path(path, 1) == NULL)
+            {
+                break;
+            }
+        }
+        else if (rec.type == REC_FILE)
+        {
+            struct ns_file file = { .servers = rec.servers, .size = rec.size, .mtime = rec.mtime };
+            if (file.servers == 0 || add_file_locked(path, &file) < 0)
+            {
+                break;
+            }
+        }
+        else if (rec.type == REC_REMOVE)
+        {
+            struct ns_node *node = find_path(path);
+            if (node != NULL && !node->is_dir)
+            {
+                remove_node(node);
+            }
+        }
+        else
+        {
+            break;
+        }
+        pos += rec_len;
+        count++;
+    }
+    *used = pos;
+    return count;
+}
+
+// Function to map a saved file into memory
+// Returns NULL if it does not exist or is empty.
+static void *map_file(const char *path, size_t *len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+    void *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            data = NULL;
+        }
+        *len = st.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+// Function to hash the configured server instances (FNV-1a)
+// Files are saved with the position of their server in dfs_servers, which another configuration
+// may give to another server.
+static uint32_t server_layout(void)
+{
+    uint32_t h = 2166136261u;
+    for (int server = 0; server < dfs_num_nodes; server++)
+    {
+        char id[DFS_MAX_HOST_LEN + 32];
+        int len = snprintf(id, sizeof(id), "%d %d %s %d;", dfs_servers[server].server, dfs_servers[server].instance,
+                           dfs_servers[server].host, dfs_servers[server].port);
+        for (int i = 0; i < len && i < (int)sizeof(id); i++)
+        {
+            h ^= (unsigned char)id[i];
+            h *= 16777619u;
+        }
+    }
+    return h;
+}
+
+// Function to get the path of a journal
+static void journal_path(char *path, size_t size, uint64_t journal)
+{
+    snprintf(path, size, "%s/%s.%llu", meta_dir, JOURNAL_NAME, (unsigned long long)journal);
+}
+
+// Function to load the saved index: the snapshot, then the journals written after it
+// There are several journals when S1 stopped while writing a snapshot, or could not write one. A
+// journal whose last record was cut off by a crash is truncated after its last whole record.
+// Returns 1 if the index was restored, 0 if there is none or the snapshot is damaged.
+static int restore_index(void)
+{
+    char path[sizeof(meta_dir) + META_NAME_MAX];
+    size_t len, used;
+
+    snprintf(path, sizeof(path), "%s/%s", meta_dir, SNAPSHOT_NAME);
+    char *data = map_file(path, &len);
+    if (data == NULL)
+    {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&ns_lock);
+    struct ns_snapshot_header hdr;
+    int ok = (len >= sizeof(hdr));
+    if (ok)
+    {
+        memcpy(&hdr, data, sizeof(hdr));
+        begin_bulk_load();
+        ok = (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) == 0 && hdr.layout == server_layout() &&
+              apply_records(data + sizeof(hdr), len - sizeof(hdr), &used) == hdr.records &&
+              used == len - sizeof(hdr));
+        end_bulk_load();
+    }
+    munmap(data, len);
+    if (!ok)
+    {
+        clear_index();
+        pthread_rwlock_unlock(&ns_lock);
+        return 0;
+    }
+    for (int server = 0; server < DFS_MAX_NODES; server++)
+    {
+        __atomic_store_n(&complete[server], (hdr.complete >> server) & 1, __ATOMIC_RELEASE);
+    }
+
+    saved_journal = journal_id = hdr.journal;
+    while (1)
+    {
+        journal_path(path, sizeof(path), journal_id);
+        data = map_file(path, &len);
+        if (data != NULL)
+        {
+            apply_records(data, len, &used);
+            munmap(data, len);
+            if (used < len)
+            {
+                truncate(path, used);
+            }
+        }
+        journal_path(path, sizeof(path), journal_id + 1);
+        if (access(path, F_OK) < 0)
+        {
+            break;
+        }
+        journal_id++;
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return 1;
+}
+
+// Function to stop saving the index after the journal could not be written
+// The saved files are removed, since they miss changes; the next start rebuilds the index.
+static void drop_saved_index(void)
+{
+    char path[sizeof(meta_dir) + META_NAME_MAX];
+
+    fprintf(stderr, "WARNING: Cannot write the namespace journal, the index is no longer saved\n");
+    close(journal_fd);
+    journal_fd = -1;
+    snprintf(path, sizeof(path), "%s/%s", meta_dir, SNAPSHOT_NAME);
+    unlink(path);
+    for (uint64_t journal = saved_journal; journal <= journal_id; journal++)
+    {
+        journal_path(path, sizeof(path), journal);
+        unlink(path);
+    }
+}
+
+// Function to remove every journal in the metadata directory
+// Used when the index starts empty, so journals left by an earlier run are not replayed later.
+static void remove_journals(void)
+{
+    DIR *dir = opendir(meta_dir);
+    if (dir == NULL)
+    {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strncmp(ent->d_name, JOURNAL_NAME, strlen(JOURNAL_NAME)) == 0)
+        {
+            unlinkat(dirfd(dir), ent->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+// Function to append a change to the journal, with the index locked for writing
+// Once the journal has grown past NS_JOURNAL_COMPACT bytes the compaction thread is woken up.
+static void journal_append(uint8_t type, const char *path, const struct ns_file *file)
+{
+    if (journal_fd < 0)
+    {
+        return;
+    }
+
+    char buf[sizeof(struct ns_record) + PATH_MAX + 8];
+    size_t path_len = strlen(path);
+    if (path_len == 0 || path_len >= PATH_MAX)
+    {
+        return;
+    }
+    size_t len = encode_record(buf, type, path, path_len, file);
+    if (dfs_write_full(journal_fd, buf, len) < 0)
+    {
+        drop_saved_index();
+        return;
+    }
+
+    journal_bytes += len;
+    if (journal_bytes > NS_JOURNAL_COMPACT)
+    {
+        pthread_mutex_lock(&compact_lock);
+        compact_wanted = 1;
+        pthread_cond_signal(&compact_cond);
+        pthread_mutex_unlock(&compact_lock);
+    }
+}
+
+// Function run by the thread writing a snapshot whenever the journal has grown too big
+static void *compact_journal(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&compact_lock);
+        while (!compact_wanted)
+        {
+            pthread_cond_wait(&compact_cond, &compact_lock);
+        }
+        compact_wanted = 0;
+        pthread_mutex_unlock(&compact_lock);
+
+        ns_snapshot();
+    }
+    return NULL;
+}
+
+// Function to start saving the index
+int ns_open(const char *dir, int restore)
+{
+    if (strlen(dir) + 1 + sizeof(SNAPSHOT_NAME ".tmp") > sizeof(meta_dir))
+    {
+        return -1;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+    strcpy(meta_dir, dir);
+
+    int restored = restore ? restore_index() : 0;
+
+    // Without a restored snapshot the journal is meaningless, and a stale snapshot must not come
+    // back if S1 stops before writing a new one
+    char path[sizeof(meta_dir) + META_NAME_MAX];
+    if (!restored)
+    {
+        snprintf(path, sizeof(path), "%s/%s", meta_dir, SNAPSHOT_NAME);
+        unlink(path);
+        remove_journals();
+        saved_journal = journal_id = 0;
+    }
+    journal_path(path, sizeof(path), journal_id);
+    journal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (restored ? 0 : O_TRUNC), 0644);
+    if (journal_fd < 0)
+    {
+        meta_dir[0] = '\0';
+        return -1;
+    }
+    struct stat st;
+    journal_bytes = (fstat(journal_fd, &st) == 0) ? st.st_size : 0;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compact_journal, NULL) == 0)
+    {
+        pthread_detach(thread);
+    }
+    return restored;
+}
+
+// Function to write the records of a directory's entries to a snapshot
+// path holds the directory's path and has room for PATH_MAX bytes. *records counts the records.
+static int write_tree(const struct ns_node *dir, char *path, size_t len, FILE *out, uint64_t *records)
+{
+    char buf[sizeof(struct ns_record) + PATH_MAX + 8];
+
+    for (size_t i = 0; i < dir->dir.count; i++)
+    {
+        const struct ns_node *child = dir->dir.entries[i];
+        if (len + 1 + child->name_len >= PATH_MAX)
+        {
+            continue;
+        }
+        size_t child_len = len + 1 + child->name_len;
+        path[len] = '/';
+        memcpy(path + len + 1, child->name, child->name_len);
+
+        size_t rec_len = encode_record(buf, child->is_dir ? REC_DIR : REC_FILE, path, child_len,
+                                       child->is_dir ? NULL : &child->file);
+        if (fwrite(buf, 1, rec_len, out) != rec_len)
+        {
+            return -1;
+        }
+        (*records)++;
+        if (child->is_dir && write_tree(child, path, child_len, out, records) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to save the whole index
+// The snapshot is written under a temporary name and renamed over the old one once it is on disk,
+// so a crash leaves either the old snapshot and its journals or the new snapshot and its journal.
+int ns_snapshot(void)
+{
+    if (meta_dir[0] == '\0')
+    {
+        return -1;
+    }
+
+    char tmp[sizeof(meta_dir) + META_NAME_MAX], path[sizeof(meta_dir) + META_NAME_MAX];
+    char journal[sizeof(meta_dir) + META_NAME_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/%s.tmp", meta_dir, SNAPSHOT_NAME);
+    snprintf(path, sizeof(path), "%s/%s", meta_dir, SNAPSHOT_NAME);
+
+    pthread_mutex_lock(&snapshot_lock);
+    char *image = NULL;
+    size_t image_len = 0;
+    FILE *out = open_memstream(&image, &image_len);
+    if (out == NULL)
+    {
+        pthread_mutex_unlock(&snapshot_lock);
+        return -1;
+    }
+
+    // Copy the index and start the journal of the changes after the copy
+    pthread_rwlock_rdlock(&ns_lock);
+    int ret = -1;
+    uint64_t old_journal = journal_id;
+    struct ns_snapshot_header hdr = { .layout = server_layout(), .records = 0, .journal = journal_id + 1 };
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    if (journal_fd >= 0)
+    {
+        for (int server = 0; server < DFS_MAX_NODES; server++)
+        {
+            hdr.complete |= (uint32_t)complete[server] << server;
+        }
+
+        char name[PATH_MAX];
+        ret = (fwrite(&hdr, sizeof(hdr), 1, out) == 1 && write_tree(&root_node, name, 0, out, &hdr.records) == 0 &&
+               fflush(out) == 0) ? 0 : -1;
+    }
+    if (ret == 0)
+    {
+        journal_path(journal, sizeof(journal), hdr.journal);
+        int fd = open(journal, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | O_TRUNC, 0644);
+        if (fd >= 0)
+        {
+            close(journal_fd);
+            journal_fd = fd;
+            journal_id = hdr.journal;
+            journal_bytes = 0;
+        }
+        else
+        {
+            ret = -1;
+        }
+    }
+    pthread_rwlock_unlock(&ns_lock);
+
+    if (fclose(out) != 0)
+    {
+        ret = -1;
+    }
+    if (ret == 0)
+    {
+        // The header goes in again now that the records are counted
+        memcpy(image, &hdr, sizeof(hdr));
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ret = (fd >= 0 && dfs_write_full(fd, image, image_len) == 0 && fsync(fd) == 0) ? 0 : -1;
+        if (fd >= 0 && close(fd) != 0)
+        {
+            ret = -1;
+        }
+        if (ret == 0 && rename(tmp, path) == 0)
+        {
+            // Everything in the older journals is in the snapshot now
+            for (uint64_t old = saved_journal; old <= old_journal; old++)
+            {
+                journal_path(journal, sizeof(journal), old);
+                unlink(journal);
+            }
+            saved_journal = hdr.journal;
+        }
+        else
+        {
+            unlink(tmp);
+            ret = -1;
+        }
+    }
+    free(image);
+    pthread_mutex_unlock(&snapshot_lock);
+    return ret;
+}
+
+// Function to walk a directory of S1's storage tree
+// path holds the directory, the part after root_len is its path in the index.
+static int scan_dir(char *path, size_t len, size_t root_len, const char *suffix, int server)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    size_t suffix_len = strlen(suffix);
+    struct dirent *ent;
+    int ret = 0;
+    while (ret == 0 && (ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        size_t name_len = strlen(ent->d_name);
+        struct stat st;
+        if (len + 1 + name_len >= PATH_MAX || fstatat(dirfd(dir), ent->d_name, &st, 0) < 0)
+        {
+            continue;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, ent->d_name, name_len + 1);
+
+        if (S_ISDIR(st.st_mode))
+        {
+            if (add_path(path + root_len, 1) == NULL)
+            {
+                ret = -1;
+            }
+            else
+            {
+                ret = scan_dir(path, len + 1 + name_len, root_len, suffix, server);
+            }
+        }
+        else if (S_ISREG(st.st_mode) && name_len >= suffix_len &&
+                 strcmp(ent->d_name + name_len - suffix_len, suffix) == 0)
+        {
+            struct ns_file file = { .servers = 1u << server, .size = st.st_size, .mtime = st.st_mtime };
+            ret = add_file_locked(path + root_len, &file);
+        }
+    }
+    path[len] = '\0';
+    closedir(dir);
+    return ret;
+}
+
+// Function to build the index of S1's own files
+int ns_scan(const char *root, const char *suffix, int server)
+{
+    char path[PATH_MAX];
+    size_t len = strlen(root);
+    if (len >= sizeof(path))
+    {
+        return -1;
+    }
+    memcpy(path, root, len + 1);
+
+    pthread_rwlock_wrlock(&ns_lock);
+    begin_bulk_load();
+    int ret = scan_dir(path, len, len, suffix, server);
+    end_bulk_load();
+    if (ret == 0)
+    {
+        __atomic_store_n(&complete[server], 1, __ATOMIC_RELEASE);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+// Function to add the file described by one manifest line, "<size> <mtime> <path>"
+static void add_manifest_line(char *line, int server)
+{
+    char *end;
+    long long size = strtoll(line, &end, 10);
+    if (end == line || *end != ' ')
+    {
+        return;
+    }
+    char *mtime_start = end + 1;
+    long long mtime = strtoll(mtime_start, &end, 10);
+    if (end == mtime_start || *end != ' ')
+    {
+        return;
+    }
+
+    struct ns_file file = { .servers = 1u << server, .size = (off_t)size, .mtime = (time_t)mtime };
+    add_copy_locked(end + 1, &file);
+}
+
+// Function to read a server's manifest into the index
+// Each DATA frame is added as one bulk load under one write lock, so lookups go on while the
+// manifest arrives.
+int ns_load_manifest(int server, int sock)
+{
+    size_t cap = DFS_CHUNK_SIZE + MANIFEST_LINE_MAX;
+    char *buf = malloc(cap);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+
+    size_t used = 0;
+    int status = -1;
+    struct dfs_header hdr;
+    while (dfs_recv_header(sock, &hdr) == 0 && hdr.opcode == DFS_OP_DATA)
+    {
+        uint64_t remaining = hdr.length;
+        int broken = 0;
+        while (remaining > 0)
+        {
+            size_t n = (remaining < DFS_CHUNK_SIZE) ? (size_t)remaining : DFS_CHUNK_SIZE;
+            if (dfs_read_full(sock, buf + used, n) < 0)
+            {
+                broken = 1;
+                break;
+            }
+            used += n;
+            remaining -= n;
+
+            // Add the complete lines, keep the start of the last one for the next read
+            char *line = buf, *nl;
+            pthread_rwlock_wrlock(&ns_lock);
+            begin_bulk_load();
+            while ((nl = memchr(line, '\n', used - (line - buf))) != NULL)
+            {
+                *nl = '\0';
+                add_manifest_line(line, server);
+                line = nl + 1;
+            }
+            end_bulk_load();
+            pthread_rwlock_unlock(&ns_lock);
+
+            used -= line - buf;
+            if (used >= MANIFEST_LINE_MAX)
+            {
+                used = 0; // No path is this long, drop the garbage
+            }
+            memmove(buf, line, used);
+        }
+        if (broken)
+        {
+            break;
+        }
+
+        if (hdr.flags & DFS_FLAG_END)
+        {
+            status = (int)hdr.status;
+            break;
+        }
+    }
+    free(buf);
+
+    if (status == DFS_OK)
+    {
+        pthread_rwlock_wrlock(&ns_lock);
+        __atomic_store_n(&complete[server], 1, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&ns_lock);
+    }
+    return status;
+}
+
+// Function to send the manifest of a storage server
+// One "<size> <mtime> <path>" line per file, path relative to root. The lines are gathered into
+// DATA frames of up to DFS_CHUNK_SIZE bytes.
+int ns_manifest_reply(struct dfs_request *req, const char *root, const char *suffix)
+{
+    struct tar_list list;
+    if (tar_collect(&list, root, suffix, 0) < 0)
+    {
+        tar_free(&list);
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to list files");
+        return -1;
+    }
+
+    char *chunk = malloc(DFS_CHUNK_SIZE);
+    if (chunk == NULL)
+    {
+        tar_free(&list);
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to list files");
+        return -1;
+    }
+
+    int ret = dfs_reply_begin(req, -1);
+    size_t used = 0;
+    for (size_t i = 0; ret == 0 && i < list.count; i++)
+    {
+        const struct tar_entry *e = &list.entries[i];
+        if (strchr(e->name, '\n') != NULL)
+        {
+            continue; // Cannot be told apart from the next line
+        }
+
+        char line[MANIFEST_LINE_MAX];
+        int n = snprintf(line, sizeof(line), "%lld %lld /%s\n", (long long)e->size, (long long)e->mtime, e->name);
+        if (n < 0 || (size_t)n >= sizeof(line))
+        {
+            continue;
+        }
+        if (used + n > DFS_CHUNK_SIZE)
+        {
+            ret = dfs_reply_data(req, chunk, used);
+            used = 0;
+        }
+        memcpy(chunk + used, line, n);
+        used += n;
+    }
+    if (ret == 0 && used > 0)
+    {
+        ret = dfs_reply_data(req, chunk, used);
+    }
+    if (ret == 0)
+    {
+        ret = dfs_reply_end(req, DFS_OK);
+    }
+    free(chunk);
+    tar_free(&list);
+    return ret;
+}
+
+// Function to tell whether the index holds every file of a server
+int ns_complete(int server)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    int ret = complete[server];
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+// Function to record a directory
+int ns_add_dir(const char *path)
+{
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = (add_path(path, 1) != NULL) ? 0 : -1;
+    if (ret == 0)
+    {
+        journal_append(REC_DIR, path, NULL);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+// Function to record a file
+int ns_add_file(const char *path, const struct ns_file *file)
+{
+    pthread_rwlock_wrlock(&ns_lock);
+    int ret = add_file_locked(path, file);
+    if (ret == 0)
+    {
+        journal_append(REC_FILE, path, file);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+// Function to forget a file
+// Directories stay, as they do on disk.
+void ns_remove_file(const char *path)
+{
+    pthread_rwlock_wrlock(&ns_lock);
+    struct ns_node *node = find_path(path);
+    if (node != NULL && !node->is_dir)
+    {
+        remove_node(node);
+        journal_append(REC_REMOVE, path, NULL);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+}
+
+// Function to tell whether a file of some servers may be in the index, without locking it
+int ns_may_exist(const char *path, unsigned int servers)
+{
+    for (int server = 0; server < dfs_num_nodes; server++)
+    {
+        if ((servers & (1u << server)) && !__atomic_load_n(&complete[server], __ATOMIC_ACQUIRE))
+        {
+            return 1;
+        }
+    }
+
+    uint64_t h = hash_path(path);
+    int ret = 0;
+    __atomic_add_fetch(&filter_readers, 1, __ATOMIC_SEQ_CST);
+    for (int server = 0; !ret && server < dfs_num_nodes; server++)
+    {
+        const struct ns_filter *filter = __atomic_load_n(&filters[server], __ATOMIC_SEQ_CST);
+        ret = (servers & (1u << server)) && (filter == NULL || filter_test(filter, h));
+    }
+    __atomic_sub_fetch(&filter_readers, 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+// Function to hash a path the same way whatever its spelling
+uint64_t ns_hash_path(const char *path)
+{
+    return mix_hash(hash_path(path));
+}
+
+// Function to look a file up
+int ns_lookup(const char *path, struct ns_file *file)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    struct ns_node *node = find_path(path);
+    int found = (node != NULL && !node->is_dir);
+    if (found)
+    {
+        *file = node->file;
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return found;
+}
+
+// Function to find the part of a listing's cursor below the listed directory
+const char *ns_cursor_below(const char *dir, const char *after)
+{
+    const char *comp, *after_comp;
+    size_t len, after_len;
+
+    while ((comp = next_component(&dir, &len)) != NULL)
+    {
+        after_comp = next_component(&after, &after_len);
+        if (after_comp == NULL || after_len != len || memcmp(comp, after_comp, len) != 0)
+        {
+            return NULL;
+        }
+    }
+    return after;
+}
+
+// Function to parse the limit argument of a dispfnames request
+int ns_parse_limit(const char *arg, size_t *limit)
+{
+    if (arg == NULL)
+    {
+        *limit = SIZE_MAX;
+        return 0;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0' || arg[0] == '-' || errno != 0)
+    {
+        return -1;
+    }
+    *limit = (n == 0 || n > SIZE_MAX) ? SIZE_MAX : (size_t)n;
+    return 0;
+}
+
+// Function to compare two names in listing order
+// A walk visiting the entries of each directory sorted by name lists the paths in byte order with
+// '/' counted as lower than any other byte, since a directory's name then sorts before a longer
+// name it starts.
+int ns_compare_names(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    size_t n = (a_len < b_len) ? a_len : b_len;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (a[i] != b[i])
+        {
+            int x = (a[i] == '/') ? -1 : (unsigned char)a[i];
+            int y = (b[i] == '/') ? -1 : (unsigned char)b[i];
+            return (x > y) - (x < y);
+        }
+    }
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+// Function to tell whether a directory is in the index
+int ns_is_dir(const char *path)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    struct ns_node *node = find_path(path);
+    int ret = (node != NULL && node->is_dir);
+    pthread_rwlock_unlock(&ns_lock);
+    return ret;
+}
+
+// Function to list the files of some servers below a directory, after the part of a cursor below it
+// path holds the "~S1/..." name of the directory. Returns 1 once the page is full, 0 at the end.
+static int list_dir(const struct ns_node *dir, unsigned int servers, const char *after, char *path, size_t len,
+                    struct ns_page *page)
+{
+    const char *comp = NULL;
+    size_t comp_len = 0, i = 0;
+    if (after != NULL && (comp = next_component(&after, &comp_len)) != NULL)
+    {
+        i = lower_bound(&dir->dir, comp, comp_len); // Entries before the cursor are skipped
+    }
+
+    for (; i < dir->dir.count; i++)
+    {
+        const struct ns_node *child = dir->dir.entries[i];
+        if (len + 2 + child->name_len >= PATH_MAX)
+        {
+            continue;
+        }
+        int at_cursor = (comp != NULL && compare_name(child, comp, comp_len) == 0);
+        size_t child_len = len + 1 + child->name_len;
+        path[len] = '/';
+        memcpy(path + len + 1, child->name, child->name_len);
+
+        if (child->is_dir)
+        {
+            if (list_dir(child, servers, at_cursor ? after : NULL, path, child_len, page))
+            {
+                return 1;
+            }
+        }
+        else if (!at_cursor && (servers & child->file.servers))
+        {
+            if (page->count == page->max || page->len + child_len + 1 > page->size)
+            {
+                return 1;
+            }
+            path[child_len] = '\n';
+            memcpy(page->buf + page->len, path, child_len + 1);
+            page->len += child_len + 1;
+            page->count++;
+        }
+    }
+    return 0;
+}
+
+// Function to list a page of the files below a directory
+// The page is filled with the index locked for reading and sent by the caller after it is unlocked,
+// so a slow client does not hold up updates.
+int ns_list(const char *path, unsigned int servers, const char *after, char *buf, size_t size, size_t *len,
+            size_t max, int *more)
+{
+    char name[PATH_MAX];
+    size_t name_len = snprintf(name, sizeof(name), "~S1");
+
+    // The directory's name as listed, with its components normalised
+    const char *p = path, *comp;
+    size_t comp_len;
+    while ((comp = next_component(&p, &comp_len)) != NULL)
+    {
+        if (name_len + 1 + comp_len >= sizeof(name))
+        {
+            return -1;
+        }
+        name[name_len] = '/';
+        memcpy(name + name_len + 1, comp, comp_len);
+        name_len += 1 + comp_len;
+    }
+    if (after != NULL && (after = ns_cursor_below(path, after)) == NULL)
+    {
+        return -1;
+    }
+
+    struct ns_page page = { buf, size, 0, 0, max };
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&ns_lock);
+    struct ns_node *dir = find_path(path);
+    if (dir == NULL || !dir->is_dir)
+    {
+        ret = -1;
+    }
+    else
+    {
+        *more = list_dir(dir, servers, after, name, name_len, &page);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+
+    *len = page.len;
+    return (ret < 0) ? -1 : (int)page.count;
+}
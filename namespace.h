@@ -0,0 +1,124 @@
+// Distributed File System - Namespace Index
+// S1's in-memory view of every stored file: its path below ~S1, the servers holding a copy of it, its
+// size and modification time, and the directories S1 has created. Used by S1 to answer dispfnames and to
+// check that a file exists before downloading or removing it, without touching the disk or asking
+// the storage servers.
+//
+// The index is built at startup from S1's own directory tree and from a manifest each instance of
+// S2, S3 and S4 sends on request, and is then kept current by S1's upload and remove handlers,
+// through which every change to the stored files passes. A server instance whose manifest could not
+// be loaded yet is marked incomplete; S1 then asks that instance itself, as it did before there was
+// an index. Servers are named by their entry in dfs_servers.
+//
+// The index is saved in a metadata directory so a restart does not have to rebuild it. Every change
+// made through ns_add_dir(), ns_add_file() and ns_remove_file() is appended to a journal there, and
+// from time to time the whole index is written to a compact snapshot and a new journal started. On
+// startup the snapshot is mapped into memory and the journals written after it replayed over it.
+//
+// Paths are relative to the storage directory, as in "/folder1/test1.c" (the part after ~S1).
+// Directories are kept in a tree and children are found through one hash table keyed by parent
+// and name, so lookups cost one probe per path component. In front of the tree a Bloom filter per
+// server rules out most paths that are not stored there without taking the index's lock.
+
+#ifndef NAMESPACE_H
+#define NAMESPACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "config.h"
+#include "protocol.h"
+
+#define NS_JOURNAL_COMPACT (64 * 1024 * 1024) // Journal size at which a new snapshot is written
+
+// A file in the index
+struct ns_file
+{
+    unsigned int servers; // Server instances storing a copy, a bit for each entry in dfs_servers
+    off_t size;
+    time_t mtime;
+};
+
+// Saves the index in dir, creating it if needed. With restore set, the index saved there by the last
+// run is loaded first. Returns 1 if an index was restored, 0 if it starts empty, or -1 if dir cannot
+// be used; the index is then not saved.
+int ns_open(const char *dir, int restore);
+
+// Writes the whole index to the snapshot and starts a new journal. ns_scan() and ns_load_manifest()
+// do not write to the journal, so this is called after them. Returns -1 if the index is not saved.
+int ns_snapshot(void);
+
+// Adds the directories and the files whose names end in suffix below root, S1's storage
+// directory, as files of server, which is then complete. Returns -1 if memory runs out.
+int ns_scan(const char *root, const char *suffix, int server);
+
+// Reads the manifest body a server sends in reply to DFS_OP_MANIFEST from sock into the index, as
+// copies of the files on server next to those of other servers. The server is complete once the
+// whole manifest has arrived. Returns the status of the final
+// frame, or -1 if the stream broke.
+int ns_load_manifest(int server, int sock);
+
+// Answers a DFS_OP_MANIFEST request with the files below root whose names end in suffix (storage
+// server side)
+int ns_manifest_reply(struct dfs_request *req, const char *root, const char *suffix);
+
+// Tells whether the index holds every file of server
+int ns_complete(int server);
+
+// Records a directory and its parents. Returns -1 if a file is in the way or memory runs out.
+int ns_add_dir(const char *path);
+
+// Records a new or replaced file and its parent directories. Returns -1 if a directory is in the
+// way or memory runs out.
+int ns_add_file(const char *path, const struct ns_file *file);
+
+// Forgets a file
+void ns_remove_file(const char *path);
+
+// Tells whether a file of the servers with a bit set in servers may be in the index: 0 only if the
+// index holds every file of those servers and their filters rule path out. Never blocks, whatever
+// updates are running.
+int ns_may_exist(const char *path, unsigned int servers);
+
+// Hashes a path, giving the same hash for every spelling of it ("/a//./b" and "/a/b")
+uint64_t ns_hash_path(const char *path);
+
+// Looks a file up. Returns 1 and fills *file if it exists, 0 if not.
+int ns_lookup(const char *path, struct ns_file *file);
+
+// dispfnames arguments are the directory, optionally the most names to list (0 for all of them) and
+// then a cursor, the last name of a previous listing, after which this one continues. Files are
+// listed S1's first, then those of S2, S3 and S4; each server's in the order of a walk of the tree
+// that visits the entries of a directory sorted by name. A listing that stops at its limit may have
+// more names after it. An optional fourth argument, NS_ORDER_NAME or NS_ORDER_ARRIVAL, asks S1 to
+// merge the servers' files into one walk of the tree or to pass them on as they arrive instead of
+// listing them by type (NS_ORDER_TYPE); the cursor is then an empty string if there is none, and
+// cannot be used with NS_ORDER_ARRIVAL.
+#define NS_ORDER_TYPE "type"
+#define NS_ORDER_NAME "name"
+#define NS_ORDER_ARRIVAL "arrival"
+
+// Parses the limit argument of a dispfnames request. NULL and 0 give SIZE_MAX (no limit).
+// Returns -1 if the argument is not a number.
+int ns_parse_limit(const char *arg, size_t *limit);
+
+// Finds the part of a listing's cursor after, a path like dir's, that lies below the directory dir.
+// Returns NULL if after does not name something below dir.
+const char *ns_cursor_below(const char *dir, const char *after);
+
+// Compares two "~S1/..." names of a listing, a_len and b_len bytes long, in listing order
+int ns_compare_names(const char *a, size_t a_len, const char *b, size_t b_len);
+
+// Tells whether a directory is in the index
+int ns_is_dir(const char *path);
+
+// Lists the files of the servers with a bit set in servers below the directory path as "~S1/<path>" lines into buf, starting after
+// the cursor after (NULL for the start). Stops when max names are listed or the next one does not
+// fit in size bytes, and then sets *more; *len is the number of bytes used. Returns the number of
+// names listed, or -1 if path is not a directory or after is not below it.
+int ns_list(const char *path, unsigned int servers, const char *after, char *buf, size_t size, size_t *len,
+            size_t max, int *more);
+
+#endif
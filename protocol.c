@@ -0,0 +1,849 @@
+// Distributed File System - Framed Wire Protocol Implementation
+// Frame encoding, reliable socket I/O and reply helpers shared by all programs.
+
+#define _GNU_SOURCE // for splice()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h> // for poll()
+#include <endian.h> // for htobe64()
+#include <arpa/inet.h> // for htonl()
+#include <sys/uio.h> // for writev()
+#include <sys/socket.h> // for shutdown()
+#include <sys/sendfile.h> // for sendfile()
+#include <fcntl.h> // for splice()
+#include <netinet/in.h> // for IPPROTO_TCP
+#include <netinet/tcp.h> // for TCP_CORK
+
+#include "protocol.h"
+
+// Pipe each thread moves relayed data through with splice(), created on first use
+static __thread int relay_pipe[2] = { -1, -1 };
+
+// Command names of the text protocol, indexed by opcode
+static const char *const command_names[] = {
+    [DFS_OP_UPLOADF] = "uploadf",
+    [DFS_OP_DOWNLF] = "downlf",
+    [DFS_OP_REMOVEF] = "removef",
+    [DFS_OP_DOWNLTAR] = "downltar",
+    [DFS_OP_DISPFNAMES] = "dispfnames",
+    [DFS_OP_EXIT] = "exit",
+};
+
+// Function to encode a frame header into its 20-byte wire format
+void dfs_encode_header(const struct dfs_header *hdr, unsigned char *buf)
+{
+    uint16_t magic = htons(hdr->magic);
+    uint32_t id = htonl(hdr->request_id);
+    uint32_t status = htonl(hdr->status);
+    uint64_t length = htobe64(hdr->length);
+
+    memcpy(buf, &magic, 2);
+    buf[2] = hdr->opcode;
+    buf[3] = hdr->flags;
+    memcpy(buf + 4, &id, 4);
+    memcpy(buf + 8, &status, 4);
+    memcpy(buf + 12, &length, 8);
+}
+
+// Function to decode a frame header
+// Returns -1 if the buffer does not start with the frame magic.
+int dfs_decode_header(const unsigned char *buf, struct dfs_header *hdr)
+{
+    uint16_t magic;
+    uint32_t id, status;
+    uint64_t length;
+
+    memcpy(&magic, buf, 2);
+    memcpy(&id, buf + 4, 4);
+    memcpy(&status, buf + 8, 4);
+    memcpy(&length, buf + 12, 8);
+
+    hdr->magic = ntohs(magic);
+    hdr->opcode = buf[2];
+    hdr->flags = buf[3];
+    hdr->request_id = ntohl(id);
+    hdr->status = ntohl(status);
+    hdr->length = be64toh(length);
+
+    return (hdr->magic == DFS_MAGIC) ? 0 : -1;
+}
+
+// Function to tell whether received bytes start a frame rather than a text command
+int dfs_is_frame(const void *buf, size_t len)
+{
+    return len > 0 && ((const unsigned char *)buf)[0] == (DFS_MAGIC >> 8);
+}
+
+// Function to wait until a non-blocking descriptor is ready again
+static int wait_ready(int fd, short events)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int n;
+
+    do
+    {
+        n = poll(&pfd, 1, -1);
+    } while (n < 0 && errno == EINTR);
+
+    return (n < 0) ? -1 : 0;
+}
+
+// Function to read exactly len bytes
+// Returns 0 on success, -1 on error or if the peer closed the connection first.
+int dfs_read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n > 0)
+        {
+            p += n;
+            len -= n;
+        }
+        else if (n == 0)
+        {
+            return -1;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            if (wait_ready(fd, POLLIN) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to write exactly len bytes
+int dfs_write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n > 0)
+        {
+            p += n;
+            len -= n;
+        }
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (wait_ready(fd, POLLOUT) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (n < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to read and drop len bytes
+int dfs_skip(int fd, uint64_t len)
+{
+    char buf[4096];
+
+    while (len > 0)
+    {
+        size_t chunk = (len < sizeof(buf)) ? len : sizeof(buf);
+        if (dfs_read_full(fd, buf, chunk) < 0)
+        {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to send a frame
+// Header and payload go out in a single writev() call when the socket accepts them.
+int dfs_send_frame(int fd, uint8_t opcode, uint8_t flags, uint32_t id, uint32_t status,
+                   const void *payload, uint64_t len)
+{
+    unsigned char buf[DFS_HEADER_SIZE];
+    struct dfs_header hdr = {
+        .magic = DFS_MAGIC, .opcode = opcode, .flags = flags,
+        .request_id = id, .status = status, .length = len
+    };
+    dfs_encode_header(&hdr, buf);
+
+    struct iovec iov[2] = {
+        { .iov_base = buf, .iov_len = DFS_HEADER_SIZE },
+        { .iov_base = (void *)payload, .iov_len = len }
+    };
+
+    ssize_t n;
+    do
+    {
+        n = writev(fd, iov, (len > 0) ? 2 : 1);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            return -1;
+        }
+        n = 0;
+    }
+
+    // Finish whatever the socket did not take in one go
+    if ((size_t)n < DFS_HEADER_SIZE)
+    {
+        if (dfs_write_full(fd, buf + n, DFS_HEADER_SIZE - n) < 0)
+        {
+            return -1;
+        }
+        n = DFS_HEADER_SIZE;
+    }
+    size_t sent = n - DFS_HEADER_SIZE;
+    return dfs_write_full(fd, (const char *)payload + sent, len - sent);
+}
+
+// Function to receive a frame header
+// Returns -1 on EOF, error or a corrupt header.
+int dfs_recv_header(int fd, struct dfs_header *hdr)
+{
+    unsigned char buf[DFS_HEADER_SIZE];
+
+    if (dfs_read_full(fd, buf, DFS_HEADER_SIZE) < 0)
+    {
+        return -1;
+    }
+    return dfs_decode_header(buf, hdr);
+}
+
+// Function to send a request frame
+// The arguments are packed as consecutive NUL-terminated strings.
+int dfs_send_request(int fd, uint8_t opcode, uint32_t id, const char *const args[], int nargs)
+{
+    char payload[DFS_MAX_REQUEST_LEN];
+    size_t len = 0;
+
+    for (int i = 0; i < nargs; i++)
+    {
+        size_t arg_len = strlen(args[i]) + 1;
+        if (len + arg_len > sizeof(payload))
+        {
+            errno = E2BIG;
+            return -1;
+        }
+        memcpy(payload + len, args[i], arg_len);
+        len += arg_len;
+    }
+
+    return dfs_send_frame(fd, opcode, 0, id, DFS_OK, payload, len);
+}
+
+// Function to split a request payload into its arguments
+// Returns the number of arguments found, at most max_args.
+int dfs_split_args(char *payload, size_t len, char *args[], int max_args)
+{
+    int nargs = 0;
+    size_t pos = 0;
+
+    while (pos < len && nargs < max_args)
+    {
+        char *end = memchr(payload + pos, '\0', len - pos);
+        if (end == NULL)
+        {
+            break; // Unterminated argument
+        }
+        args[nargs++] = payload + pos;
+        pos = (end - payload) + 1;
+    }
+    return nargs;
+}
+
+// Function to receive the STATUS frame answering a request
+// Copies the message into msg (truncated to msg_size) and the announced body size into size.
+int dfs_recv_status(int fd, struct dfs_header *hdr, char *msg, size_t msg_size, int64_t *size)
+{
+    if (dfs_recv_header(fd, hdr) < 0 || hdr->opcode != DFS_OP_STATUS)
+    {
+        return -1;
+    }
+
+    if (size != NULL)
+    {
+        *size = -1;
+    }
+
+    if (hdr->flags & DFS_FLAG_SIZE)
+    {
+        uint64_t be_size;
+        if (hdr->length != sizeof(be_size) || dfs_read_full(fd, &be_size, sizeof(be_size)) < 0)
+        {
+            return -1;
+        }
+        if (size != NULL)
+        {
+            *size = (int64_t)be64toh(be_size);
+        }
+        if (msg_size > 0)
+        {
+            msg[0] = '\0';
+        }
+        return 0;
+    }
+
+    size_t keep = (hdr->length < msg_size) ? hdr->length : msg_size - 1;
+    if (dfs_read_full(fd, msg, keep) < 0 || dfs_skip(fd, hdr->length - keep) < 0)
+    {
+        return -1;
+    }
+    msg[keep] = '\0';
+    return 0;
+}
+
+// Function to receive the DATA frames of a body
+// Payload goes to out_fd if it is valid, otherwise into buf (up to buf_size - 1 bytes, the rest is
+// dropped and buf is NUL-terminated). Returns the status of the final frame, -1 on a broken stream.
+int dfs_recv_body(int fd, int out_fd, char *buf, size_t buf_size, size_t *buf_len)
+{
+    char chunk[DFS_CHUNK_SIZE];
+    struct dfs_header hdr;
+    size_t used = 0;
+    int failed = 0;
+
+    while (1)
+    {
+        if (dfs_recv_header(fd, &hdr) < 0 || hdr.opcode != DFS_OP_DATA)
+        {
+            return -1;
+        }
+
+        uint64_t remaining = hdr.length;
+        while (remaining > 0)
+        {
+            size_t n = (remaining < sizeof(chunk)) ? remaining : sizeof(chunk);
+            if (dfs_read_full(fd, chunk, n) < 0)
+            {
+                return -1;
+            }
+            if (out_fd >= 0)
+            {
+                if (dfs_write_full(out_fd, chunk, n) < 0)
+                {
+                    out_fd = -1; // Keep draining so the connection stays usable
+                    failed = 1;
+                }
+            }
+            else if (buf != NULL && used < buf_size - 1)
+            {
+                size_t keep = (n < buf_size - 1 - used) ? n : buf_size - 1 - used;
+                memcpy(buf + used, chunk, keep);
+                used += keep;
+            }
+            remaining -= n;
+        }
+
+        if (hdr.flags & DFS_FLAG_END)
+        {
+            break;
+        }
+    }
+
+    if (buf != NULL)
+    {
+        buf[used] = '\0';
+    }
+    if (buf_len != NULL)
+    {
+        *buf_len = used;
+    }
+    return failed ? DFS_ERR_IO : (int)hdr.status;
+}
+
+// Function to drop the DATA frames of a body
+int dfs_skip_body(int fd)
+{
+    return dfs_recv_body(fd, -1, NULL, 0, NULL);
+}
+
+// Function to map a text command name to its opcode
+// Returns -1 for unknown commands.
+int dfs_opcode_from_name(const char *name)
+{
+    for (size_t op = 0; op < sizeof(command_names) / sizeof(command_names[0]); op++)
+    {
+        if (command_names[op] != NULL && strcmp(command_names[op], name) == 0)
+        {
+            return (int)op;
+        }
+    }
+    return -1;
+}
+
+// Function to tell whether a successful reply to this request carries a body
+int dfs_has_body(uint8_t opcode)
+{
+    return opcode == DFS_OP_DOWNLF || opcode == DFS_OP_DOWNLTAR || opcode == DFS_OP_DISPFNAMES ||
+           opcode == DFS_OP_MANIFEST;
+}
+
+// Function to check a path argument names a place below ~S1
+// The servers map it into their storage directory by dropping the "~S1", so anything else, and a
+// ".." part climbing out of that directory, is refused.
+int dfs_valid_path(const char *path)
+{
+    if (strncmp(path, "~S1", 3) != 0 || (path[3] != '/' && path[3] != '\0'))
+    {
+        return 0;
+    }
+    for (const char *part = path + 3; *part != '\0'; part++)
+    {
+        if (part[-1] == '/' && part[0] == '.' && part[1] == '.' && (part[2] == '/' || part[2] == '\0'))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to take the right to write a reply frame to the request's connection
+// Frames of concurrent requests may interleave, but a frame itself must go out in one piece.
+static void lock_writes(struct dfs_request *req)
+{
+    if (req->write_lock != NULL)
+    {
+        pthread_mutex_lock(req->write_lock);
+    }
+}
+
+// Function to let other requests write to the connection again
+static void unlock_writes(struct dfs_request *req)
+{
+    if (req->write_lock != NULL)
+    {
+        pthread_mutex_unlock(req->write_lock);
+    }
+}
+
+// Function to send a reply frame while holding the connection's write lock
+static int reply_frame(struct dfs_request *req, uint8_t opcode, uint8_t flags, uint32_t status,
+                       const void *payload, uint64_t len)
+{
+    lock_writes(req);
+    int ret = dfs_send_frame(req->sock, opcode, flags, req->id, status, payload, len);
+    unlock_writes(req);
+    return ret;
+}
+
+// Function to answer a request with a status and a message
+// Text clients only receive the message, as before the framed protocol existed.
+int dfs_reply_status(struct dfs_request *req, uint32_t status, const char *msg)
+{
+    if (!req->framed)
+    {
+        return dfs_write_full(req->sock, msg, strlen(msg));
+    }
+    return reply_frame(req, DFS_OP_STATUS, 0, status, msg, strlen(msg));
+}
+
+// Function to start a successful reply that carries a body
+// size is the body size if known in advance, or -1. Text clients receive the raw off_t size
+// (only when it is known), which is what they expect in front of file data.
+int dfs_reply_begin(struct dfs_request *req, off_t size)
+{
+    if (!req->framed)
+    {
+        return (size >= 0) ? dfs_write_full(req->sock, &size, sizeof(off_t)) : 0;
+    }
+
+    if (size < 0)
+    {
+        return reply_frame(req, DFS_OP_STATUS, 0, DFS_OK, NULL, 0);
+    }
+    uint64_t be_size = htobe64((uint64_t)size);
+    return reply_frame(req, DFS_OP_STATUS, DFS_FLAG_SIZE, DFS_OK, &be_size, sizeof(be_size));
+}
+
+// Function to send a piece of a reply body
+int dfs_reply_data(struct dfs_request *req, const void *buf, size_t len)
+{
+    if (!req->framed)
+    {
+        return dfs_write_full(req->sock, buf, len);
+    }
+    return reply_frame(req, DFS_OP_DATA, 0, DFS_OK, buf, len);
+}
+
+// Function to send len bytes of a file as part of a reply body
+// The data goes from the file to the socket with sendfile(), one DATA frame per DFS_FILE_CHUNK_SIZE
+// so that other replies on the connection are not held up for the whole file. Where sendfile() is
+// not supported the chunks are copied with read() and write() instead. Once a frame header is out
+// its payload must follow, so a failure in the middle of a frame shuts the connection down.
+int dfs_reply_file(struct dfs_request *req, int fd, off_t len)
+{
+    unsigned char buf[DFS_HEADER_SIZE];
+    int copy = 0; // sendfile() not supported for this file, copy instead
+
+    while (len > 0)
+    {
+        size_t chunk = (len < DFS_FILE_CHUNK_SIZE) ? (size_t)len : DFS_FILE_CHUNK_SIZE;
+
+        lock_writes(req);
+        if (req->framed)
+        {
+            struct dfs_header hdr = {
+                .magic = DFS_MAGIC, .opcode = DFS_OP_DATA, .flags = 0,
+                .request_id = req->id, .status = DFS_OK, .length = chunk
+            };
+            dfs_encode_header(&hdr, buf);
+            if (dfs_write_full(req->sock, buf, DFS_HEADER_SIZE) < 0)
+            {
+                unlock_writes(req);
+                return -1;
+            }
+        }
+
+        while (chunk > 0)
+        {
+            ssize_t sent;
+            if (!copy)
+            {
+                sent = sendfile(req->sock, fd, NULL, chunk);
+                if (sent < 0 && (errno == EINVAL || errno == ENOSYS))
+                {
+                    copy = 1;
+                    continue;
+                }
+            }
+            else
+            {
+                char data[DFS_CHUNK_SIZE];
+                sent = read(fd, data, (chunk < sizeof(data)) ? chunk : sizeof(data));
+                if (sent > 0 && dfs_write_full(req->sock, data, sent) < 0)
+                {
+                    sent = -1;
+                }
+            }
+
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                if (wait_ready(req->sock, POLLOUT) == 0)
+                {
+                    continue;
+                }
+            }
+            else if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (sent <= 0)
+            {
+                shutdown(req->sock, SHUT_RDWR);
+                unlock_writes(req);
+                return -1;
+            }
+            chunk -= sent;
+            len -= sent;
+        }
+        unlock_writes(req);
+    }
+    return 0;
+}
+
+// Function to send a whole file as the body of a successful reply
+// The socket is corked for the duration, so the STATUS frame, the frame headers and the END frame
+// go out in full packets together with the file data instead of as tiny segments of their own.
+int dfs_reply_file_body(struct dfs_request *req, int fd, off_t size)
+{
+    int on = 1, off = 0;
+    setsockopt(req->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+
+    int ret = dfs_reply_begin(req, size);
+    if (ret == 0)
+    {
+        ret = dfs_reply_file(req, fd, size);
+    }
+    if (ret == 0)
+    {
+        ret = dfs_reply_end(req, DFS_OK);
+    }
+
+    // Uncorking flushes whatever is still held back
+    setsockopt(req->sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    return ret;
+}
+
+// Function to move len bytes from in_fd to out_fd through the thread's relay pipe
+// Returns 0 on success, -1 on failure, or 1 if splice() cannot be used on these descriptors and
+// nothing was moved.
+static int splice_through_pipe(int in_fd, int out_fd, uint64_t len)
+{
+    if (relay_pipe[0] < 0 && pipe2(relay_pipe, O_CLOEXEC) < 0)
+    {
+        return 1;
+    }
+
+    int moved = 0;
+    while (len > 0)
+    {
+        size_t chunk = (len < DFS_CHUNK_SIZE) ? (size_t)len : DFS_CHUNK_SIZE;
+        ssize_t n = splice(in_fd, NULL, relay_pipe[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(in_fd, POLLIN) == 0)
+        {
+            continue;
+        }
+        if (n < 0 && !moved && (errno == EINVAL || errno == ENOSYS))
+        {
+            return 1;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        moved = 1;
+
+        // Empty the pipe into the destination before taking more
+        size_t left = n;
+        while (left > 0)
+        {
+            ssize_t m = splice(relay_pipe[0], NULL, out_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(out_fd, POLLOUT) == 0)
+            {
+                continue;
+            }
+            if (m <= 0)
+            {
+                break;
+            }
+            left -= m;
+        }
+        if (left > 0)
+        {
+            break;
+        }
+        len -= n;
+    }
+
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    // Data may be stuck in the pipe, start the next relay on a fresh one
+    close(relay_pipe[0]);
+    close(relay_pipe[1]);
+    relay_pipe[0] = relay_pipe[1] = -1;
+    return -1;
+}
+
+// Function to pass len bytes read from in_fd on to the client as part of a reply body
+// Used to relay a body from another server. The bytes go from socket to socket with splice(), so
+// they never pass through a user-space buffer; read() and write() are the fallback where splice()
+// is not supported. The frame header is sent before the data, so a failure part way through leaves
+// the client unable to resync and its connection is shut down.
+int dfs_reply_relay(struct dfs_request *req, int in_fd, uint64_t len)
+{
+    lock_writes(req);
+    if (req->framed)
+    {
+        unsigned char buf[DFS_HEADER_SIZE];
+        struct dfs_header hdr = {
+            .magic = DFS_MAGIC, .opcode = DFS_OP_DATA, .flags = 0,
+            .request_id = req->id, .status = DFS_OK, .length = len
+        };
+        dfs_encode_header(&hdr, buf);
+        if (dfs_write_full(req->sock, buf, DFS_HEADER_SIZE) < 0)
+        {
+            unlock_writes(req);
+            return -1;
+        }
+    }
+
+    int ret = splice_through_pipe(in_fd, req->sock, len);
+    if (ret > 0)
+    {
+        char chunk[DFS_CHUNK_SIZE];
+        ret = 0;
+        while (len > 0)
+        {
+            size_t n = (len < sizeof(chunk)) ? (size_t)len : sizeof(chunk);
+            if (dfs_read_full(in_fd, chunk, n) < 0 || dfs_write_full(req->sock, chunk, n) < 0)
+            {
+                ret = -1;
+                break;
+            }
+            len -= n;
+        }
+    }
+
+    if (ret < 0)
+    {
+        shutdown(req->sock, SHUT_RDWR);
+    }
+    unlock_writes(req);
+    return ret;
+}
+
+// Function to finish a reply body
+// A non-zero status tells framed clients the body is incomplete. A text client cannot be told,
+// so its connection is shut down instead of leaving it out of sync.
+int dfs_reply_end(struct dfs_request *req, uint32_t status)
+{
+    if (!req->framed)
+    {
+        if (status != DFS_OK)
+        {
+            shutdown(req->sock, SHUT_RDWR);
+        }
+        return 0;
+    }
+    return reply_frame(req, DFS_OP_DATA, DFS_FLAG_END, status, NULL, 0);
+}
+
+// Function to pass a chunk of an upload on to every descriptor that has not failed yet
+static void pass_chunk(const int out_fds[], int nout, int forward, uint32_t out_id, int write_failed[],
+                       const char *chunk, size_t n)
+{
+    for (int i = 0; i < nout; i++)
+    {
+        if (out_fds[i] >= 0 && !write_failed[i] &&
+            (forward ? dfs_send_frame(out_fds[i], DFS_OP_DATA, 0, out_id, DFS_OK, chunk, n)
+                     : dfs_write_full(out_fds[i], chunk, n)) < 0)
+        {
+            write_failed[i] = 1;
+        }
+    }
+}
+
+// Function to receive the file data of an upload request and pass it to the nout descriptors out_fds
+// With forward set the data goes on as DATA frames of request out_id, finished by an END frame that
+// tells whether the whole file arrived; otherwise it is written to the descriptors as is. A
+// descriptor -1 discards the data. Text clients are first told READY and then send an off_t size
+// followed by the file. A failed write to out_fds[i] sets write_failed[i], but the upload is still
+// drained so the client's connection stays in sync. *len counts the bytes received. Returns 0 when
+// the whole file arrived, -1 otherwise.
+static int receive_upload(struct dfs_request *req, const int out_fds[], int nout, int forward, uint32_t out_id,
+                          int write_failed[], uint64_t *len)
+{
+    char chunk[DFS_CHUNK_SIZE];
+    int received = 0;
+    int broken = 0;
+
+    for (int i = 0; i < nout; i++)
+    {
+        write_failed[i] = 0;
+    }
+    *len = 0;
+    if (req->framed)
+    {
+        struct dfs_header hdr;
+        while (!broken)
+        {
+            if (dfs_recv_header(req->sock, &hdr) < 0 || hdr.opcode != DFS_OP_DATA)
+            {
+                broken = 1;
+                break;
+            }
+
+            uint64_t remaining = hdr.length;
+            while (remaining > 0)
+            {
+                size_t n = (remaining < sizeof(chunk)) ? remaining : sizeof(chunk);
+                if (dfs_read_full(req->sock, chunk, n) < 0)
+                {
+                    broken = 1;
+                    break;
+                }
+                *len += n;
+                pass_chunk(out_fds, nout, forward, out_id, write_failed, chunk, n);
+                remaining -= n;
+            }
+
+            if (!broken && (hdr.flags & DFS_FLAG_END))
+            {
+                received = (hdr.status == DFS_OK) ? 0 : -1;
+                break;
+            }
+        }
+    }
+    else
+    {
+        off_t size;
+        if (dfs_write_full(req->sock, "READY", 5) < 0 || dfs_read_full(req->sock, &size, sizeof(off_t)) < 0 || size < 0)
+        {
+            broken = 1;
+            size = 0;
+        }
+
+        while (size > 0)
+        {
+            size_t n = (size < (off_t)sizeof(chunk)) ? (size_t)size : sizeof(chunk);
+            if (dfs_read_full(req->sock, chunk, n) < 0)
+            {
+                broken = 1;
+                break;
+            }
+            *len += n;
+            pass_chunk(out_fds, nout, forward, out_id, write_failed, chunk, n);
+            size -= n;
+        }
+    }
+
+    if (broken)
+    {
+        // The client's stream cannot be resynchronised
+        shutdown(req->sock, SHUT_RDWR);
+        received = -1;
+    }
+
+    for (int i = 0; forward && i < nout; i++)
+    {
+        if (out_fds[i] >= 0 && !write_failed[i] &&
+            dfs_send_frame(out_fds[i], DFS_OP_DATA, DFS_FLAG_END, out_id, (received == 0) ? DFS_OK : DFS_ERR_IO, NULL, 0) < 0)
+        {
+            write_failed[i] = 1;
+        }
+    }
+    return received;
+}
+
+// Function to receive the file data of an upload request
+// Writes it to out_fd, or discards it when out_fd is -1 (a rejected upload must still be drained).
+// Returns 0 when the whole file was stored, -1 otherwise.
+int dfs_recv_upload(struct dfs_request *req, int out_fd)
+{
+    int write_failed;
+    uint64_t len;
+    int received = receive_upload(req, &out_fd, 1, 0, 0, &write_failed, &len);
+    return (received == 0 && out_fd >= 0 && !write_failed) ? 0 : -1;
+}
+
+// Function to pass the file data of an upload request on to other servers as it arrives
+// Each piece goes out to all nout of them as soon as it has been received, so no more than one chunk
+// is buffered and the slowest server slows down the client. The data is sent as DATA frames of
+// request out_id on out_fds. Returns 0 when the whole file arrived from the client, -1 otherwise;
+// out_failed[i] is set if out_fds[i] broke, which leaves that connection out of sync and the others
+// going. *len is set to the size of the file.
+int dfs_forward_upload(struct dfs_request *req, const int out_fds[], int nout, uint32_t out_id, int out_failed[],
+                       uint64_t *len)
+{
+    return receive_upload(req, out_fds, nout, 1, out_id, out_failed, len);
+}
@@ -0,0 +1,122 @@
+// Distributed File System - Framed Wire Protocol
+// Shared by the client (w25clients), the main server (S1) and the storage servers (S2, S3, S4).
+//
+// Every message is a frame: a fixed 20-byte header followed by `length` payload bytes.
+// All header fields are in network byte order:
+//
+//   magic (2) | opcode (1) | flags (1) | request id (4) | status (4) | payload length (8)
+//
+// A request frame carries its arguments as NUL-terminated strings. The server answers every
+// request with exactly one STATUS frame (status code, payload is a message). Requests that return
+// a body (downlf, downltar, dispfnames) follow a successful STATUS with DATA frames, the last of
+// which has DFS_FLAG_END set; its status field is non-zero if the body was cut short. An upload
+// sends its file as DATA frames right after the request frame, ending with DFS_FLAG_END.
+//
+// A client may pipeline requests without waiting for the replies. The server completes them in any
+// order and may interleave the frames of different replies; the request id tells them apart.
+//
+// The first byte of a frame (0xDF) can never start a text command, so servers detect the protocol
+// on each connection and keep serving the old space-separated text commands for compatibility.
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define DFS_MAGIC 0xDF53 // Frame marker, first byte 0xDF is not printable text
+#define DFS_HEADER_SIZE 20 // Size of an encoded frame header
+#define DFS_MAX_REQUEST_LEN 4096 // Largest accepted request frame payload (the arguments)
+#define DFS_CHUNK_SIZE 65536 // Payload size used when streaming file data
+#define DFS_FILE_CHUNK_SIZE (1024 * 1024) // Payload size of the DATA frames a file is sent in with sendfile()
+#define DFS_MAX_ARGS 8 // Most arguments a request may carry
+
+// Frame opcodes
+enum dfs_opcode
+{
+    DFS_OP_UPLOADF = 1,
+    DFS_OP_DOWNLF = 2,
+    DFS_OP_REMOVEF = 3,
+    DFS_OP_DOWNLTAR = 4,
+    DFS_OP_DISPFNAMES = 5,
+    DFS_OP_EXIT = 6,
+    DFS_OP_MANIFEST = 7, // Every file a storage server holds, asked for by S1 at startup
+    DFS_OP_STATUS = 0x40, // Reply to a request
+    DFS_OP_DATA = 0x41 // Chunk of a file, archive or listing
+};
+
+// Frame flags
+#define DFS_FLAG_END 0x01 // Last DATA frame of a body
+#define DFS_FLAG_SIZE 0x02 // STATUS payload is the 8-byte size of the body that follows
+
+// Status codes carried in STATUS frames and in the final DATA frame
+enum dfs_status
+{
+    DFS_OK = 0,
+    DFS_ERR_INVALID = 1, // Malformed request
+    DFS_ERR_NOT_FOUND = 2, // File or directory does not exist
+    DFS_ERR_UNSUPPORTED = 3, // File type not handled
+    DFS_ERR_IO = 4, // Local file system or transfer failure
+    DFS_ERR_UNAVAILABLE = 5 // Storage server could not be reached
+};
+
+// Decoded frame header
+struct dfs_header
+{
+    uint16_t magic;
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t request_id;
+    uint32_t status;
+    uint64_t length;
+};
+
+// A request being served and how its replies have to be encoded
+struct dfs_request
+{
+    int sock; // Connection the request arrived on
+    int framed; // 1 for framed requests, 0 for the text compatibility protocol
+    uint32_t id; // Request id, echoed in every reply frame
+    uint8_t opcode;
+    pthread_mutex_t *write_lock; // Held while a reply frame is written, NULL if the request is alone on sock
+};
+
+// Header encoding
+void dfs_encode_header(const struct dfs_header *hdr, unsigned char *buf);
+int dfs_decode_header(const unsigned char *buf, struct dfs_header *hdr);
+int dfs_is_frame(const void *buf, size_t len);
+
+// Reliable I/O on blocking or non-blocking descriptors
+int dfs_read_full(int fd, void *buf, size_t len);
+int dfs_write_full(int fd, const void *buf, size_t len);
+int dfs_skip(int fd, uint64_t len);
+
+// Frames
+int dfs_send_frame(int fd, uint8_t opcode, uint8_t flags, uint32_t id, uint32_t status,
+                   const void *payload, uint64_t len);
+int dfs_recv_header(int fd, struct dfs_header *hdr);
+int dfs_send_request(int fd, uint8_t opcode, uint32_t id, const char *const args[], int nargs);
+int dfs_split_args(char *payload, size_t len, char *args[], int max_args);
+int dfs_recv_status(int fd, struct dfs_header *hdr, char *msg, size_t msg_size, int64_t *size);
+int dfs_recv_body(int fd, int out_fd, char *buf, size_t buf_size, size_t *buf_len);
+int dfs_skip_body(int fd);
+
+// Command names used by the text protocol
+int dfs_opcode_from_name(const char *name);
+int dfs_has_body(uint8_t opcode);
+int dfs_valid_path(const char *path);
+
+// Replies to a request, encoded for the protocol the request arrived in
+int dfs_reply_status(struct dfs_request *req, uint32_t status, const char *msg);
+int dfs_reply_begin(struct dfs_request *req, off_t size);
+int dfs_reply_data(struct dfs_request *req, const void *buf, size_t len);
+int dfs_reply_file(struct dfs_request *req, int fd, off_t len);
+int dfs_reply_file_body(struct dfs_request *req, int fd, off_t size);
+int dfs_reply_relay(struct dfs_request *req, int in_fd, uint64_t len);
+int dfs_reply_end(struct dfs_request *req, uint32_t status);
+int dfs_recv_upload(struct dfs_request *req, int out_fd);
+int dfs_forward_upload(struct dfs_request *req, const int out_fds[], int nout, uint32_t out_id, int out_failed[],
+                       uint64_t *len);
+
+#endif
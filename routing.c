@@ -0,0 +1,210 @@
+// Distributed File System - Routing Table Implementation
+// Each server has a ring of points sorted by hash, each naming the instance it belongs to; a path
+// picks the instance of the first point at or after its hash with a binary search, and its further
+// replicas the instances of the points after it that are not picked yet.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "routing.h"
+#include "namespace.h"
+
+const char *const route_types[DFS_NUM_SERVERS] = { ".c", ".pdf", ".txt", ".zip" };
+
+// A point on a server's hash ring
+struct ring_point
+{
+    uint64_t hash;
+    int node; // Instance owning the files from the previous point up to this one
+};
+
+static int instances[DFS_NUM_SERVERS][DFS_MAX_NODES]; // Entries in dfs_servers of each server's instances
+static int num_instances[DFS_NUM_SERVERS];
+static unsigned int instance_mask[DFS_NUM_SERVERS];
+static struct ring_point *rings[DFS_NUM_SERVERS];
+static size_t ring_sizes[DFS_NUM_SERVERS];
+static int ring_instances[DFS_NUM_SERVERS]; // Instances with points on the ring
+static pthread_rwlock_t route_lock = PTHREAD_RWLOCK_INITIALIZER; // Held for writing while the table is rebuilt
+
+// Function to spread the bits of a hash (the splitmix64 finalizer)
+static uint64_t mix_hash(uint64_t h)
+{
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+// Function to hash the address of an instance, which names it on the ring (FNV-1a)
+// The address rather than the position in the configuration names it, so reordering the lines of
+// the configuration file moves no files.
+static uint64_t hash_instance(int node)
+{
+    char name[DFS_MAX_HOST_LEN + 16];
+    snprintf(name, sizeof(name), "%s:%d", dfs_server_host(node), dfs_servers[node].port);
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *p = name; *p != '\0'; p++)
+    {
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Function to order ring points by hash
+static int compare_points(const void *a, const void *b)
+{
+    const struct ring_point *pa = a, *pb = b;
+    if (pa->hash != pb->hash)
+    {
+        return (pa->hash < pb->hash) ? -1 : 1;
+    }
+    return pa->node - pb->node;
+}
+
+// Function to place the instances of a server on its ring
+// Instances of weight 0 are left off, unless all of them have weight 0.
+static int build_ring(enum dfs_server server)
+{
+    int total = 0;
+    for (int i = 0; i < num_instances[server]; i++)
+    {
+        total += dfs_servers[instances[server][i]].weight;
+    }
+
+    struct ring_point *ring = malloc(sizeof(struct ring_point) * ROUTE_POINTS_PER_WEIGHT * (total > 0 ? total : num_instances[server]));
+    if (ring == NULL)
+    {
+        return -1;
+    }
+    free(rings[server]);
+    rings[server] = ring;
+    ring_sizes[server] = 0;
+    ring_instances[server] = 0;
+
+    for (int i = 0; i < num_instances[server]; i++)
+    {
+        int node = instances[server][i];
+        int points = ROUTE_POINTS_PER_WEIGHT * (total > 0 ? dfs_servers[node].weight : 1);
+        uint64_t base = hash_instance(node);
+        ring_instances[server] += (points > 0);
+        for (int p = 0; p < points; p++)
+        {
+            struct ring_point *point = &rings[server][ring_sizes[server]++];
+            point->hash = mix_hash(base + (uint64_t)p * 0x9e3779b97f4a7c15ULL);
+            point->node = node;
+        }
+    }
+    qsort(rings[server], ring_sizes[server], sizeof(struct ring_point), compare_points);
+    return 0;
+}
+
+// Function to build the routing table
+// If memory runs out the old rings of the servers not rebuilt yet stay in use.
+int route_init(void)
+{
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&route_lock);
+    memset(num_instances, 0, sizeof(num_instances));
+    memset(instance_mask, 0, sizeof(instance_mask));
+    for (int node = 0; node < dfs_num_nodes; node++)
+    {
+        enum dfs_server server = dfs_servers[node].server;
+        instances[server][num_instances[server]++] = node;
+        instance_mask[server] |= 1u << node;
+    }
+
+    for (int server = 0; ret == 0 && server < DFS_NUM_SERVERS; server++)
+    {
+        if (num_instances[server] > 1 && build_ring(server) < 0)
+        {
+            ret = -1;
+        }
+    }
+    pthread_rwlock_unlock(&route_lock);
+    return ret;
+}
+
+// Function to find the server storing a file type
+int route_type(const char *type)
+{
+    for (int server = 0; server < DFS_NUM_SERVERS; server++)
+    {
+        if (strcmp(type, route_types[server]) == 0)
+        {
+            return server;
+        }
+    }
+    return -1;
+}
+
+// Function to get the instances of a server
+unsigned int route_servers(enum dfs_server server)
+{
+    pthread_rwlock_rdlock(&route_lock);
+    unsigned int mask = instance_mask[server];
+    pthread_rwlock_unlock(&route_lock);
+    return mask;
+}
+
+// Function to find the first point of a ring at or after the hash of a path
+// Past the last point the ring wraps around to the first.
+static size_t ring_position(enum dfs_server server, const char *path)
+{
+    const struct ring_point *ring = rings[server];
+    uint64_t h = ns_hash_path(path);
+    size_t lo = 0, hi = ring_sizes[server];
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring[mid].hash < h)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return (lo < ring_sizes[server]) ? lo : 0;
+}
+
+// Function to pick the instance storing a file
+int route_file(enum dfs_server server, const char *path)
+{
+    pthread_rwlock_rdlock(&route_lock);
+    int node = (num_instances[server] == 1) ? instances[server][0] : rings[server][ring_position(server, path)].node;
+    pthread_rwlock_unlock(&route_lock);
+    return node;
+}
+
+// Function to pick the instances storing the copies of a file
+int route_replicas(enum dfs_server server, const char *path, int nodes[])
+{
+    pthread_rwlock_rdlock(&route_lock);
+    if (num_instances[server] == 1)
+    {
+        nodes[0] = instances[server][0];
+        pthread_rwlock_unlock(&route_lock);
+        return 1;
+    }
+
+    int wanted = (dfs_replicas < ring_instances[server]) ? dfs_replicas : ring_instances[server];
+    unsigned int picked = 0;
+    int count = 0;
+    size_t pos = ring_position(server, path);
+    while (count < wanted)
+    {
+        int node = rings[server][pos].node;
+        if (!(picked & (1u << node)))
+        {
+            picked |= 1u << node;
+            nodes[count++] = node;
+        }
+        pos = (pos + 1 < ring_sizes[server]) ? pos + 1 : 0;
+    }
+    pthread_rwlock_unlock(&route_lock);
+    return count;
+}
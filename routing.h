@@ -0,0 +1,47 @@
+// Distributed File System - Routing Table
+// Decides which server instance stores a file. Used by S1.
+//
+// A file's type picks the server: .c files stay in S1, .pdf files go to S2, .txt files to S3 and
+// .zip files to S4. When the configuration has several instances of a server, its files are spread
+// over them by a hash of their path below ~S1, so each instance stores and serves its share and the
+// same path always goes to the same instance. The table is built from the configuration once it is
+// loaded, and again when it is reloaded, while lookups wait; a server instance is named by its entry
+// in dfs_servers.
+//
+// The instances of a server are placed on a hash ring (consistent hashing): each gets
+// ROUTE_POINTS_PER_WEIGHT points on it per unit of its weight, at hashes of its address, and a file
+// goes to the instance owning the first point at or after the hash of its path. Adding or removing
+// an instance, or changing a weight, thus only moves the files between the points that changed,
+// about the new instance's share of them, instead of nearly all files as a hash modulo the number
+// of instances would. With dfs_replicas copies of each file, the copies go to the instances of the
+// points that follow, skipping instances that already have one.
+
+#ifndef ROUTING_H
+#define ROUTING_H
+
+#include "config.h"
+
+#define ROUTE_POINTS_PER_WEIGHT 100 // Points on the ring per unit of an instance's weight
+
+// File type each server stores
+extern const char *const route_types[DFS_NUM_SERVERS];
+
+// Builds the table from dfs_servers, or rebuilds it after the configuration changed. Returns -1 if
+// memory runs out.
+int route_init(void);
+
+// Finds the server storing files of a type such as ".pdf". Returns -1 if the type is not supported.
+int route_type(const char *type);
+
+// Instances of a server, a bit set for each entry in dfs_servers
+unsigned int route_servers(enum dfs_server server);
+
+// Instance of a server that stores the file at path (relative to the storage directory, as in
+// "/folder1/test1.pdf"). An instance of weight 0 gets no files unless every instance has weight 0.
+int route_file(enum dfs_server server, const char *path);
+
+// Instances of a server that store the copies of the file at path, the first being route_file()'s.
+// Fills nodes, which must have room for dfs_replicas entries, and returns their number.
+int route_replicas(enum dfs_server server, const char *path, int nodes[]);
+
+#endif
@@ -2,6 +2,8 @@
 // This file implements the main server (S1) which interacts with the client and other servers (S2, S3, S4).
 // S1 handles .c files locally and forwards other file types to the appropriate servers.
 
+#define _GNU_SOURCE // for accept4()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,7 +11,8 @@
 #include <sys/types.h>
 #include <sys/socket.h> // for socket()
 #include <netinet/in.h> // for sockaddr_in
-#include <netdb.h> // for gethostbyname()
+#include <netinet/tcp.h> // for TCP_NODELAY
+#include <netdb.h> // for getaddrinfo()
 #include <arpa/inet.h> // for inet_ntoa()
 #include <sys/stat.h> // for stat()
 #include <fcntl.h> // for open()
@@ -19,50 +22,387 @@
 #include <sys/sendfile.h> // for sendfile()
 #include <time.h> // for time()
 #include <errno.h> // for errno
-
-#define PORT 4307 // S1 server port
-#define MAX_CLIENTS 5 // Maximum number of clients
+#include <signal.h> // for signal()
+#include <pthread.h> // for worker threads
+#include <sys/epoll.h> // for epoll_create1()
+#include <sys/signalfd.h> // for signalfd()
+#include <sys/eventfd.h> // for eventfd()
+#include <poll.h> // for poll()
+#include <limits.h> // for PATH_MAX
+#include <stdint.h> // for SIZE_MAX
+
+#include "config.h"
+#include "gzip_stream.h"
+#include "namespace.h"
+#include "protocol.h"
+#include "routing.h"
+#include "tar_stream.h"
+#include "thread_pool.h"
+
+#define MAX_CLIENTS SOMAXCONN // Pending connection backlog
 #define BUFFER_SIZE 1024 // Buffer size for file transfer
 #define MAX_PATH_LEN 1024 // Maximum path length
+#define NUM_WORKERS 16 // Worker threads executing client commands, mostly waiting on S2, S3, S4
+#define WORK_QUEUE_DEPTH 1024 // Commands waiting for a free worker
+#define MAX_PIPELINE 64 // Requests of one connection queued or running before reading from it pauses
+#define MAX_CONN_WORKERS (NUM_WORKERS / 2) // Requests of one connection queued for or running on a worker at a time
+#define MAX_EVENTS 64 // Events handled per epoll_wait() call
+#define COMMAND_BUFFER_SIZE (DFS_HEADER_SIZE + DFS_MAX_REQUEST_LEN + 1) // Largest request frame or text command
+#define TEXT_COMMAND_WAIT 20 // Milliseconds without more data after which a text command without a newline is complete
+#define STORAGE_ROOT (dfs_servers[DFS_S1].root) // Directory holding S1's files
+#define MANIFEST_RETRY 10 // Seconds between attempts to load the manifest of an unreachable server
+#define REBALANCE_RATE 16 // MiB per second the rebalancer copies files at by default
+#define REBALANCE_BATCH 256 // Names taken from the index at a time while looking for misplaced files
+#define REBALANCE_RETRY 10 // Seconds between passes while files are left to move
+#define REBALANCE_COMMIT_WAIT 100 // Milliseconds a moved file waits for running downloads of it to start
+#define PLACE_ATTEMPTS 3 // Times a file is copied again after an upload or removal of it got in between
+#define MOVE_LOCKS 4096 // Locks keeping requests off the files being moved, picked by path hash
+#define BACKEND_RETRY 5 // Seconds an unreachable instance is asked for copies only after the others
+#define ARCHIVE_HELD_MAX (16 * TAR_BLOCK_SIZE) // Long name entries held back until their entry is read
+#define LATENCY_SAMPLES 128 // Recent reply times kept per instance to derive the hedging delay from
+#define LATENCY_WEIGHT 0.125 // Weight of each new reply time in an instance's moving average
+#define HEDGE_MIN_SAMPLES 16 // Reply times an instance needs before its slow downloads are hedged
+#define HEDGE_MIN_DELAY 2000 // Microseconds a download waits at least before a second copy is asked
+
+// Per-connection state
+// The event loop reads requests from the connection while workers execute earlier ones, so a client
+// can pipeline requests. Only MAX_CONN_WORKERS of them take workers at a time, leaving the others
+// for other clients; the rest wait in the connection for one of them to finish. The connection is
+// freed once it is neither read nor has requests in flight.
+struct connection
+{
+    int fd;
+    pthread_mutex_t lock; // Protects reading, paused, inflight, workers and held
+    pthread_mutex_t write_lock; // Serialises the reply frames of concurrent requests
+    int reading; // Still receiving requests, from the event loop or a worker that took over the socket
+    int paused; // Reading stopped until fewer than MAX_PIPELINE requests are in flight
+    int inflight; // Requests read and not finished yet
+    int workers; // Requests queued for or running on a worker
+    struct request_job *held; // Requests waiting for one of the connection's workers, oldest first
+    struct request_job *held_last;
+    struct request_job *pending; // Command read while the work queue was full, queued once it has room
+    struct connection *stalled_next; // Next connection with a pending command
+    size_t len; // Bytes of the command received so far
+    char buffer[COMMAND_BUFFER_SIZE];
+};
+
+// A command handed to a worker thread
+struct request_job
+{
+    struct connection *conn;
+    struct request_job *next; // Next request held in the connection
+    int owns_socket; // The worker reads from the socket and hands it back to the event loop after
+    size_t len;
+    char buffer[]; // Request frame or text command, NUL-terminated
+};
+
+// An archive streamed from another server into a merged downltar reply
+struct archive_source
+{
+    int node; // Server instance sending the archive
+    const char *since_arg; // Modification time the archive starts from, NULL for all files
+    int sock; // Connection the archive arrives on, -1 once it has ended
+    int reused; // The connection came from the worker's pool
+    int64_t size; // Archive size announced by the server
+    uint64_t frame_left; // Bytes of the current DATA frame not read yet
+    unsigned int peers; // Live instances sending copies of the same files, 0 if the server's files have one
+};
+
+// A server's part of a dispfnames reply, listed from the namespace index or streamed by the server
+struct listing_source
+{
+    enum dfs_server server; // Server whose files are listed
+    int node; // Instance streaming them, -1 if they come from the index
+    unsigned int nodes; // Instances whose files the index lists
+    int from_index;
+    const char *after; // "~S1/..." name the part continues after, NULL for all of it
+    const char *args[3]; // Request sent to the server
+    int nargs;
+    int sock; // Connection the listing arrives on, -1 once it has ended
+    int reused; // The connection came from the worker's pool
+    int started; // The server's STATUS reply was read
+    int more; // The index has names after the last page, or the server sends more frames
+    uint64_t frame_left; // Bytes of the current DATA frame not read yet
+    char cursor[PATH_MAX]; // Last name of the last page taken from the index
+    char *buf; // Names received but not passed on, from start to len
+    size_t start;
+    size_t len;
+};
+
+// Keeps the requests for a file and the rebalancer placing its copies apart
+// Uploads and removals hold update shared while they run and bump generation before they finish,
+// downloads hold lookup shared until the server has opened the file. The rebalancer copies a file
+// without either, then holds update exclusively only while it checks that generation did not
+// change and a new copy or the index entry takes effect, and lookup while the index entry changes.
+struct move_lock
+{
+    pthread_rwlock_t update;
+    pthread_rwlock_t lookup;
+    unsigned int generation; // Uploads and removals of the paths using the lock, updated atomically
+};
 
-// Server ports for S2, S3, S4
-#define S2_PORT 4308
-#define S3_PORT 4309
-#define S4_PORT 4310
+// How busy and how fast a server instance is, for picking the copy of a file to read
+struct backend_load
+{
+    int in_flight; // Connections taken for requests and not given back yet, updated atomically
+    pthread_mutex_t lock; // Guards the rest
+    double latency; // Moving average of the time until a download is answered, in microseconds
+    uint32_t samples[LATENCY_SAMPLES]; // Recent such times, the oldest replaced first
+    int nsamples;
+    int next_sample;
+    int64_t hedge_delay; // 95th percentile of the samples, -1 while there are too few
+};
+
+// A download request sent to one instance holding a copy of the file
+struct download_attempt
+{
+    int node;
+    int sock;
+    int reused; // The connection came from the worker's pool
+    int64_t sent; // When the request was sent, in microseconds
+};
+
+// Orders a dispfnames reply can list the servers' files in
+enum listing_order
+{
+    ORDER_TYPE, // S1's files, then those of S2, S3 and S4
+    ORDER_NAME, // All files in one walk of the tree
+    ORDER_ARRIVAL // Names passed on as they arrive
+};
+
+int epoll_fd; // Event loop epoll instance
+int hangup_fd = -1; // Signal descriptor reporting SIGHUP, asking to reload the configuration
+int stalled_fd = -1; // Event counter a worker bumps when it finishes while connections are stalled
+pthread_mutex_t stalled_lock = PTHREAD_MUTEX_INITIALIZER; // Guards stalled and queueing commands
+struct connection *stalled; // Connections not read from until their pending command is queued
+const char *config_path; // Configuration file given with -c, NULL for the defaults
+struct thread_pool *workers; // Threads executing client commands
+__thread int backend_socks[DFS_MAX_NODES] = { [0 ... DFS_MAX_NODES - 1] = -1 }; // Each worker's idle connections to S2, S3, S4
+int busy_workers; // Workers executing a command, updated atomically
+long rebalance_rate = REBALANCE_RATE * 1024L * 1024L; // Bytes per second the rebalancer copies, 0 if it is off
+int verbose; // Print every request received, set with -v
+struct move_lock move_locks[MOVE_LOCKS] = 
+{
+    [0 ... MOVE_LOCKS - 1] = { PTHREAD_RWLOCK_INITIALIZER, PTHREAD_RWLOCK_INITIALIZER, 0 }
+};
+time_t backend_down[DFS_MAX_NODES]; // When connecting to each instance last failed, 0 once it worked again
+struct backend_load backend_loads[DFS_MAX_NODES] = 
+{
+    [0 ... DFS_MAX_NODES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER, .hedge_delay = -1 }
+};
+pthread_mutex_t rebalance_lock = PTHREAD_MUTEX_INITIALIZER; // Guards rebalance_wanted
+pthread_cond_t rebalance_cond = PTHREAD_COND_INITIALIZER; // Signalled when rebalance_wanted is set
+pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER; // Guards waiting for idle workers
+pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER; // Signalled when a worker finishes while idle_waiting
+int idle_waiting; // The rebalancer waits for busy_workers to drop, updated atomically
+int rebalance_wanted; // Set when a file was stored with fewer copies than it should have
 
 // Function prototypes
-void handle_client(int client_sock);
-int upload_file(int client_sock, char *filename, char *dest_path);
-int download_file(int client_sock, char *filename);
-int remove_file(int client_sock, char *filename);
-int download_tar(int client_sock, char *filetype);
-int display_filenames(int client_sock, char *pathname);
-int send_to_server(int port, char *command, char *response);
+void accept_connections(int listen_sock);
+void read_command(struct connection *conn);
+struct request_job *new_job(struct connection *conn, int owns_socket);
+struct request_job *read_text_command(struct request_job *job);
+int take_worker(struct connection *conn, struct request_job *job);
+struct request_job *next_held(struct connection *conn);
+int queue_command(struct connection *conn, struct request_job *job);
+void resume_stalled(void);
+void wake_stalled(void);
+void serve_request(void *arg);
+void finish_work(void);
+void wait_for_idle_workers(void);
+void finish_request(struct connection *conn);
+void rearm_connection(struct connection *conn);
+void stop_reading(struct connection *conn);
+void free_connection(struct connection *conn);
+ssize_t command_bytes_wanted(struct connection *conn);
+int handle_client(struct connection *conn, char *buffer, size_t len);
+int dispatch_request(struct dfs_request *req, char *args[], int nargs);
+void reject_upload(struct dfs_request *req, uint32_t status, const char *msg);
+int upload_file(struct dfs_request *req, char *filename, char *dest_path);
+int forward_upload(struct dfs_request *req, const int nodes[], int count, unsigned int old_servers, 
+                   char *filename, char *dest_path);
+int open_upload(int node, uint32_t id, const char *const args[]);
+int download_file(struct dfs_request *req, char *filename);
+int remove_file(struct dfs_request *req, char *filename);
+int download_tar(struct dfs_request *req, char *filetype, char *since_arg, int compress);
+int parse_tar_types(char *filetype, unsigned int *servers);
+int merge_tar(struct dfs_request *req, unsigned int servers, char *since_arg, time_t since, int compress);
+int open_archive(struct archive_source *src, uint32_t id, char *msg, size_t msg_size, uint32_t *status);
+int relay_archive_entry(const struct tar_sink *sink, struct archive_source *src);
+int keep_archive_entry(const struct archive_source *src, const char *name);
+int held_elsewhere(int node, unsigned int live, time_t since);
+int skip_archive(struct archive_source *src, off_t len);
+void close_archives(struct archive_source *sources, int nsources);
+int read_archive(struct archive_source *src, void *buf, size_t len);
+int next_archive_frame(struct archive_source *src);
+int finish_archive(struct archive_source *src);
+int display_filenames(struct dfs_request *req, char *pathname, char *limit_arg, char *after, char *order_arg);
+int open_listing(struct listing_source *src, enum dfs_server server, int node, unsigned int nodes, uint32_t id, 
+                 const char *pathname, const char *limit_arg, const char *after);
+int start_listing(struct listing_source *src, uint32_t id);
+int fill_listing(struct listing_source *src, const char *path, uint32_t id);
+int next_listing_name(struct listing_source *src, const char *path, uint32_t id, int wait, const char **name, size_t *len);
+void close_listings(struct listing_source *sources, int nsources);
+int send_listing_name(struct dfs_request *req, char *out, size_t *used, const char *name, size_t len);
+int merge_names(struct dfs_request *req, struct listing_source *sources, int nsources, const char *path, 
+                size_t *left, char *out, size_t *used);
+int merge_arrivals(struct dfs_request *req, struct listing_source *sources, int nsources, const char *path, 
+                   size_t *left, char *out, size_t *used);
+int index_complete(int node);
+int find_copies(enum dfs_server target, const char *path, struct ns_file *file, int nodes[]);
+int order_replicas(unsigned int servers, int nodes[]);
+int hedged_download(const int nodes[], int count, uint32_t id, const char *const args[], 
+                    struct dfs_header *hdr, char *msg, size_t msg_size, int64_t *size, int *node);
+int start_download(struct download_attempt *attempt, int node, uint32_t id, const char *const args[]);
+void record_latency(int node, int64_t elapsed);
+int64_t hedge_delay(int node);
+double backend_score(int node);
+int compare_samples(const void *a, const void *b);
+int64_t monotonic_us(void);
+int load_manifest(int node);
+int relay_from_server(struct dfs_request *req, int node, uint8_t opcode, const char *const args[], int nargs);
+int relay_reply(struct dfs_request *req, int node, int sockfd, struct dfs_header *hdr, const char *msg, int64_t size);
+int send_to_server(int node, uint8_t opcode, const char *const args[], int nargs, char *response, uint32_t *status);
+int request_from_server(int node, uint8_t opcode, uint32_t id, const char *const args[], int nargs,
+                        struct dfs_header *hdr, char *msg, size_t msg_size, int64_t *size);
+int acquire_backend(int node, int *reused);
+void release_backend(int node, int sockfd, int reusable);
+int connect_to_server(int node);
+int backend_up(int node);
+struct move_lock *move_lock(const char *path);
+void reload_config(void);
+unsigned int rebalance_nodes(void);
+void *rebalance_files(void *arg);
+void wake_rebalancer(void);
+int rebalance_pass(unsigned int nodes, int *placed);
+int place_file(const char *path, const struct ns_file *file, unsigned int want);
+int copy_file(int from, int to, const char *filename, const char *dest_path, struct move_lock *lock, 
+              unsigned int generation);
+void throttle_rebalance(size_t len);
 int create_directory_tree(char *path);
 void error(const char *msg);
 
-// Main function initializes the server and listens for client connections.
-// It creates a child process for each client to handle requests concurrently.
-int main() 
+// Main function initializes the server and runs the connection event loop.
+// Connections are non-blocking and watched with edge-triggered epoll; every complete
+// request is handed to a worker thread while the loop goes on reading the next one.
+// Usage: ./S1 [-c config_file] [-r] [-b rebalance_rate] [-v]
+// -r rebuilds the namespace index from the stored files instead of loading the saved one.
+// -b sets the MiB per second the rebalancer copies files between server instances at, 0 turns it off.
+// -v prints every request received.
+// SIGHUP reads the configuration file again, e.g. after an instance was added or a weight changed.
+int main(int argc, char *argv[]) 
 {
-    // Create socket
-    int sockfd, newsockfd;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
-    pid_t pid;
+    int sockfd;
+    struct sockaddr_in serv_addr;
+    int rebuild = 0;
+    int opt;
+
+    // Parse options
+    char *end;
+    while ((opt = getopt(argc, argv, "c:rb:v")) != -1) 
+    {
+        switch (opt) 
+        {
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'r':
+                rebuild = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'b':
+                rebalance_rate = strtol(optarg, &end, 10) * 1024L * 1024L;
+                if (end == optarg || *end != '\0' || rebalance_rate < 0) 
+                {
+                    fprintf(stderr, "Usage: %s [-c config_file] [-r] [-b rebalance_rate] [-v]\n", argv[0]);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c config_file] [-r] [-b rebalance_rate] [-v]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    // Addresses of all servers and S1's storage directory, and the instances each file type goes to
+    if (dfs_load_config(config_path) < 0) 
+    {
+        exit(1);
+    }
+    if (route_init() < 0) 
+    {
+        error("ERROR building the routing table");
+    }
+
+    // A client disconnecting mid-transfer must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGHUP is read by the event loop; blocking it here keeps it from every thread started later
+    sigset_t hangup;
+    sigemptyset(&hangup);
+    sigaddset(&hangup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hangup, NULL);
+    hangup_fd = signalfd(-1, &hangup, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (hangup_fd < 0)
+    {
+        error("ERROR creating signal descriptor");
+    }
+
+    // Load the namespace index saved next to the storage directory, or build it from S1's files
+    // and the manifests of the other servers; a server that does not answer yet is asked again
+    // when its files are needed
+    char meta_dir[MAX_PATH_LEN];
+    snprintf(meta_dir, sizeof(meta_dir), "%s.meta", STORAGE_ROOT);
+    int restored = ns_open(meta_dir, !rebuild);
+    if (restored < 0) 
+    {
+        fprintf(stderr, "WARNING: Cannot use %s, the namespace index will not be saved\n", meta_dir);
+    }
+    if (restored <= 0 && ns_scan(STORAGE_ROOT, ".c", DFS_S1) < 0) 
+    {
+        error("ERROR indexing S1's files");
+    }
+    int loaded = 0;
+    for (int node = 0; node < dfs_num_nodes; node++) 
+    {
+        if (node == DFS_S1 || ns_complete(node)) 
+        {
+            continue;
+        }
+        if (load_manifest(node) == 0) 
+        {
+            loaded = 1;
+        }
+        else 
+        {
+            char name[16];
+            dfs_node_name(node, name, sizeof(name));
+            fprintf(stderr, "WARNING: No file list from %s yet, its files are looked up there\n", name);
+        }
+    }
+    if (restored <= 0 || loaded) 
+    {
+        ns_snapshot();
+    }
 
     // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (sockfd < 0) 
     {
         error("ERROR opening socket");
     }
 
+    int reuse = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Initialize socket structure
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(PORT);
+    if (dfs_listen_address(DFS_S1, &serv_addr) < 0) 
+    {
+        fprintf(stderr, "ERROR resolving %s\n", dfs_servers[DFS_S1].host);
+        exit(1);
+    }
 
     // Bind the host address
     if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
@@ -71,43 +411,89 @@ int main()
     }
 
     // Start listening for the clients
-    listen(sockfd, MAX_CLIENTS);
-    clilen = sizeof(cli_addr);
+    if (listen(sockfd, MAX_CLIENTS) < 0)
+    {
+        error("ERROR on listen");
+    }
+
+    // Start the worker threads that execute client commands
+    workers = pool_create(NUM_WORKERS, WORK_QUEUE_DEPTH);
+    if (workers == NULL)
+    {
+        error("ERROR creating worker pool");
+    }
+
+    // Place the files that the configuration now routes to other instances of their server, and
+    // make the copies uploads could not store
+    pthread_t rebalancer;
+    if (rebalance_rate > 0 && 
+        pthread_create(&rebalancer, NULL, rebalance_files, NULL) == 0) 
+    {
+        pthread_detach(rebalancer);
+    }
+
+    // Create the epoll instance and watch the listening socket
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0)
+    {
+        error("ERROR creating epoll instance");
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+    {
+        error("ERROR adding listening socket to epoll");
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &hangup_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, hangup_fd, &ev) < 0)
+    {
+        error("ERROR adding signal descriptor to epoll");
+    }
+    stalled_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.data.ptr = &stalled_fd;
+    if (stalled_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stalled_fd, &ev) < 0)
+    {
+        error("ERROR adding event counter to epoll");
+    }
 
     // Print server start message
-    printf("S1 (MAIN SERVER) started on port %d\n", PORT);
+    printf("S1 (MAIN SERVER) started on port %d with %d worker threads\n", dfs_servers[DFS_S1].port, NUM_WORKERS);
 
-    // Main loop to accept clients
+    // Main event loop
+    struct epoll_event events[MAX_EVENTS];
     while (1) 
     {
-        // Accept connection from client
-        newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-        if (newsockfd < 0) {
-            error("ERROR on accept");
-        }
-
-        // Create child process to handle client
-        pid = fork();
-        if (pid < 0) 
+        int nready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (nready < 0)
         {
-            error("ERROR on fork");
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("ERROR on epoll_wait");
         }
 
-        if (pid == 0) 
-        {
-            // Child process
-            close(sockfd);
-            handle_client(newsockfd);
-            close(newsockfd);
-            exit(0);
-        } 
-
-        else 
+        for (int i = 0; i < nready; i++)
         {
-            // Parent process
-            close(newsockfd);
-            // Clean up zombie processes
-            while (waitpid(-1, NULL, WNOHANG) > 0);
+            if (events[i].data.ptr == NULL)
+            {
+                accept_connections(sockfd);
+            }
+            else if (events[i].data.ptr == &hangup_fd)
+            {
+                reload_config();
+            }
+            else if (events[i].data.ptr == &stalled_fd)
+            {
+                resume_stalled();
+            }
+            else
+            {
+                read_command(events[i].data.ptr);
+            }
         }
     }
 
@@ -115,687 +501,3022 @@ int main()
     return 0;
 }
 
-// Function to handle client requests
-// Parses the command received from the client and calls the appropriate function.
-void handle_client(int client_sock) 
+// Function to accept all pending connections on the listening socket
+// Edge-triggered epoll only reports new connections once, so accept until EAGAIN.
+void accept_connections(int listen_sock)
 {
-    char buffer[BUFFER_SIZE]; // Buffer for commands
-    int n;
-    
-    // Read command from client
-    bzero(buffer, BUFFER_SIZE);
-    n = read(client_sock, buffer, BUFFER_SIZE - 1);
-    if (n < 0) 
-    {
-        error("ERROR reading from socket");
-    }
-    
-    printf("Received command: %s\n", buffer);
-    
-    // Parse command
-    char *cmd = strtok(buffer, " ");
-    if (cmd == NULL) 
-    {
-        write(client_sock, "ERROR: Invalid command", 22);
-        return;
-    }
-    
-    if (strcmp(cmd, "uploadf") == 0) 
+    while (1)
     {
-        // Handle file upload
-        char *filename = strtok(NULL, " ");
-        char *dest_path = strtok(NULL, " ");
-        if (filename == NULL || dest_path == NULL) 
+        int client_sock = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK);
+        if (client_sock < 0)
         {
-            write(client_sock, "ERROR: Invalid uploadf command format", 36);
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("ERROR on accept");
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
             return;
         }
-        upload_file(client_sock, filename, dest_path);
-    } 
-    else if (strcmp(cmd, "downlf") == 0) 
-    {
-        // Handle file download
-        char *filename = strtok(NULL, " ");
-        if (filename == NULL) 
+
+        struct connection *conn = calloc(1, sizeof(struct connection));
+        if (conn == NULL)
         {
-            write(client_sock, "ERROR: Invalid downlf command format", 34);
-            return;
+            close(client_sock);
+            continue;
         }
-        download_file(client_sock, filename);
-    } 
-    else if (strcmp(cmd, "removef") == 0) 
-    {
-        // Handle file removal
-        char *filename = strtok(NULL, " ");
-        if (filename == NULL) 
+        conn->fd = client_sock;
+        conn->reading = 1;
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_mutex_init(&conn->write_lock, NULL);
+
+        // Sessions exchange many small request/response messages
+        int nodelay = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        // One-shot so that only one thread ever reads from the connection at a time
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0)
         {
-            write(client_sock, "ERROR: Invalid removef command format", 35);
-            return;
+            perror("ERROR adding client to epoll");
+            stop_reading(conn);
         }
-        remove_file(client_sock, filename);
-    } 
-    else if (strcmp(cmd, "downltar") == 0) 
+    }
+}
+
+// Function to read commands from a readable connection
+// Every complete request frame is queued for a worker and reading goes on with the next one, so
+// pipelined requests run concurrently. A request frame is complete once its header and payload have
+// arrived. Upload data follows its request frame, and a text command may still be arriving when the
+// client pauses (see read_text_command()), so for those the worker takes over the socket and
+// reading only resumes once it is done.
+// A connection using its share of the workers keeps its commands until one of them finishes.
+// While the work queue is full the command is held back and the connection is not read from until
+// a worker finishes, so the event loop never waits for the queue.
+void read_command(struct connection *conn)
+{
+    struct request_job *job = conn->pending;
+    conn->pending = NULL;
+    while (1)
     {
-        // Handle tar file download
-        char *filetype = strtok(NULL, " ");
-        if (filetype == NULL) 
+        if (job == NULL)
         {
-            write(client_sock, "ERROR: Invalid downltar command format", 36);
-            return;
+            ssize_t want;
+            while ((want = command_bytes_wanted(conn)) > 0)
+            {
+                ssize_t n = read(conn->fd, conn->buffer + conn->len, want);
+                if (n > 0)
+                {
+                    conn->len += n;
+                    continue;
+                }
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    if (conn->len > 0 && !dfs_is_frame(conn->buffer, conn->len))
+                    {
+                        break; // Start of a text command, the worker reads the rest
+                    }
+                    // Wait for the rest of the command
+                    rearm_connection(conn);
+                    return;
+                }
+
+                // Client closed the connection or the read failed; replies still in flight are sent
+                stop_reading(conn);
+                return;
+            }
+
+            if (want < 0)
+            {
+                // Corrupt or oversized request frame, the stream cannot be trusted any more
+                shutdown(conn->fd, SHUT_RDWR);
+                stop_reading(conn);
+                return;
+            }
+
+            int owns_socket = 1;
+            if (dfs_is_frame(conn->buffer, conn->len))
+            {
+                struct dfs_header hdr;
+                dfs_decode_header((unsigned char *)conn->buffer, &hdr);
+                if (hdr.opcode == DFS_OP_EXIT)
+                {
+                    // Client is ending its session once the replies in flight are out
+                    stop_reading(conn);
+                    return;
+                }
+                owns_socket = (hdr.opcode == DFS_OP_UPLOADF);
+            }
+
+            job = new_job(conn, owns_socket);
+            if (job == NULL)
+            {
+                stop_reading(conn);
+                return;
+            }
+            if (!take_worker(conn, job))
+            {
+                if (owns_socket)
+                {
+                    return; // The worker that runs it reads the rest from the socket
+                }
+                job = NULL;
+            }
         }
-        download_tar(client_sock, filetype);
-    } 
-    else if (strcmp(cmd, "dispfnames") == 0) 
-    {
-        // Handle display filenames request
-        char *pathname = strtok(NULL, " ");
-        if (pathname == NULL) 
+
+        if (job != NULL)
+        {
+            int owns_socket = job->owns_socket;
+            int queued = queue_command(conn, job);
+            job = NULL;
+            if (queued < 0)
+            {
+                stop_reading(conn);
+                return;
+            }
+            if (queued > 0 || owns_socket)
+            {
+                return;
+            }
+        }
+
+        // Stop taking requests from a client that has too many in flight
+        pthread_mutex_lock(&conn->lock);
+        if (conn->inflight >= MAX_PIPELINE)
+        {
+            conn->paused = 1;
+        }
+        int paused = conn->paused;
+        pthread_mutex_unlock(&conn->lock);
+        if (paused)
         {
-            write(client_sock, "ERROR: Invalid dispfnames command format", 38);
             return;
         }
-        display_filenames(client_sock, pathname);
-    } 
-    else 
-    {
-        // Handle unknown command
-        write(client_sock, "ERROR: Unknown command", 21);
     }
 }
 
-// Function to upload a file to S1 or forward it to the appropriate server
-// Receives the file from the client and determines its type based on the extension.
-int upload_file(int client_sock, char *filename, char *dest_path) 
+// Function to make a job of the received command
+// The command is copied so that the connection buffer can take the next one right away. A text
+// command ends at its first newline; what was read after it stays in the buffer as the next one.
+struct request_job *new_job(struct connection *conn, int owns_socket)
 {
-    // First, receive the file from client
-    char buffer[BUFFER_SIZE];
-    int n;
-    
-    // Send acknowledgment to client to start sending file
-    write(client_sock, "READY", 5);
-    
-    // Get file size
-    off_t file_size;
-    read(client_sock, &file_size, sizeof(off_t));
-    
-    // Determine file type
-    char *ext = strrchr(filename, '.');
-    if (ext == NULL) 
+    size_t len = conn->len;
+    if (!dfs_is_frame(conn->buffer, conn->len))
     {
-        write(client_sock, "ERROR: File has no extension", 27);
-        return -1;
+        char *end = memchr(conn->buffer, '\n', conn->len);
+        if (end != NULL)
+        {
+            len = end + 1 - conn->buffer;
+        }
     }
-    
-    // Create destination path in S1
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), dest_path + 3); // +3 to skip "~S1"
-    
-    // Create directory tree if needed
-    if (create_directory_tree(s1_path) < 0) 
+
+    struct request_job *job = malloc(sizeof(struct request_job) + len + 1);
+    if (job == NULL)
     {
-        write(client_sock, "ERROR: Failed to create directory", 32);
-        return -1;
+        return NULL;
     }
-    
-    // Construct full file path
-    char *base_name = basename(filename);
-    char full_path[MAX_PATH_LEN];
-    snprintf(full_path, MAX_PATH_LEN, "%s/%s", s1_path, base_name);
-    
-    // Open file for writing
-    int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) 
+    job->conn = conn;
+    job->owns_socket = owns_socket;
+    job->len = len;
+    memcpy(job->buffer, conn->buffer, len);
+    job->buffer[len] = '\0';
+    conn->len -= len;
+    memmove(conn->buffer, conn->buffer + len, conn->len);
+
+    pthread_mutex_lock(&conn->lock);
+    conn->inflight++;
+    pthread_mutex_unlock(&conn->lock);
+    return job;
+}
+
+// Function to count a command against the connection's share of the workers
+// Returns 0 if the share is used up; the command is then held in the connection and run by the
+// worker that finishes one of its earlier commands (see next_held()).
+int take_worker(struct connection *conn, struct request_job *job)
+{
+    pthread_mutex_lock(&conn->lock);
+    int free_worker = (conn->workers < MAX_CONN_WORKERS);
+    if (free_worker)
     {
-        write(client_sock, "ERROR: Failed to create file", 27);
-        return -1;
+        conn->workers++;
     }
-    
-    // Receive file data
-    off_t remaining = file_size;
-    while (remaining > 0) 
+    else
     {
-        n = read(client_sock, buffer, BUFFER_SIZE);
-        if (n <= 0) 
+        job->next = NULL;
+        if (conn->held_last != NULL)
         {
-            close(fd);
-            write(client_sock, "ERROR: File transfer failed", 27);
-            return -1;
+            conn->held_last->next = job;
         }
-        write(fd, buffer, n);
-        remaining -= n;
+        else
+        {
+            conn->held = job;
+        }
+        conn->held_last = job;
     }
-    close(fd);
-    
-    // Determine which server should handle this file
-    int target_port = 0;
-    if (strcmp(ext, ".c") == 0) 
+    pthread_mutex_unlock(&conn->lock);
+    return free_worker;
+}
+
+// Function to take the next command held in a connection, for the worker that finished one of its
+// commands. Returns NULL, giving the worker back to other connections, if there is none.
+struct request_job *next_held(struct connection *conn)
+{
+    pthread_mutex_lock(&conn->lock);
+    struct request_job *job = conn->held;
+    if (job != NULL)
     {
-        // File stays in S1
-        write(client_sock, "SUCCESS: File uploaded to S1", 27);
-        return 0;
-    } 
-    else if (strcmp(ext, ".pdf") == 0) 
+        conn->held = job->next;
+        if (conn->held == NULL)
+        {
+            conn->held_last = NULL;
+        }
+    }
+    else
     {
-        target_port = S2_PORT;
-    } 
-    else if (strcmp(ext, ".txt") == 0) 
+        conn->workers--;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return job;
+}
+
+// Function to queue a command for a worker thread
+// Returns 1 if the queue is full; the command is then kept in the connection until a worker
+// finishes and resume_stalled() queues it.
+int queue_command(struct connection *conn, struct request_job *job)
+{
+    pthread_mutex_lock(&stalled_lock);
+    int ret = pool_try_submit(workers, serve_request, job);
+    if (ret > 0)
     {
-        target_port = S3_PORT;
-    } 
-    else if (strcmp(ext, ".zip") == 0) 
+        conn->pending = job;
+        conn->stalled_next = stalled;
+        stalled = conn;
+    }
+    pthread_mutex_unlock(&stalled_lock);
+
+    if (ret < 0)
     {
-        target_port = S4_PORT;
-    } 
-    else 
+        pthread_mutex_lock(&conn->lock);
+        conn->workers--;
+        pthread_mutex_unlock(&conn->lock);
+        free(job);
+        finish_request(conn);
+    }
+    return ret;
+}
+
+// Function to queue the commands held back while the work queue was full
+// Each connection is read from again once its command is queued; the ones that still find the
+// queue full wait for the next worker to finish.
+void resume_stalled(void)
+{
+    uint64_t count;
+    while (read(stalled_fd, &count, sizeof(count)) == sizeof(count))
     {
-        write(client_sock, "ERROR: Unsupported file type", 27);
-        return -1;
     }
-    
-    // Forward file to appropriate server
-    char command[MAX_PATH_LEN * 2];
-    snprintf(command, MAX_PATH_LEN * 2, "uploadf %s %s", full_path, dest_path);
-    
-    char response[BUFFER_SIZE];
-    if (send_to_server(target_port, command, response) < 0) 
+
+    pthread_mutex_lock(&stalled_lock);
+    struct connection *conn = stalled;
+    stalled = NULL;
+    pthread_mutex_unlock(&stalled_lock);
+
+    while (conn != NULL)
     {
-        write(client_sock, "ERROR: Failed to forward file to target server", 44);
-        return -1;
+        struct connection *next = conn->stalled_next;
+        read_command(conn);
+        conn = next;
     }
-    
-    // Remove the file from S1 after forwarding
-    unlink(full_path);
-    
-    write(client_sock, response, strlen(response));
-    return 0;
 }
 
-// Function to download a file from S1 or request it from the appropriate server
-// Checks if the file exists in S1 and sends it to the client, or forwards the request to another server.
-int download_file(int client_sock, char *filename) 
+// Function to have the event loop queue the held back commands, after a worker finished
+// queue_command() holds stalled_lock from finding the queue full until the connection is listed,
+// and a job is taken off the queue before it finishes, so no connection is left waiting.
+void wake_stalled(void)
 {
-    // Check if file exists in S1
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), filename + 3); // +3 to skip "~S1"
-    
-    struct stat st;
-    if (stat(s1_path, &st) == 0) 
+    pthread_mutex_lock(&stalled_lock);
+    int waiting = (stalled != NULL);
+    pthread_mutex_unlock(&stalled_lock);
+
+    if (waiting)
     {
-        // File exists in S1 - send it directly
-        int fd = open(s1_path, O_RDONLY);
-        if (fd < 0) 
+        uint64_t one = 1;
+        write(stalled_fd, &one, sizeof(one));
+    }
+}
+
+// Function to work out how many more bytes belong to the command being received
+// Returns 0 once the command is complete, -1 for a frame header that cannot be accepted.
+ssize_t command_bytes_wanted(struct connection *conn)
+{
+    if (conn->len == 0)
+    {
+        return DFS_HEADER_SIZE; // Enough to recognise a frame; a short text command just returns less
+    }
+
+    if (!dfs_is_frame(conn->buffer, conn->len))
+    {
+        if (memchr(conn->buffer, '\n', conn->len) != NULL)
         {
-            write(client_sock, "ERROR: Failed to open file", 25);
-            return -1;
+            return 0;
         }
-        
-        // Send file size
-        if (write(client_sock, &st.st_size, sizeof(off_t)) != sizeof(off_t)) 
+        return BUFFER_SIZE - 1 - ((conn->len < BUFFER_SIZE - 1) ? conn->len : BUFFER_SIZE - 1);
+    }
+
+    if (conn->len < DFS_HEADER_SIZE)
+    {
+        return DFS_HEADER_SIZE - conn->len;
+    }
+
+    struct dfs_header hdr;
+    if (dfs_decode_header((unsigned char *)conn->buffer, &hdr) < 0 || hdr.length > DFS_MAX_REQUEST_LEN)
+    {
+        return -1;
+    }
+    return DFS_HEADER_SIZE + hdr.length - conn->len;
+}
+
+// Function run by a worker thread to execute one command
+// The socket stays non-blocking; the protocol helpers wait for it when it is not ready. A worker
+// that took over the socket hands it back to the event loop for the next command of the session.
+// The worker goes on with the commands the connection holds for its share of the workers.
+void serve_request(void *arg)
+{
+    struct request_job *job = arg;
+    struct connection *conn = job->conn;
+
+    while (job != NULL)
+    {
+        __atomic_add_fetch(&busy_workers, 1, __ATOMIC_RELAXED);
+        if (job->owns_socket && !dfs_is_frame(job->buffer, job->len))
         {
-            close(fd);
-            write(client_sock, "ERROR: Failed to send file size", 31);
-            return -1;
+            job = read_text_command(job);
         }
-        
-        // Send file data
-        off_t remaining = st.st_size;
-        char buffer[BUFFER_SIZE];
-        while (remaining > 0) 
+        int ret = handle_client(conn, job->buffer, job->len);
+        finish_work();
+
+        if (job->owns_socket)
         {
-            ssize_t n = read(fd, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-            if (n <= 0) 
+            if (ret < 0)
             {
-                close(fd);
-                write(client_sock, "ERROR: File transfer failed", 27);
-                return -1;
+                stop_reading(conn);
             }
-            if (write(client_sock, buffer, n) != n) 
+            else if (conn->len > 0)
             {
-                close(fd);
-                write(client_sock, "ERROR: File transfer failed", 27);
-                return -1;
+                read_command(conn); // The next command arrived with this one, no event will announce it
             }
-            remaining -= n;
-        }
-        close(fd);
-        return 0;
+            else
+            {
+                rearm_connection(conn);
+            }
+        }
+
+        // Taken before finishing, as the connection may be freed once its last request is done
+        struct request_job *next = next_held(conn);
+        free(job);
+        finish_request(conn);
+        job = next;
     }
-    
-    // File not in S1 - forward to appropriate server
-    char *ext = strrchr(filename, '.');
-    int target_port = 0;
-    if (strcmp(ext, ".pdf") == 0) 
+    wake_stalled();
+}
+
+// Function to receive the rest of a text command
+// Text commands have no frame. Line-based clients end them with a newline; older clients send each
+// one in a single write and wait for the reply, so a command without a newline is complete once no
+// more of it has arrived for TEXT_COMMAND_WAIT milliseconds, however it was split on the way.
+// Bytes read past the newline belong to the next command and go back to the connection buffer.
+struct request_job *read_text_command(struct request_job *job)
+{
+    size_t max = BUFFER_SIZE - 1;
+    struct request_job *grown = realloc(job, sizeof(struct request_job) + max + 1);
+    if (grown == NULL)
     {
-        target_port = S2_PORT;
-    } 
-    else if (strcmp(ext, ".txt") == 0) 
+        return job;
+    }
+    job = grown;
+
+    struct pollfd pfd = { .fd = job->conn->fd, .events = POLLIN };
+    while (job->len < max && memchr(job->buffer, '\n', job->len) == NULL && 
+           poll(&pfd, 1, TEXT_COMMAND_WAIT) > 0) 
     {
-        target_port = S3_PORT;
-    } 
-    else if (strcmp(ext, ".zip") == 0) 
+        ssize_t n = read(pfd.fd, job->buffer + job->len, max - job->len);
+        if (n > 0) 
+        {
+            job->len += n;
+        }
+        else if (n == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) 
+        {
+            break; // The client is gone; its reply fails to send
+        }
+    }
+
+    char *end = memchr(job->buffer, '\n', job->len);
+    if (end != NULL)
+    {
+        struct connection *conn = job->conn;
+        size_t rest = job->buffer + job->len - (end + 1);
+        memcpy(conn->buffer + conn->len, end + 1, rest);
+        conn->len += rest;
+        job->len -= rest;
+    }
+    job->buffer[job->len] = '\0';
+    return job;
+}
+
+// Function to account for a finished request
+// Resumes reading from a paused connection and frees the connection once it is done with.
+void finish_request(struct connection *conn)
+{
+    pthread_mutex_lock(&conn->lock);
+    conn->inflight--;
+    int resume = conn->paused && conn->inflight < MAX_PIPELINE;
+    if (resume)
+    {
+        conn->paused = 0;
+    }
+    int done = !conn->reading && conn->inflight == 0;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (resume)
+    {
+        rearm_connection(conn);
+    }
+    else if (done)
+    {
+        free_connection(conn);
+    }
+}
+
+// Function to watch a connection for the next readable event
+void rearm_connection(struct connection *conn)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+    {
+        stop_reading(conn);
+    }
+}
+
+// Function to stop receiving requests from a connection
+// The connection is closed right away if no requests are in flight, otherwise by the last one to
+// finish.
+void stop_reading(struct connection *conn)
+{
+    pthread_mutex_lock(&conn->lock);
+    conn->reading = 0;
+    int done = (conn->inflight == 0);
+    pthread_mutex_unlock(&conn->lock);
+
+    if (done)
+    {
+        free_connection(conn);
+    }
+}
+
+// Function to close a connection and release its state
+// Closing the descriptor also removes it from the epoll set.
+void free_connection(struct connection *conn)
+{
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn);
+}
+
+// Function to handle client requests
+// Parses a request received from the client, either a request frame or a text command, and calls
+// the appropriate function. Returns -1 when the session should be closed, 0 to wait for the next one.
+int handle_client(struct connection *conn, char *buffer, size_t len) 
+{
+    struct dfs_request req = { .sock = conn->fd, .write_lock = &conn->write_lock };
+    char *args[DFS_MAX_ARGS];
+    int nargs = 0;
+    
+    if (dfs_is_frame(buffer, len)) 
     {
-        target_port = S4_PORT;
+        // Framed request, the event loop has read exactly one complete frame; other requests of the
+        // connection may be running at the same time
+        struct dfs_header hdr;
+        dfs_decode_header((unsigned char *)buffer, &hdr);
+        req.framed = 1;
+        req.id = hdr.request_id;
+        req.opcode = hdr.opcode;
+        nargs = dfs_split_args(buffer + DFS_HEADER_SIZE, hdr.length, args, DFS_MAX_ARGS);
+        if (verbose) 
+        {
+            printf("Received request %u: opcode %d\n", hdr.request_id, hdr.opcode);
+        }
     } 
     else 
     {
-        write(client_sock, "ERROR: Unsupported file type", 28);
-        return -1;
+        char *saveptr;
+        
+        if (verbose) 
+        {
+            printf("Received command: %s\n", buffer);
+        }
+        
+        // Parse command (tolerate a trailing newline from line-based clients)
+        char *cmd = strtok_r(buffer, " \r\n", &saveptr);
+        if (cmd == NULL) 
+        {
+            dfs_reply_status(&req, DFS_ERR_INVALID, "ERROR: Invalid command");
+            return 0;
+        }
+        
+        int opcode = dfs_opcode_from_name(cmd);
+        if (opcode < 0) 
+        {
+            dfs_reply_status(&req, DFS_ERR_INVALID, "ERROR: Unknown command");
+            return 0;
+        }
+        req.opcode = opcode;
+        
+        char *arg;
+        while (nargs < DFS_MAX_ARGS && (arg = strtok_r(NULL, " \r\n", &saveptr)) != NULL) 
+        {
+            args[nargs++] = arg;
+        }
     }
     
-    // Forward request to target server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "downlf %s", filename);
-    int sockfd;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
+    return dispatch_request(&req, args, nargs);
+}
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) 
+// Function to call the handler for a parsed request
+// Returns -1 when the client ends its session.
+int dispatch_request(struct dfs_request *req, char *args[], int nargs) 
+{
+    switch (req->opcode) 
+    {
+        case DFS_OP_EXIT:
+            // Client is ending its session
+            return -1;
+        case DFS_OP_UPLOADF:
+            // Handle file upload
+            if (nargs < 2) 
+            {
+                reject_upload(req, DFS_ERR_INVALID, "ERROR: Invalid uploadf command format");
+                return 0;
+            }
+            if (!dfs_valid_path(args[1])) 
+            {
+                reject_upload(req, DFS_ERR_INVALID, "ERROR: Path must be below ~S1");
+                return 0;
+            }
+            upload_file(req, args[0], args[1]);
+            break;
+        case DFS_OP_DOWNLF:
+            // Handle file download
+            if (nargs < 1) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid downlf command format");
+                return 0;
+            }
+            if (!dfs_valid_path(args[0])) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Path must be below ~S1");
+                return 0;
+            }
+            download_file(req, args[0]);
+            break;
+        case DFS_OP_REMOVEF:
+            // Handle file removal
+            if (nargs < 1) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid removef command format");
+                return 0;
+            }
+            if (!dfs_valid_path(args[0])) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Path must be below ~S1");
+                return 0;
+            }
+            remove_file(req, args[0]);
+            break;
+        case DFS_OP_DOWNLTAR:
+            // Handle tar file download, of the files changed since args[1] if given
+            if (nargs < 1) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid downltar command format");
+                return 0;
+            }
+            download_tar(req, args[0], (nargs > 1) ? args[1] : NULL, nargs > 2 && strcmp(args[2], TAR_ARG_GZIP) == 0);
+            break;
+        case DFS_OP_DISPFNAMES:
+            // Handle display filenames request, of at most args[1] names after args[2] in the order args[3] if given
+            if (nargs < 1) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid dispfnames command format");
+                return 0;
+            }
+            if (!dfs_valid_path(args[0])) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Path must be below ~S1");
+                return 0;
+            }
+            display_filenames(req, args[0], (nargs > 1) ? args[1] : NULL, (nargs > 2) ? args[2] : NULL, 
+                              (nargs > 3) ? args[3] : NULL);
+            break;
+        default:
+            // Handle unknown command
+            dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Unknown command");
+            break;
+    }
+    
+    return 0;
+}
+
+// Function to refuse an upload
+// A framed client has already started sending the file, so it is drained first to keep the
+// connection in sync. Text clients only send the file after READY, which they never get.
+void reject_upload(struct dfs_request *req, uint32_t status, const char *msg) 
+{
+    if (req->framed) 
+    {
+        dfs_recv_upload(req, -1);
+    }
+    dfs_reply_status(req, status, msg);
+}
+
+// Function to upload a file to S1 or forward it to the appropriate server
+// Determines the file's type based on the extension. .c files are stored in S1, other files are
+// streamed through to their server as they arrive and never touch S1's disk.
+int upload_file(struct dfs_request *req, char *filename, char *dest_path) 
+{
+    // Determine file type before accepting any data
+    char *ext = strrchr(filename, '.');
+    if (ext == NULL) 
+    {
+        reject_upload(req, DFS_ERR_UNSUPPORTED, "ERROR: File has no extension");
+        return -1;
+    }
+    
+    // Determine which server should handle this file; .c files stay in S1
+    int target = route_type(ext);
+    if (target < 0) 
+    {
+        reject_upload(req, DFS_ERR_UNSUPPORTED, "ERROR: Unsupported file type");
+        return -1;
+    }
+    
+    // Create destination path in S1
+    char s1_path[MAX_PATH_LEN];
+    snprintf(s1_path, MAX_PATH_LEN, "%s%s", STORAGE_ROOT, dest_path + 3); // +3 to skip "~S1"
+    
+    // Create directory tree if needed; S1 holds the directories for all file types
+    if (create_directory_tree(s1_path) < 0) 
+    {
+        reject_upload(req, DFS_ERR_IO, "ERROR: Failed to create directory");
+        return -1;
+    }
+    ns_add_dir(dest_path + 3);
+    
+    // Construct full file path
+    char *base_name = basename(filename);
+    char full_path[MAX_PATH_LEN];
+    if (snprintf(full_path, MAX_PATH_LEN, "%s/%s", s1_path, base_name) >= MAX_PATH_LEN) 
+    {
+        reject_upload(req, DFS_ERR_INVALID, "ERROR: Destination path too long");
+        return -1;
+    }
+    
+    if (target != DFS_S1) 
+    {
+        // The file goes to the instances its path is routed to, and replaces the copies a file already
+        // stored has elsewhere; the rebalancer later removes copies that are not routed there
+        const char *path = full_path + strlen(STORAGE_ROOT);
+        struct move_lock *lock = move_lock(path);
+        pthread_rwlock_rdlock(&lock->update);
+        int nodes[DFS_MAX_NODES];
+        int count = route_replicas(target, path, nodes);
+        struct ns_file file;
+        if (!ns_lookup(path, &file)) 
+        {
+            file.servers = 0;
+        }
+        for (int node = 0; node < dfs_num_nodes; node++) 
+        {
+            int routed = 0;
+            for (int i = 0; i < count; i++) 
+            {
+                routed |= (nodes[i] == node);
+            }
+            if ((file.servers & (1u << node)) && !routed) 
+            {
+                nodes[count++] = node;
+            }
+        }
+        int ret = forward_upload(req, nodes, count, file.servers, filename, dest_path);
+        __atomic_add_fetch(&lock->generation, 1, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&lock->update);
+        return ret;
+    }
+    
+    // Receive the file data into a temporary file next to it, which replaces the file only once
+    // complete; until then readers see the old file
+    char tmp_path[MAX_PATH_LEN];
+    int fd = -1;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.XXXXXX", s1_path, base_name) < (int)sizeof(tmp_path)) 
+    {
+        fd = mkstemp(tmp_path);
+    }
+    if (fd < 0) 
+    {
+        reject_upload(req, DFS_ERR_IO, "ERROR: Failed to create file");
+        return -1;
+    }
+    fchmod(fd, 0644);
+    
+    // Receive file data
+    struct stat st;
+    int received = (dfs_recv_upload(req, fd) == 0 && fstat(fd, &st) == 0);
+    close(fd);
+    if (!received || rename(tmp_path, full_path) < 0) 
     {
-        write(client_sock, "ERROR: Socket creation failed", 29);
+        unlink(tmp_path);
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: File transfer failed");
         return -1;
     }
+    
+    struct ns_file file = { .servers = 1u << DFS_S1, .size = st.st_size, .mtime = st.st_mtime };
+    ns_add_file(full_path + strlen(STORAGE_ROOT), &file);
+    dfs_reply_status(req, DFS_OK, "SUCCESS: File uploaded to S1");
+    return 0;
+}
 
-    server = gethostbyname("localhost");
-    if (server == NULL) 
+// Function to stream an upload through to the servers storing the copies of a file
+// The request goes to the count server instances in nodes first, then every piece of the file is
+// passed on to all of them as soon as it arrives from the client (cut-through). The client sends
+// the file once, only one chunk is buffered at a time, and the slowest server holds the client back
+// instead of S1 queueing up the file. old_servers are the instances holding the file before.
+// The upload succeeds if one instance stored the file; the rebalancer makes the missing copies.
+int forward_upload(struct dfs_request *req, const int nodes[], int count, unsigned int old_servers, 
+                   char *filename, char *dest_path) 
+{
+    // Send the request to every instance that can be reached
+    const char *args[] = { filename, dest_path };
+    int socks[DFS_MAX_NODES];
+    int reached = 0;
+    for (int i = 0; i < count; i++) 
     {
-        close(sockfd);
-        write(client_sock, "ERROR: Host resolution failed", 29);
+        socks[i] = open_upload(nodes[i], req->id, args);
+        reached += (socks[i] >= 0);
+    }
+    if (reached == 0) 
+    {
+        reject_upload(req, DFS_ERR_UNAVAILABLE, "ERROR: Failed to forward file to target server");
+        return -1;
+    }
+    
+    // Pass the file on, then wait for the servers to store it
+    int out_failed[DFS_MAX_NODES];
+    uint64_t len;
+    int received = dfs_forward_upload(req, socks, count, req->id, out_failed, &len);
+    
+    unsigned int sent = 0, stored = 0;
+    uint32_t status = DFS_ERR_UNAVAILABLE;
+    char response[BUFFER_SIZE] = "ERROR: Failed to forward file to target server";
+    for (int i = 0; i < count; i++) 
+    {
+        struct dfs_header hdr;
+        char msg[BUFFER_SIZE];
+        if (socks[i] < 0) 
+        {
+            continue;
+        }
+        sent |= 1u << nodes[i];
+        if (out_failed[i] || dfs_recv_status(socks[i], &hdr, msg, sizeof(msg), NULL) < 0) 
+        {
+            release_backend(nodes[i], socks[i], 0);
+            continue;
+        }
+        release_backend(nodes[i], socks[i], 1);
+        
+        // The first success is the reply, or else the first refusal
+        if (hdr.status == DFS_OK && stored == 0) 
+        {
+            status = DFS_OK;
+            snprintf(response, sizeof(response), "%s", msg);
+        }
+        else if (hdr.status != DFS_OK && status == DFS_ERR_UNAVAILABLE) 
+        {
+            status = hdr.status;
+            snprintf(response, sizeof(response), "%s", msg);
+        }
+        stored |= (hdr.status == DFS_OK) ? 1u << nodes[i] : 0;
+    }
+    
+    // The servers dropped an incomplete upload, along with the file it replaced; the instances it was
+    // not sent to still hold the file as it was. A refused upload leaves the file as it was.
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dest_path + 3, basename(filename)); // +3 to skip "~S1"
+    struct ns_file file;
+    if (received < 0) 
+    {
+        if ((old_servers & ~sent) != 0 && ns_lookup(path, &file)) 
+        {
+            file.servers = old_servers & ~sent;
+            ns_add_file(path, &file);
+        }
+        else 
+        {
+            ns_remove_file(path);
+        }
+    }
+    else if (stored != 0) 
+    {
+        file = (struct ns_file){ .servers = stored, .size = (off_t)len, .mtime = time(NULL) };
+        ns_add_file(path, &file);
+        if (stored != sent || reached < count) 
+        {
+            wake_rebalancer();
+        }
+    }
+    
+    if (received < 0) 
+    {
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: File transfer failed");
         return -1;
     }
+    
+    dfs_reply_status(req, status, response);
+    return (status == DFS_OK) ? 0 : -1;
+}
 
-    bzero((char *)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(target_port);
+// Function to send an upload request to a server instance
+// Only this step of an upload can be retried, no file data has been consumed yet; a pooled
+// connection the server has dropped is replaced once. Returns the connection, or -1.
+int open_upload(int node, uint32_t id, const char *const args[]) 
+{
+    for (int attempt = 0; attempt < 2; attempt++) 
+    {
+        int reused;
+        int sockfd = acquire_backend(node, &reused);
+        if (sockfd < 0 || dfs_send_request(sockfd, DFS_OP_UPLOADF, id, args, 2) == 0) 
+        {
+            return sockfd;
+        }
+        release_backend(node, sockfd, 0);
+        if (!reused) 
+        {
+            break;
+        }
+    }
+    return -1;
+}
 
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) 
+// Function to download a file from S1 or request it from the appropriate server
+// The namespace index tells whether the file exists and on which server instance; its filters turn
+// most requests for missing files away before the index is even locked. A file it does not know of
+// is reported missing without asking another server, unless the index of the instance the file is
+// routed to is incomplete.
+int download_file(struct dfs_request *req, char *filename) 
+{
+    // The server storing the file's type
+    char *ext = strrchr(filename, '.');
+    int target = (ext != NULL) ? route_type(ext) : DFS_S1;
+    if (target < 0) 
     {
-        close(sockfd);
-        write(client_sock, "ERROR: Connection to server failed", 34);
+        dfs_reply_status(req, DFS_ERR_UNSUPPORTED, "ERROR: Unsupported file type");
+        return -1;
+    }
+    
+    if (!ns_may_exist(filename + 3, route_servers(target))) // +3 to skip "~S1"
+    {
+        dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: File not found");
+        return -1;
+    }
+    
+    struct ns_file file;
+    if (target == DFS_S1) 
+    {
+        if (!ns_lookup(filename + 3, &file)) 
+        {
+            dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: File not found");
+            return -1;
+        }
+        
+        // File exists in S1 - send it directly
+        char s1_path[MAX_PATH_LEN];
+        snprintf(s1_path, MAX_PATH_LEN, "%s%s", STORAGE_ROOT, filename + 3);
+        
+        struct stat st;
+        int fd = open(s1_path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) 
+        {
+            int missing = (errno == ENOENT);
+            if (fd >= 0) 
+            {
+                close(fd);
+            }
+            if (missing) 
+            {
+                // Removed from the disk behind S1's back
+                ns_remove_file(filename + 3);
+                dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: File not found");
+                return -1;
+            }
+            dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to open file");
+            return -1;
+        }
+        
+        // Send file size and data
+        int ret = dfs_reply_file_body(req, fd, st.st_size);
+        close(fd);
+        return ret;
+    }
+    
+    // File not in S1 - forward to an instance storing a copy. The lock keeps the rebalancer from
+    // removing the copy before the server has opened it.
+    struct move_lock *lock = move_lock(filename + 3);
+    pthread_rwlock_rdlock(&lock->lookup);
+    int nodes[DFS_MAX_NODES];
+    int count = find_copies(target, filename + 3, &file, nodes);
+    if (count == 0) 
+    {
+        pthread_rwlock_unlock(&lock->lookup);
+        dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: File not found");
+        return -1;
+    }
+    
+    // Take the file from the least loaded instance, or whichever answers first if it is slow
+    const char *args[] = { filename };
+    struct dfs_header hdr;
+    char msg[BUFFER_SIZE];
+    int64_t size;
+    int node;
+    int sockfd = hedged_download(nodes, count, req->id, args, &hdr, msg, sizeof(msg), &size, &node);
+    pthread_rwlock_unlock(&lock->lookup);
+    if (sockfd < 0) 
+    {
+        dfs_reply_status(req, hdr.status, msg);
         return -1;
     }
+    return relay_reply(req, node, sockfd, &hdr, msg, size);
+}
 
-    // Send command to target server
-    if (write(sockfd, command, strlen(command)) < 0) 
+// Function to remove a file from S1 or request its removal from another server
+// The namespace index tells whether the file exists and on which server instance; its filters turn
+// most requests for missing files away before the index is even locked. A file it does not know of
+// is reported missing without asking another server, unless the index of the instance the file is
+// routed to is incomplete.
+int remove_file(struct dfs_request *req, char *filename) 
+{
+    // The server storing the file's type
+    char *ext = strrchr(filename, '.');
+    if (ext == NULL) 
+    {
+        dfs_reply_status(req, DFS_ERR_UNSUPPORTED, "ERROR: File has no extension");
+        return -1;
+    }
+    
+    int target = route_type(ext);
+    if (target < 0 || !ns_may_exist(filename + 3, route_servers(target))) // +3 to skip "~S1"
+    {
+        dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: File not found");
+        return -1;
+    }
+    
+    struct ns_file file;
+    if (target == DFS_S1) 
+    {
+        if (!ns_lookup(filename + 3, &file)) 
+        {
+            dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: File not found");
+            return -1;
+        }
+        
+        char s1_path[MAX_PATH_LEN];
+        snprintf(s1_path, MAX_PATH_LEN, "%s%s", STORAGE_ROOT, filename + 3);
+        
+        if (unlink(s1_path) == 0) 
+        {
+            ns_remove_file(filename + 3);
+            dfs_reply_status(req, DFS_OK, "SUCCESS: File deleted from S1");
+            return 0;
+        }
+        if (errno == ENOENT) 
+        {
+            ns_remove_file(filename + 3); // Removed from the disk behind S1's back
+        }
+        dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: File not found");
+        return -1;
+    }
+    
+    // File not in S1 - ask the instances storing its copies, while the file is not being moved
+    struct move_lock *lock = move_lock(filename + 3);
+    pthread_rwlock_rdlock(&lock->update);
+    int nodes[DFS_MAX_NODES];
+    int count = find_copies(target, filename + 3, &file, nodes);
+    if (count == 0) 
+    {
+        pthread_rwlock_unlock(&lock->update);
+        dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: File not found");
+        return -1;
+    }
+    
+    // Request deletion from every instance; the first success is the reply
+    const char *args[] = { filename };
+    char response[BUFFER_SIZE] = "ERROR: Failed to delete file from target server";
+    uint32_t status = DFS_ERR_UNAVAILABLE;
+    int answered = 0;
+    for (int i = 0; i < count; i++) 
+    {
+        char msg[BUFFER_SIZE];
+        uint32_t node_status;
+        if (send_to_server(nodes[i], DFS_OP_REMOVEF, args, 1, msg, &node_status) < 0) 
+        {
+            continue;
+        }
+        answered = 1;
+        
+        // Either way the file is gone from the server
+        if (node_status == DFS_OK || node_status == DFS_ERR_NOT_FOUND) 
+        {
+            file.servers &= ~(1u << nodes[i]);
+        }
+        if (status != DFS_OK) 
+        {
+            status = node_status;
+            snprintf(response, sizeof(response), "%s", msg);
+        }
+    }
+    
+    // Copies on instances that could not be reached are still there
+    if (answered && file.servers == 0) 
+    {
+        ns_remove_file(filename + 3);
+    }
+    else if (answered) 
+    {
+        ns_add_file(filename + 3, &file);
+        status = DFS_ERR_UNAVAILABLE;
+        snprintf(response, sizeof(response), "ERROR: Failed to delete file from every server holding it");
+    }
+    __atomic_add_fetch(&lock->generation, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&lock->update);
+    
+    dfs_reply_status(req, status, response);
+    return (status == DFS_OK) ? 0 : -1;
+}
+
+// Function to download a tar file containing files of a specific type
+// filetype is one type, a comma-separated set of types such as ".c,.pdf", or "all". .c files are
+// archived locally, a single other type is relayed from its server and sets are merged into one
+// archive from all the servers involved. With since_arg (seconds since the epoch) only files
+// modified at or after that time are archived. With compress set the archive is gzip compressed,
+// by the server holding the files or, for a merged archive, by S1.
+int download_tar(struct dfs_request *req, char *filetype, char *since_arg, int compress) 
+{
+    unsigned int servers;
+    time_t since;
+    if (parse_tar_types(filetype, &servers) < 0) 
+    {
+        dfs_reply_status(req, DFS_ERR_UNSUPPORTED, "ERROR: Unsupported file type for tar");
+        return -1;
+    }
+    if (tar_parse_since(since_arg, &since) < 0) 
+    {
+        dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid downltar command format");
+        return -1;
+    }
+    if (compress && !req->framed) 
+    {
+        dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Compressed archives need the framed protocol");
+        return -1;
+    }
+
+    if (servers == (1u << DFS_S1)) 
+    {
+        // Handle .c files in S1, the archive is streamed as it is built
+        if (compress) 
+        {
+            return gzip_tar_reply(req, STORAGE_ROOT, ".c", since);
+        }
+        return tar_reply(req, STORAGE_ROOT, ".c", since);
+    } 
+    for (int server = DFS_S2; server < DFS_NUM_SERVERS; server++) 
+    {
+        unsigned int nodes = route_servers(server);
+        if (servers == (1u << server) && (nodes & (nodes - 1)) == 0) 
+        {
+            // Handle .pdf, .txt and .zip files from other servers running alone
+            const char *args[] = { route_types[server], (since_arg != NULL) ? since_arg : "0", TAR_ARG_GZIP };
+            return relay_from_server(req, server, DFS_OP_DOWNLTAR, args, compress ? 3 : (since_arg != NULL) ? 2 : 1);
+        }
+    }
+    return merge_tar(req, servers, since_arg, since, compress);
+}
+
+// Function to find the servers storing the file types of a downltar request
+// Sets a bit for each server in *servers. Returns -1 if a type is not supported.
+int parse_tar_types(char *filetype, unsigned int *servers) 
+{
+    char types[BUFFER_SIZE];
+    char *saveptr;
+
+    *servers = 0;
+    if (strcmp(filetype, "all") == 0) 
+    {
+        *servers = (1u << DFS_NUM_SERVERS) - 1;
+        return 0;
+    }
+
+    snprintf(types, sizeof(types), "%s", filetype);
+    for (char *type = strtok_r(types, ",", &saveptr); type != NULL; type = strtok_r(NULL, ",", &saveptr)) 
+    {
+        int server = route_type(type);
+        if (server < 0) 
+        {
+            return -1;
+        }
+        *servers |= 1u << server;
+    }
+    return (*servers != 0) ? 0 : -1;
+}
+
+// Function to send one archive holding the files of several servers
+// All the servers, every instance of each, are asked for their archives at once and collect their
+// files while S1 collects its own. The .c files go first, then the entries of the other archives are passed on as whole entries
+// from whichever server has data ready, so a slow server does not hold up the others.
+// A compressed archive is compressed as a whole by S1.
+int merge_tar(struct dfs_request *req, unsigned int servers, char *since_arg, time_t since, int compress) 
+{
+    static const char end_marker[TAR_END_SIZE];
+    struct archive_source sources[DFS_MAX_NODES];
+    int nsources = 0;
+
+    // Replicated files come from several instances and only one copy of each goes into the archive,
+    // so its size is not known in advance
+    int dedupe = 0;
+    for (int server = DFS_S2; server < DFS_NUM_SERVERS && dfs_replicas > 1; server++) 
+    {
+        unsigned int instances = route_servers(server);
+        dedupe |= (servers & (1u << server)) && (instances & (instances - 1)) != 0;
+    }
+    if (dedupe && !req->framed) 
+    {
+        dfs_reply_status(req, DFS_ERR_UNSUPPORTED, "ERROR: Archives of replicated files need the framed protocol");
+        return -1;
+    }
+
+    for (int node = 0; node < dfs_num_nodes; node++) 
+    {
+        enum dfs_server server = dfs_servers[node].server;
+        if (server == DFS_S1 || !(servers & (1u << server))) 
+        {
+            continue;
+        }
+
+        struct archive_source *src = &sources[nsources++];
+        const char *args[] = { route_types[server], since_arg };
+        unsigned int instances = route_servers(server);
+        src->node = node;
+        src->since_arg = since_arg;
+        src->frame_left = 0;
+        src->peers = (dfs_replicas > 1 && (instances & (instances - 1)) != 0) ? instances : 0;
+        src->sock = acquire_backend(node, &src->reused);
+        if (src->sock >= 0 && dfs_send_request(src->sock, DFS_OP_DOWNLTAR, req->id, args, (since_arg != NULL) ? 2 : 1) < 0) 
+        {
+            release_backend(node, src->sock, 0);
+            src->sock = -1;
+        }
+    }
+
+    struct tar_list list = { 0 };
+    int local = (servers & (1u << DFS_S1)) != 0;
+    if (local && tar_collect(&list, STORAGE_ROOT, route_types[DFS_S1], since) < 0) 
+    {
+        tar_free(&list);
+        close_archives(sources, nsources);
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to create tar file");
+        return -1;
+    }
+
+    // Every archive but the last loses its end marker
+    off_t size = TAR_END_SIZE;
+    if (local) 
+    {
+        size += tar_archive_size(&list) - TAR_END_SIZE;
+    }
+    char msg[BUFFER_SIZE], failed_msg[BUFFER_SIZE];
+    uint32_t status = DFS_OK, failed_status = DFS_OK;
+    unsigned int live = 0;
+    for (int i = 0; i < nsources; i++) 
+    {
+        if (open_archive(&sources[i], req->id, msg, sizeof(msg), &status) == 0) 
+        {
+            live |= 1u << sources[i].node;
+            size += sources[i].size - TAR_END_SIZE;
+        }
+        else if (failed_status == DFS_OK) 
+        {
+            failed_status = status;
+            snprintf(failed_msg, sizeof(failed_msg), "%s", msg);
+        }
+    }
+    
+    // An instance of a replicated server may be missing as long as the others hold all its files
+    int active = 0;
+    for (int i = 0; i < nsources && failed_status != DFS_OK; i++) 
+    {
+        if (sources[i].sock < 0 && (sources[i].peers == 0 || !held_elsewhere(sources[i].node, live, since))) 
+        {
+            close_archives(sources, nsources);
+            tar_free(&list);
+            dfs_reply_status(req, failed_status, failed_msg);
+            return -1;
+        }
+    }
+    for (int i = 0; i < nsources; i++) 
+    {
+        sources[i].peers &= live;
+        active += (sources[i].sock >= 0);
+    }
+
+    // The merged archive goes into the reply, or through the compression threads
+    struct gzip_stream *gz = NULL;
+    struct tar_sink sink;
+    tar_reply_sink(req, &sink);
+    if (compress) 
+    {
+        gz = gzip_open(&sink);
+        if (gz == NULL) 
+        {
+            close_archives(sources, nsources);
+            tar_free(&list);
+            dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to start compression");
+            return -1;
+        }
+        gzip_sink(gz, &sink);
+    }
+
+    int on = 1, off = 0;
+    setsockopt(req->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+
+    int ret = dfs_reply_begin(req, (compress || dedupe) ? -1 : size);
+    if (ret == 0 && local) 
+    {
+        ret = tar_send(&sink, &list, 0);
+    }
+    tar_free(&list);
+
+    while (ret == 0 && active > 0) 
+    {
+        struct pollfd pfds[DFS_MAX_NODES];
+        struct archive_source *polled[DFS_MAX_NODES];
+        int npfds = 0;
+        for (int i = 0; i < nsources; i++) 
+        {
+            if (sources[i].sock >= 0) 
+            {
+                pfds[npfds].fd = sources[i].sock;
+                pfds[npfds].events = POLLIN;
+                polled[npfds++] = &sources[i];
+            }
+        }
+
+        if (poll(pfds, npfds, -1) < 0) 
+        {
+            ret = (errno == EINTR) ? 0 : -1;
+            continue;
+        }
+        for (int i = 0; i < npfds && ret == 0; i++) 
+        {
+            if (pfds[i].revents != 0) 
+            {
+                int ended = relay_archive_entry(&sink, polled[i]);
+                ret = (ended < 0) ? -1 : 0;
+                active -= (ended > 0);
+            }
+        }
+    }
+    if (ret == 0) 
+    {
+        ret = sink.data(sink.ctx, end_marker, sizeof(end_marker));
+    }
+    if (gz != NULL && gzip_close(gz) < 0) 
+    {
+        ret = -1;
+    }
+
+    // A server that failed part way leaves the archive incomplete
+    close_archives(sources, nsources);
+    dfs_reply_end(req, (ret == 0) ? DFS_OK : DFS_ERR_UNAVAILABLE);
+    setsockopt(req->sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    return ret;
+}
+
+// Function to close the connections of archives that have not ended
+// They are not in sync any more, so they do not go back to the pool.
+void close_archives(struct archive_source *sources, int nsources) 
+{
+    for (int i = 0; i < nsources; i++) 
+    {
+        if (sources[i].sock >= 0) 
+        {
+            release_backend(sources[i].node, sources[i].sock, 0);
+            sources[i].sock = -1;
+        }
+    }
+}
+
+// Function to receive a server's reply to the downltar request sent on src->sock
+// A pooled connection the server has dropped fails right away; the request is then sent again on a
+// new connection. On failure *status and msg describe the problem for the client.
+int open_archive(struct archive_source *src, uint32_t id, char *msg, size_t msg_size, uint32_t *status) 
+{
+    struct dfs_header hdr;
+    const char *args[] = { route_types[dfs_servers[src->node].server], src->since_arg };
+
+    int retry = (src->sock < 0); // Sending the request failed
+    if (!retry && dfs_recv_status(src->sock, &hdr, msg, msg_size, &src->size) < 0) 
+    {
+        release_backend(src->node, src->sock, 0);
+        src->sock = -1;
+        retry = src->reused;
+    }
+    if (retry) 
+    {
+        src->sock = request_from_server(src->node, DFS_OP_DOWNLTAR, id, args, (src->since_arg != NULL) ? 2 : 1, 
+                                        &hdr, msg, msg_size, &src->size);
+    }
+    if (src->sock < 0) 
+    {
+        *status = DFS_ERR_UNAVAILABLE;
+        snprintf(msg, msg_size, "ERROR: Connection to server failed");
+        return -1;
+    }
+    if (hdr.status != DFS_OK || src->size < TAR_END_SIZE) 
+    {
+        release_backend(src->node, src->sock, hdr.status != DFS_OK);
+        src->sock = -1;
+        *status = (hdr.status != DFS_OK) ? hdr.status : DFS_ERR_IO;
+        if (hdr.status == DFS_OK) 
+        {
+            snprintf(msg, msg_size, "ERROR: Invalid archive from server");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Function to pass the next entry of an archive on to the client
+// An entry is its header and its data; metadata entries such as long names are held back and passed
+// on together with the entry they belong to, or dropped with it if another instance sends the copy
+// of the file that goes into the archive. Returns 1 once the archive has ended, 0 after an entry,
+// -1 on failure.
+int relay_archive_entry(const struct tar_sink *sink, struct archive_source *src) 
+{
+    unsigned char held[ARCHIVE_HELD_MAX + TAR_BLOCK_SIZE];
+    size_t nheld = 0;
+    char name[PATH_MAX] = "", long_name[PATH_MAX] = "";
+    off_t size;
+    int extension;
+
+    do 
+    {
+        unsigned char *block = held + nheld;
+        if (nheld + TAR_BLOCK_SIZE > sizeof(held) || read_archive(src, block, TAR_BLOCK_SIZE) < 0) 
+        {
+            return -1;
+        }
+
+        int entry = tar_read_header(block, &size, &extension);
+        if (entry <= 0) 
+        {
+            return (entry == 0 && nheld == 0) ? finish_archive(src) : -1;
+        }
+        nheld += TAR_BLOCK_SIZE;
+        int is_long_name = tar_entry_name(block, name, sizeof(name));
+        if (extension) 
+        {
+            if (nheld + size > sizeof(held) - TAR_BLOCK_SIZE || read_archive(src, held + nheld, size) < 0) 
+            {
+                return -1;
+            }
+            if (is_long_name) 
+            {
+                snprintf(long_name, sizeof(long_name), "%.*s", (int)size, (char *)held + nheld);
+            }
+            nheld += size;
+        }
+    } while (extension);
+
+    if (!keep_archive_entry(src, (long_name[0] != '\0') ? long_name : name)) 
+    {
+        return skip_archive(src, size);
+    }
+    if (sink->data(sink->ctx, held, nheld) < 0) 
+    {
+        return -1;
+    }
+
+    // Uncompressed, the data goes from socket to socket like any relayed body
+    while (size > 0) 
+    {
+        if (src->frame_left == 0 && next_archive_frame(src) < 0) 
+        {
+            return -1;
+        }
+        uint64_t n = ((uint64_t)size < src->frame_left) ? (uint64_t)size : src->frame_left;
+        if (sink->copy(sink->ctx, src->sock, n) < 0) 
+        {
+            return -1;
+        }
+        src->frame_left -= n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Function to decide whether an archive entry goes into a merged archive
+// Of the copies of a replicated file, the one from the lowest numbered live instance holding it is
+// taken. Files the index does not know are taken from every instance sending them.
+int keep_archive_entry(const struct archive_source *src, const char *name) 
+{
+    if (src->peers == 0) 
+    {
+        return 1;
+    }
+
+    char path[PATH_MAX];
+    struct ns_file file;
+    snprintf(path, sizeof(path), "/%s", name);
+    if (!ns_lookup(path, &file)) 
+    {
+        return 1;
+    }
+    unsigned int holders = file.servers & src->peers;
+    return holders == 0 || __builtin_ctz(holders) == src->node;
+}
+
+// Function to tell whether every file an instance holds that was modified at or after since also
+// has a copy on one of the instances in live
+// Used to leave an instance that cannot be reached out of an archive. Files of an instance whose
+// manifest the index does not hold are unknown, so it cannot be left out then.
+int held_elsewhere(int node, unsigned int live, time_t since) 
+{
+    if (!ns_complete(node)) 
+    {
+        return 0;
+    }
+    size_t size = REBALANCE_BATCH * (PATH_MAX + 4);
+    char *names = malloc(size);
+    if (names == NULL) 
+    {
+        return 0;
+    }
+    
+    char cursor[PATH_MAX] = "";
+    int held = 1, more = 1;
+    while (held && more) 
+    {
+        size_t len;
+        int count = ns_list("/", 1u << node, (cursor[0] != '\0') ? cursor : NULL, names, size, &len, 
+                            REBALANCE_BATCH, &more);
+        if (count <= 0) 
+        {
+            break;
+        }
+        
+        char *name = names;
+        for (int i = 0; i < count && held; i++) 
+        {
+            char *end = memchr(name, '\n', names + len - name);
+            *end = '\0';
+            snprintf(cursor, sizeof(cursor), "%s", name + 3); // +3 to skip "~S1"
+            name = end + 1;
+            
+            struct ns_file file;
+            held = !ns_lookup(cursor, &file) || file.mtime < since || (file.servers & live) != 0;
+        }
+    }
+    free(names);
+    return held;
+}
+
+// Function to skip len bytes of an archive
+int skip_archive(struct archive_source *src, off_t len) 
+{
+    while (len > 0) 
+    {
+        if (src->frame_left == 0 && next_archive_frame(src) < 0) 
+        {
+            return -1;
+        }
+        uint64_t n = ((uint64_t)len < src->frame_left) ? (uint64_t)len : src->frame_left;
+        if (dfs_skip(src->sock, n) < 0) 
+        {
+            return -1;
+        }
+        src->frame_left -= n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to read len bytes of an archive, across the DATA frames it arrives in
+int read_archive(struct archive_source *src, void *buf, size_t len) 
+{
+    char *p = buf;
+    while (len > 0) 
+    {
+        if (src->frame_left == 0 && next_archive_frame(src) < 0) 
+        {
+            return -1;
+        }
+        size_t n = (len < src->frame_left) ? len : (size_t)src->frame_left;
+        if (dfs_read_full(src->sock, p, n) < 0) 
+        {
+            return -1;
+        }
+        src->frame_left -= n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Function to start reading the next DATA frame of an archive
+// The archive must not end before its end marker.
+int next_archive_frame(struct archive_source *src) 
+{
+    struct dfs_header hdr;
+    if (dfs_recv_header(src->sock, &hdr) < 0 || hdr.opcode != DFS_OP_DATA || (hdr.flags & DFS_FLAG_END)) 
+    {
+        return -1;
+    }
+    src->frame_left = hdr.length;
+    return 0;
+}
+
+// Function to skip the end marker of an archive and the rest of its body
+// The connection goes back to the pool if the server finished the body successfully.
+int finish_archive(struct archive_source *src) 
+{
+    struct dfs_header hdr;
+    uint32_t status = DFS_ERR_UNAVAILABLE;
+    int complete = 0;
+
+    if (dfs_skip(src->sock, src->frame_left) == 0) 
+    {
+        while (dfs_recv_header(src->sock, &hdr) == 0 && hdr.opcode == DFS_OP_DATA) 
+        {
+            if (dfs_skip(src->sock, hdr.length) < 0) 
+            {
+                break;
+            }
+            if (hdr.flags & DFS_FLAG_END) 
+            {
+                status = hdr.status;
+                complete = 1;
+                break;
+            }
+        }
+    }
+
+    release_backend(src->node, src->sock, complete);
+    src->sock = -1;
+    return (status == DFS_OK) ? 1 : -1;
+}
+
+// Function to display filenames from S1 and other servers
+// The files below the directory are listed from the namespace index: S1's .c files first, then
+// those of S2, S3 and S4, or in the order order_arg asks for. The files of the instances of one
+// server are merged into one walk of the tree. Instances whose index is incomplete are all asked
+// for their lists before any is read, so they work on them at the same time. The names are
+// sent as they are found, at most limit_arg of them, after the name after.
+int display_filenames(struct dfs_request *req, char *pathname, char *limit_arg, char *after, char *order_arg) 
+{
+    const char *path = pathname + 3; // +3 to skip "~S1"
+    enum listing_order order = ORDER_TYPE;
+    int valid = 1;
+    if (order_arg != NULL && strcmp(order_arg, NS_ORDER_NAME) == 0) 
+    {
+        order = ORDER_NAME;
+    }
+    else if (order_arg != NULL && strcmp(order_arg, NS_ORDER_ARRIVAL) == 0) 
+    {
+        order = ORDER_ARRIVAL;
+    }
+    else if (order_arg != NULL && strcmp(order_arg, NS_ORDER_TYPE) != 0) 
+    {
+        valid = 0;
+    }
+    if (after != NULL && after[0] == '\0') 
+    {
+        after = NULL;
+    }
+    size_t left;
+    if (!valid || ns_parse_limit(limit_arg, &left) < 0 || (after != NULL && order == ORDER_ARRIVAL) || 
+        (after != NULL && (strncmp(after, "~S1/", 4) != 0 || ns_cursor_below(path, after + 3) == NULL))) 
+    {
+        dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid dispfnames command format");
+        return -1;
+    }
+    if (!ns_is_dir(path)) 
+    {
+        dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: Invalid directory path");
+        return -1;
+    }
+    
+    // Listed by type, the listing resumes with the server storing the type of the cursor's file
+    int first = DFS_S1;
+    if (after != NULL && order == ORDER_TYPE) 
+    {
+        char *ext = strrchr(after, '.');
+        first = (ext != NULL) ? route_type(ext) : -1;
+        if (first < 0) 
+        {
+            dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid dispfnames command format");
+            return -1;
+        }
+    }
+    
+    // The servers get the whole limit, the names they send past it are not read
+    char server_limit[32];
+    snprintf(server_limit, sizeof(server_limit), "%zu", (left == SIZE_MAX) ? (size_t)0 : left);
+    
+    // One listing from the index per server, and one from each instance the index is incomplete for;
+    // a server's listings are next to each other
+    struct listing_source *sources = malloc((dfs_num_nodes + DFS_NUM_SERVERS) * sizeof(*sources));
+    int nsources = 0;
+    char *out = malloc(DFS_CHUNK_SIZE);
+    int ret = (sources != NULL && out != NULL) ? 0 : -1;
+    for (int server = first; ret == 0 && server < DFS_NUM_SERVERS; server++) 
+    {
+        const char *from = (server == first || order == ORDER_NAME) ? after : NULL;
+        unsigned int indexed = 0;
+        for (int node = 0; ret == 0 && node < dfs_num_nodes; node++) 
+        {
+            if (!(route_servers(server) & (1u << node))) 
+            {
+                continue;
+            }
+            if (node == DFS_S1 || index_complete(node)) 
+            {
+                indexed |= 1u << node;
+            }
+            else if ((ret = open_listing(&sources[nsources], server, node, 0, req->id, pathname, server_limit, from)) == 0) 
+            {
+                nsources++;
+            }
+        }
+        if (ret == 0 && indexed != 0 && 
+            (ret = open_listing(&sources[nsources], server, -1, indexed, req->id, pathname, server_limit, from)) == 0) 
+        {
+            nsources++;
+        }
+    }
+    if (ret < 0) 
+    {
+        close_listings(sources, nsources);
+        free(sources);
+        free(out);
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to list files");
+        return -1;
+    }
+    
+    ret = dfs_reply_begin(req, -1);
+    size_t limit = left, used = 0;
+    if (order == ORDER_TYPE) 
+    {
+        int i = 0;
+        while (ret == 0 && i < nsources) 
+        {
+            int end = i + 1;
+            while (end < nsources && sources[end].server == sources[i].server) 
+            {
+                end++;
+            }
+            ret = merge_names(req, sources + i, end - i, path, &left, out, &used);
+            i = end;
+        }
+    }
+    else if (order == ORDER_NAME) 
+    {
+        ret = merge_names(req, sources, nsources, path, &left, out, &used);
+    }
+    else 
+    {
+        ret = merge_arrivals(req, sources, nsources, path, &left, out, &used);
+    }
+    close_listings(sources, nsources);
+    free(sources);
+    
+    if (ret == 0 && used > 0) 
+    {
+        ret = dfs_reply_data(req, out, used);
+    }
+    free(out);
+    
+    // Never an empty reply, the client waits for one
+    if (ret == 0 && left == limit && after == NULL) 
+    {
+        ret = dfs_reply_data(req, "No files found\n", strlen("No files found\n"));
+    }
+    if (ret == 0) 
+    {
+        ret = dfs_reply_end(req, DFS_OK);
+    }
+    return ret;
+}
+
+// Function to start listing a server's files below a directory
+// Names come from the namespace index for the instances with a bit set in nodes (node is then -1);
+// otherwise the request is sent to the instance node, whose reply is read later. Returns -1 if
+// memory runs out.
+int open_listing(struct listing_source *src, enum dfs_server server, int node, unsigned int nodes, uint32_t id, 
+                 const char *pathname, const char *limit_arg, const char *after) 
+{
+    src->server = server;
+    src->node = node;
+    src->nodes = nodes;
+    src->after = after;
+    src->args[0] = pathname;
+    src->args[1] = limit_arg;
+    src->args[2] = after;
+    src->nargs = (after != NULL) ? 3 : 2;
+    src->sock = -1;
+    src->started = 1;
+    src->more = 1;
+    src->frame_left = 0;
+    src->start = 0;
+    src->len = 0;
+    src->buf = malloc(DFS_CHUNK_SIZE);
+    if (src->buf == NULL) 
+    {
+        return -1;
+    }
+    
+    src->from_index = (node < 0);
+    if (!src->from_index) 
+    {
+        src->started = 0;
+        src->sock = acquire_backend(node, &src->reused);
+        if (src->sock >= 0 && dfs_send_request(src->sock, DFS_OP_DISPFNAMES, id, src->args, src->nargs) < 0) 
+        {
+            release_backend(node, src->sock, 0);
+            src->sock = -1;
+        }
+    }
+    return 0;
+}
+
+// Function to receive a server's reply to the dispfnames request sent on src->sock
+// A pooled connection the server has dropped fails right away; the request is then sent again on a
+// new connection. A server that cannot be reached or refuses adds no names.
+int start_listing(struct listing_source *src, uint32_t id) 
+{
+    struct dfs_header hdr;
+    char msg[BUFFER_SIZE];
+    
+    src->started = 1;
+    int retry = (src->sock < 0); // Sending the request failed
+    if (!retry && dfs_recv_status(src->sock, &hdr, msg, sizeof(msg), NULL) < 0) 
+    {
+        release_backend(src->node, src->sock, 0);
+        src->sock = -1;
+        retry = src->reused;
+    }
+    if (retry) 
+    {
+        src->sock = request_from_server(src->node, DFS_OP_DISPFNAMES, id, src->args, src->nargs, &hdr, msg, sizeof(msg), NULL);
+    }
+    if (src->sock < 0) 
+    {
+        return -1;
+    }
+    if (hdr.status != DFS_OK) 
+    {
+        release_backend(src->node, src->sock, 1);
+        src->sock = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to get more names of a listing into its buffer: the next page from the namespace index,
+// or what the server sent up to the end of its current DATA frame
+// Returns 0 once the listing has ended.
+int fill_listing(struct listing_source *src, const char *path, uint32_t id) 
+{
+    // Keep the start of a name cut off at the end of the buffer
+    memmove(src->buf, src->buf + src->start, src->len - src->start);
+    src->len -= src->start;
+    src->start = 0;
+    
+    if (src->from_index) 
+    {
+        size_t len;
+        int more = 0;
+        int count = src->more ? ns_list(path, src->nodes, (src->after != NULL) ? src->after + 3 : NULL, 
+                                        src->buf, DFS_CHUNK_SIZE, &len, SIZE_MAX, &more) : 0;
+        src->more = more;
+        if (count <= 0) 
+        {
+            return 0;
+        }
+        src->len = len;
+        
+        // The next page starts after the last name of this one
+        const char *last = src->buf + len - 1;
+        while (last > src->buf && last[-1] != '\n') 
+        {
+            last--;
+        }
+        memcpy(src->cursor, last, src->buf + len - 1 - last);
+        src->cursor[src->buf + len - 1 - last] = '\0';
+        src->after = src->cursor;
+        return 1;
+    }
+    
+    if (!src->started && start_listing(src, id) < 0) 
+    {
+        return 0;
+    }
+    if (src->sock < 0) 
+    {
+        return 0;
+    }
+    struct dfs_header hdr;
+    while (src->frame_left == 0) 
+    {
+        if (!src->more) 
+        {
+            release_backend(src->node, src->sock, 1);
+            src->sock = -1;
+            return 0;
+        }
+        if (dfs_recv_header(src->sock, &hdr) < 0 || hdr.opcode != DFS_OP_DATA) 
+        {
+            release_backend(src->node, src->sock, 0);
+            src->sock = -1;
+            return 0;
+        }
+        src->frame_left = hdr.length;
+        src->more = !(hdr.flags & DFS_FLAG_END);
+    }
+    
+    if (src->len == DFS_CHUNK_SIZE) 
+    {
+        src->len = 0; // No name is this long, drop the garbage
+    }
+    size_t n = DFS_CHUNK_SIZE - src->len;
+    if (n > src->frame_left) 
+    {
+        n = src->frame_left;
+    }
+    if (dfs_read_full(src->sock, src->buf + src->len, n) < 0) 
+    {
+        release_backend(src->node, src->sock, 0);
+        src->sock = -1;
+        return 0;
+    }
+    src->len += n;
+    src->frame_left -= n;
+    return 1;
+}
+
+// Function to find the next name of a listing, its line including the newline
+// With wait set the listing is read until a whole name is there. The name stays in the buffer until
+// the caller moves src->start past it. Returns 0 if there is no name (yet).
+int next_listing_name(struct listing_source *src, const char *path, uint32_t id, int wait, const char **name, size_t *len) 
+{
+    while (1) 
+    {
+        char *nl = memchr(src->buf + src->start, '\n', src->len - src->start);
+        if (nl != NULL) 
+        {
+            *name = src->buf + src->start;
+            *len = nl + 1 - *name;
+            return 1;
+        }
+        if (!wait || !fill_listing(src, path, id)) 
+        {
+            return 0;
+        }
+    }
+}
+
+// Function to end the listings of a dispfnames reply
+// Connections whose listing was not read to the end are not in sync any more and are closed.
+void close_listings(struct listing_source *sources, int nsources) 
+{
+    for (int i = 0; i < nsources; i++) 
+    {
+        if (sources[i].sock >= 0) 
+        {
+            release_backend(sources[i].node, sources[i].sock, 0);
+        }
+        free(sources[i].buf);
+    }
+}
+
+// Function to add a name to the reply, sending the names gathered in out when it is full
+int send_listing_name(struct dfs_request *req, char *out, size_t *used, const char *name, size_t len) 
+{
+    if (*used + len > DFS_CHUNK_SIZE) 
+    {
+        if (dfs_reply_data(req, out, *used) < 0) 
+        {
+            return -1;
+        }
+        *used = 0;
+    }
+    memcpy(out + *used, name, len);
+    *used += len;
+    return 0;
+}
+
+// Function to pass the names of several listings on in one walk of the tree
+// Each listing's names come in listing order, so the next name is the first of their next ones.
+int merge_names(struct dfs_request *req, struct listing_source *sources, int nsources, const char *path, 
+                size_t *left, char *out, size_t *used) 
+{
+    const char *name;
+    size_t len;
+    int ret = 0;
+    
+    while (ret == 0 && *left > 0) 
+    {
+        struct listing_source *next = NULL;
+        const char *next_name = NULL;
+        size_t next_len = 0;
+        for (int i = 0; i < nsources; i++) 
+        {
+            if (next_listing_name(&sources[i], path, req->id, 1, &name, &len) && 
+                (next == NULL || ns_compare_names(name, len - 1, next_name, next_len - 1) < 0)) 
+            {
+                next = &sources[i];
+                next_name = name;
+                next_len = len;
+            }
+        }
+        if (next == NULL) 
+        {
+            break;
+        }
+        ret = send_listing_name(req, out, used, next_name, next_len);
+        
+        // Copies of a replicated file on other instances are listed once
+        for (int i = 0; i < nsources; i++) 
+        {
+            if (&sources[i] != next && next_listing_name(&sources[i], path, req->id, 1, &name, &len) && 
+                len == next_len && memcmp(name, next_name, len) == 0) 
+            {
+                sources[i].start += len;
+            }
+        }
+        next->start += next_len;
+        (*left)--;
+    }
+    return ret;
+}
+
+// Function to pass the names of several listings on in the order they arrive
+// The index's names are at hand and go first; then whichever server has data ready is read, so a
+// slow server does not hold up the others.
+int merge_arrivals(struct dfs_request *req, struct listing_source *sources, int nsources, const char *path, 
+                   size_t *left, char *out, size_t *used) 
+{
+    const char *name;
+    size_t len;
+    int ret = 0;
+    
+    for (int i = 0; i < nsources; i++) 
+    {
+        while (ret == 0 && *left > 0 && sources[i].from_index && next_listing_name(&sources[i], path, req->id, 1, &name, &len)) 
+        {
+            ret = send_listing_name(req, out, used, name, len);
+            sources[i].start += len;
+            (*left)--;
+        }
+    }
+    
+    while (ret == 0 && *left > 0) 
+    {
+        struct pollfd pfds[DFS_MAX_NODES];
+        struct listing_source *polled[DFS_MAX_NODES];
+        int npolled = 0;
+        for (int i = 0; i < nsources; i++) 
+        {
+            struct listing_source *src = &sources[i];
+            if (!src->from_index && !src->started && src->sock < 0) 
+            {
+                start_listing(src, req->id); // Sending the request failed, try once more
+            }
+            if (!src->from_index && src->sock >= 0) 
+            {
+                pfds[npolled].fd = src->sock;
+                pfds[npolled].events = POLLIN;
+                polled[npolled++] = src;
+            }
+        }
+        if (npolled == 0) 
+        {
+            break;
+        }
+        
+        // The names already received go out before waiting for more
+        if (*used > 0) 
+        {
+            ret = dfs_reply_data(req, out, *used);
+            *used = 0;
+        }
+        if (ret < 0 || poll(pfds, npolled, -1) < 0) 
+        {
+            ret = (ret < 0 || errno != EINTR) ? -1 : 0;
+            continue;
+        }
+        
+        for (int i = 0; i < npolled; i++) 
+        {
+            struct listing_source *src = polled[i];
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) || !fill_listing(src, path, req->id)) 
+            {
+                continue;
+            }
+            while (ret == 0 && *left > 0 && next_listing_name(src, path, req->id, 0, &name, &len)) 
+            {
+                ret = send_listing_name(req, out, used, name, len);
+                src->start += len;
+                (*left)--;
+            }
+        }
+    }
+    return ret;
+}
+
+// Function to tell whether the namespace index holds every file of a server
+// While it does not, the server's manifest is asked for again, at most every MANIFEST_RETRY
+// seconds and by one worker at a time; the others carry on asking the server directly.
+int index_complete(int node) 
+{
+    static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+    static time_t last_attempt[DFS_MAX_NODES];
+    
+    if (ns_complete(node)) 
+    {
+        return 1;
+    }
+    if (pthread_mutex_trylock(&load_lock) != 0) 
+    {
+        return 0;
+    }
+    time_t now = time(NULL);
+    if (!ns_complete(node) && now - last_attempt[node] >= MANIFEST_RETRY) 
+    {
+        last_attempt[node] = now;
+        if (load_manifest(node) == 0) 
+        {
+            ns_snapshot();
+        }
+    }
+    pthread_mutex_unlock(&load_lock);
+    return ns_complete(node);
+}
+
+// Function to find the instances of server target to ask for a file
+// Those holding its copies, in the order to try them, if the index knows the file (which is then
+// returned in file); otherwise those its path is routed to whose files the index does not all hold
+// yet. Returns their number, 0 if the file does not exist.
+int find_copies(enum dfs_server target, const char *path, struct ns_file *file, int nodes[]) 
+{
+    if (ns_lookup(path, file)) 
+    {
+        return order_replicas(file->servers, nodes);
+    }
+    file->servers = 0;
+    
+    int routed[DFS_MAX_NODES];
+    int nrouted = route_replicas(target, path, routed);
+    int count = 0;
+    for (int i = 0; i < nrouted; i++) 
+    {
+        if (!index_complete(routed[i])) 
+        {
+            nodes[count++] = routed[i];
+        }
+    }
+    return count;
+}
+
+// Function to order the instances in the mask servers for reading a file from them
+// The reachable ones come first, the least loaded first: the fewest requests in flight, weighted
+// by how long the instance takes to answer. Equally loaded ones start at a different one each time
+// to share the reads out. Those that recently could not be reached come last. Returns their number.
+int order_replicas(unsigned int servers, int nodes[]) 
+{
+    static unsigned int turn; // Rotates the first instance, updated atomically
+    int up[DFS_MAX_NODES], down[DFS_MAX_NODES];
+    int nup = 0, ndown = 0;
+    for (int node = 0; node < dfs_num_nodes; node++) 
+    {
+        if (servers & (1u << node)) 
+        {
+            if (backend_up(node)) 
+            {
+                up[nup++] = node;
+            }
+            else 
+            {
+                down[ndown++] = node;
+            }
+        }
+    }
+    
+    unsigned int first = (nup > 1) ? __atomic_fetch_add(&turn, 1, __ATOMIC_RELAXED) % nup : 0;
+    double scores[DFS_MAX_NODES];
+    for (int i = 0; i < nup; i++) 
+    {
+        // Insertion sort, stable so that ties keep the rotated order
+        int node = up[(first + i) % nup];
+        double score = backend_score(node);
+        int j = i;
+        while (j > 0 && scores[j - 1] > score) 
+        {
+            nodes[j] = nodes[j - 1];
+            scores[j] = scores[j - 1];
+            j--;
+        }
+        nodes[j] = node;
+        scores[j] = score;
+    }
+    memcpy(nodes + nup, down, ndown * sizeof(int));
+    return nup + ndown;
+}
+
+// Function to request a file from the instances holding its copies, in the order given
+// The next copy is asked when one refuses or cannot be reached, and also, once, when the first has
+// not answered after the time within which its instance answers 95% of downloads. The first copy
+// to be sent is taken and the other request cancelled by closing its connection. Returns the
+// connection, positioned at the body, with hdr, msg and size filled in as by request_from_server(),
+// or -1 with hdr->status and msg telling why no copy can be sent.
+int hedged_download(const int nodes[], int count, uint32_t id, const char *const args[], 
+                    struct dfs_header *hdr, char *msg, size_t msg_size, int64_t *size, int *node) 
+{
+    struct download_attempt running[2];
+    int nrunning = 0, next = 0, hedged = 0;
+    hdr->status = DFS_ERR_UNAVAILABLE;
+    snprintf(msg, msg_size, "ERROR: Connection to server failed");
+    
+    while (nrunning > 0 || next < count) 
+    {
+        if (nrunning == 0) 
+        {
+            nrunning += (start_download(&running[0], nodes[next++], id, args) == 0);
+            continue;
+        }
+        
+        // Hedge a download that is later than its instance usually is
+        int timeout = -1;
+        int64_t delay = (!hedged && nrunning == 1 && next < count) ? hedge_delay(running[0].node) : -1;
+        if (delay >= 0) 
+        {
+            int64_t late = running[0].sent + delay - monotonic_us();
+            if (late <= 0) 
+            {
+                hedged = 1;
+                nrunning += (start_download(&running[1], nodes[next++], id, args) == 0);
+                continue;
+            }
+            timeout = (int)((late + 999) / 1000);
+        }
+        
+        struct pollfd pfds[2];
+        for (int i = 0; i < nrunning; i++) 
+        {
+            pfds[i].fd = running[i].sock;
+            pfds[i].events = POLLIN;
+        }
+        int ready = poll(pfds, nrunning, timeout);
+        if (ready < 0 && errno != EINTR) 
+        {
+            break;
+        }
+        
+        // Downwards, so that a finished request can be replaced by the last one
+        for (int i = nrunning - 1; i >= 0 && ready > 0; i--) 
+        {
+            struct download_attempt *attempt = &running[i];
+            if (pfds[i].revents == 0) 
+            {
+                continue;
+            }
+            
+            struct dfs_header reply;
+            char reply_msg[BUFFER_SIZE];
+            int64_t reply_size;
+            if (dfs_recv_status(attempt->sock, &reply, reply_msg, sizeof(reply_msg), &reply_size) < 0) 
+            {
+                // A pooled connection the server had dropped; the request goes again on a new one
+                release_backend(attempt->node, attempt->sock, 0);
+                int retry = attempt->reused, retry_node = attempt->node;
+                *attempt = running[--nrunning];
+                if (retry) 
+                {
+                    nrunning += (start_download(&running[nrunning], retry_node, id, args) == 0);
+                }
+                continue;
+            }
+            record_latency(attempt->node, monotonic_us() - attempt->sent);
+            *hdr = reply;
+            snprintf(msg, msg_size, "%s", reply_msg);
+            if (reply.status == DFS_OK) 
+            {
+                // The other request lost; it is at least as slow as it has taken so far
+                for (int j = 0; j < nrunning; j++) 
+                {
+                    if (j != i) 
+                    {
+                        record_latency(running[j].node, monotonic_us() - running[j].sent);
+                        release_backend(running[j].node, running[j].sock, 0);
+                    }
+                }
+                *size = reply_size;
+                *node = attempt->node;
+                return attempt->sock;
+            }
+            release_backend(attempt->node, attempt->sock, 1);
+            *attempt = running[--nrunning];
+        }
+    }
+    
+    for (int i = 0; i < nrunning; i++) 
+    {
+        release_backend(running[i].node, running[i].sock, 0);
+    }
+    return -1;
+}
+
+// Function to send a download request to an instance for hedged_download()
+// A pooled connection the server has dropped fails right away; the request is then sent again
+// once on a new connection.
+int start_download(struct download_attempt *attempt, int node, uint32_t id, const char *const args[]) 
+{
+    attempt->node = node;
+    for (int tries = 0; tries < 2; tries++) 
+    {
+        attempt->sock = acquire_backend(node, &attempt->reused);
+        if (attempt->sock < 0) 
+        {
+            return -1;
+        }
+        attempt->sent = monotonic_us();
+        if (dfs_send_request(attempt->sock, DFS_OP_DOWNLF, id, args, 1) == 0) 
+        {
+            return 0;
+        }
+        release_backend(node, attempt->sock, 0);
+        if (!attempt->reused) 
+        {
+            break;
+        }
+    }
+    return -1;
+}
+
+// Function to take the time an instance took to answer a download into its statistics
+void record_latency(int node, int64_t elapsed) 
+{
+    struct backend_load *load = &backend_loads[node];
+    uint32_t sample = (elapsed < UINT32_MAX) ? (uint32_t)elapsed : UINT32_MAX;
+    uint32_t sorted[LATENCY_SAMPLES];
+    
+    pthread_mutex_lock(&load->lock);
+    load->latency = (load->nsamples == 0) ? sample : load->latency + LATENCY_WEIGHT * (sample - load->latency);
+    load->samples[load->next_sample] = sample;
+    load->next_sample = (load->next_sample + 1) % LATENCY_SAMPLES;
+    if (load->nsamples < LATENCY_SAMPLES) 
+    {
+        load->nsamples++;
+    }
+    if (load->nsamples >= HEDGE_MIN_SAMPLES) 
+    {
+        memcpy(sorted, load->samples, load->nsamples * sizeof(uint32_t));
+        qsort(sorted, load->nsamples, sizeof(uint32_t), compare_samples);
+        load->hedge_delay = sorted[(load->nsamples * 95 + 99) / 100 - 1];
+    }
+    pthread_mutex_unlock(&load->lock);
+}
+
+// Function to get how long a download from an instance may take before a second copy is asked
+// Returns -1 while too few of its downloads were timed to tell.
+int64_t hedge_delay(int node) 
+{
+    struct backend_load *load = &backend_loads[node];
+    pthread_mutex_lock(&load->lock);
+    int64_t delay = load->hedge_delay;
+    pthread_mutex_unlock(&load->lock);
+    return (delay < 0 || delay >= HEDGE_MIN_DELAY) ? delay : HEDGE_MIN_DELAY;
+}
+
+// Function to rate the load of an instance, lower is better
+// An instance no download was timed on yet rates 0, so that it is tried.
+double backend_score(int node) 
+{
+    struct backend_load *load = &backend_loads[node];
+    pthread_mutex_lock(&load->lock);
+    double latency = load->latency;
+    pthread_mutex_unlock(&load->lock);
+    return (__atomic_load_n(&load->in_flight, __ATOMIC_RELAXED) + 1) * latency;
+}
+
+// Function to compare two reply times for qsort()
+int compare_samples(const void *a, const void *b) 
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to read the monotonic clock in microseconds
+int64_t monotonic_us(void) 
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Function to read the list of every file a server stores into the namespace index
+int load_manifest(int node) 
+{
+    struct dfs_header hdr;
+    char msg[BUFFER_SIZE];
+    int sockfd = request_from_server(node, DFS_OP_MANIFEST, 0, NULL, 0, &hdr, msg, sizeof(msg), NULL);
+    if (sockfd < 0) 
+    {
+        return -1;
+    }
+    if (hdr.status != DFS_OK) 
+    {
+        release_backend(node, sockfd, 1);
+        return -1;
+    }
+    
+    int status = ns_load_manifest(node, sockfd);
+    release_backend(node, sockfd, status >= 0);
+    return (status == DFS_OK) ? 0 : -1;
+}
+
+// Function to relay a download from another server to the client
+// Sends the request, passes on the server's status and streams the body frames through.
+int relay_from_server(struct dfs_request *req, int node, uint8_t opcode, const char *const args[], int nargs) 
+{
+    // Send command to target server and read its reply, which carries the body size on success
+    struct dfs_header hdr;
+    char msg[BUFFER_SIZE];
+    int64_t size;
+    int sockfd = request_from_server(node, opcode, req->id, args, nargs, &hdr, msg, sizeof(msg), &size);
+    return relay_reply(req, node, sockfd, &hdr, msg, size);
+}
+
+// Function to relay the reply request_from_server() received to the client
+// sockfd, hdr, msg and size are what it returned and filled in; sockfd is -1 if it failed.
+int relay_reply(struct dfs_request *req, int node, int sockfd, struct dfs_header *hdr, const char *msg, int64_t size) 
+{
+    if (sockfd < 0) 
     {
-        close(sockfd);
-        write(client_sock, "ERROR: Command send failed", 26);
+        dfs_reply_status(req, DFS_ERR_UNAVAILABLE, "ERROR: Connection to server failed");
         return -1;
     }
-
-    // Read file size from target server
-    off_t filesize;
-    if (read(sockfd, &filesize, sizeof(off_t)) != sizeof(off_t)) 
+    if (hdr->status != DFS_OK) 
     {
-        close(sockfd);
-        write(client_sock, "ERROR: Failed to read file size", 31);
+        release_backend(node, sockfd, 1);
+        dfs_reply_status(req, hdr->status, msg);
         return -1;
     }
 
     // Send file size to client
-    if (write(client_sock, &filesize, sizeof(off_t)) != sizeof(off_t)) 
+    if (dfs_reply_begin(req, size) < 0) 
     {
-        close(sockfd);
+        release_backend(node, sockfd, 0);
         return -1;
     }
 
-    // Relay file content from target server to client
-    off_t remaining = filesize;
-    char buffer[BUFFER_SIZE];
-    while (remaining > 0) 
+    // Relay file content from target server to client, frame by frame
+    uint32_t status = DFS_ERR_UNAVAILABLE;
+    int complete = 0;
+    while (dfs_recv_header(sockfd, hdr) == 0 && hdr->opcode == DFS_OP_DATA) 
     {
-        ssize_t bytes_read = read(sockfd, buffer, sizeof(buffer));
-        if (bytes_read <= 0) break;
-        write(client_sock, buffer, bytes_read);
-        remaining -= bytes_read;
+        // The payload goes from socket to socket without being copied through S1
+        if (hdr->length > 0 && dfs_reply_relay(req, sockfd, hdr->length) < 0) 
+        {
+            release_backend(node, sockfd, 0);
+            return -1;
+        }
+
+        if (hdr->flags & DFS_FLAG_END) 
+        {
+            status = hdr->status;
+            complete = 1;
+            break;
+        }
     }
 
-    close(sockfd);
-    return 0;
+    // Only a connection that delivered the whole body is back in sync for the next request
+    release_backend(node, sockfd, complete);
+    dfs_reply_end(req, status);
+    return (status == DFS_OK) ? 0 : -1;
 }
 
-// Function to remove a file from S1 or request its removal from another server
-// Determines the file's location based on its extension and sends the removal request.
-int remove_file(int client_sock, char *filename) 
+// Function to send a request to another server and receive its response
+// Sends the request over a pooled connection and reads the status message, or the body for
+// requests that return one (truncated to BUFFER_SIZE - 1 bytes).
+int send_to_server(int node, uint8_t opcode, const char *const args[], int nargs, char *response, uint32_t *status) 
 {
-    // Check if file exists in S1
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), filename + 3); // +3 to skip "~S1"
-    
-    if (unlink(s1_path) == 0) 
-    {
-        write(client_sock, "SUCCESS: File deleted from S1", 28);
-        return 0;
-    }
-    
-    // File not in S1 - check other servers based on extension
-    char *ext = strrchr(filename, '.');
-    if (ext == NULL) 
-    {
-        write(client_sock, "ERROR: File has no extension", 27);
-        return -1;
-    }
-    
-    int target_port = 0;
-    if (strcmp(ext, ".pdf") == 0) 
-    {
-        target_port = S2_PORT;
-    } 
-    else if (strcmp(ext, ".txt") == 0) 
-    {
-        target_port = S3_PORT;
-    } 
-    else if (strcmp(ext, ".zip") == 0) 
-    {
-        target_port = S4_PORT;
-    } 
-    else 
+    struct dfs_header hdr;
+    int sockfd = request_from_server(node, opcode, 0, args, nargs, &hdr, response, BUFFER_SIZE, NULL);
+    if (sockfd < 0) 
     {
-        write(client_sock, "ERROR: File not found", 21);
         return -1;
     }
+    *status = hdr.status;
     
-    // Request deletion from appropriate server
-    char command[MAX_PATH_LEN];
-    snprintf(command, MAX_PATH_LEN, "removef %s", filename);
-    
-    char response[BUFFER_SIZE];
-    if (send_to_server(target_port, command, response) < 0) 
+    if (hdr.status == DFS_OK && dfs_has_body(opcode)) 
     {
-        write(client_sock, "ERROR: Failed to delete file from target server", 45);
-        return -1;
+        int body_status = dfs_recv_body(sockfd, -1, response, BUFFER_SIZE, NULL);
+        if (body_status != DFS_OK) 
+        {
+            release_backend(node, sockfd, body_status >= 0);
+            return -1;
+        }
     }
     
-    write(client_sock, response, strlen(response));
+    release_backend(node, sockfd, 1);
     return 0;
 }
 
-// Function to download a tar file containing files of a specific type
-// Handles .c files locally and forwards requests for other file types to the appropriate server.
-int download_tar(int client_sock, char *filetype) 
+// Function to send a request to another server and receive its STATUS reply
+// Returns the connection, positioned at the body if the request has one, or -1 on failure.
+// A pooled connection the server has dropped since it was checked fails right away; the request is
+// then sent again once on a new connection.
+int request_from_server(int node, uint8_t opcode, uint32_t id, const char *const args[], int nargs,
+                        struct dfs_header *hdr, char *msg, size_t msg_size, int64_t *size) 
 {
-    if (strcmp(filetype, ".c") == 0) 
+    for (int attempt = 0; attempt < 2; attempt++) 
     {
-        // Handle .c files in S1
-        char s1_dir[MAX_PATH_LEN];
-        snprintf(s1_dir, MAX_PATH_LEN, "%s/S1", getenv("HOME"));
-
-        // Find all .c files recursively and tar them
-        char find_cmd[MAX_PATH_LEN * 2];
-        snprintf(find_cmd, sizeof(find_cmd), "find %s -type f -name \"*.c\" | tar -cf /tmp/cfiles.tar -T -", s1_dir);
-
-        if (system(find_cmd) != 0) 
+        int reused;
+        int sockfd = acquire_backend(node, &reused);
+        if (sockfd < 0) 
         {
-            write(client_sock, "ERROR: Failed to create tar file", 32);
             return -1;
         }
-
-        // Send tar file to client
-        struct stat st;
-        if (stat("/tmp/cfiles.tar", &st) != 0) 
+        
+        if (dfs_send_request(sockfd, opcode, id, args, nargs) == 0 && 
+            dfs_recv_status(sockfd, hdr, msg, msg_size, size) == 0) 
         {
-            write(client_sock, "ERROR: Tar file not found", 25);
-            return -1;
+            return sockfd;
         }
-
-        int fd = open("/tmp/cfiles.tar", O_RDONLY);
-        if (fd < 0) 
+        
+        release_backend(node, sockfd, 0);
+        if (!reused) 
         {
-            write(client_sock, "ERROR: Failed to open tar file", 30);
-            return -1;
+            break;
         }
+    }
+    return -1;
+}
 
-        // Send file size
-        write(client_sock, &st.st_size, sizeof(off_t));
+// Function to get a connection to another server
+// Each worker thread keeps one open connection per server between requests. It is checked before
+// reuse: an idle connection has nothing to read, so readable means the server closed it.
+int acquire_backend(int node, int *reused)
+{
+    int *slot = &backend_socks[node];
+    int sockfd = *slot;
+    *slot = -1;
 
-        // Send file data
-        off_t remaining = st.st_size;
-        while (remaining > 0) 
+    if (sockfd >= 0)
+    {
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) == 0)
         {
-            ssize_t sent = sendfile(client_sock, fd, NULL, remaining);
-            if (sent <= 0) 
-            {
-                close(fd);
-                write(client_sock, "ERROR: File transfer failed", 28);
-                return -1;
-            }
-            remaining -= sent;
+            *reused = 1;
+            __atomic_add_fetch(&backend_loads[node].in_flight, 1, __ATOMIC_RELAXED);
+            return sockfd;
         }
-        close(fd);
+        close(sockfd);
+    }
 
-        // Clean up
-        unlink("/tmp/cfiles.tar");
-        return 0;
+    *reused = 0;
+    sockfd = connect_to_server(node);
+    if (sockfd >= 0)
+    {
+        // Requests are small frames that must not wait for Nagle
+        int nodelay = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        __atomic_add_fetch(&backend_loads[node].in_flight, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&backend_down[node], (sockfd < 0) ? time(NULL) : 0, __ATOMIC_RELAXED);
+    return sockfd;
+}
 
-    } 
-    else if (strcmp(filetype, ".pdf") == 0 || strcmp(filetype, ".txt") == 0) 
+// Function to return a connection to the worker's pool
+// A connection that is not in sync any more (reusable is 0) is closed instead.
+void release_backend(int node, int sockfd, int reusable)
+{
+    int *slot = &backend_socks[node];
+    __atomic_sub_fetch(&backend_loads[node].in_flight, 1, __ATOMIC_RELAXED);
+
+    if (!reusable || *slot >= 0)
     {
-        // Handle .pdf and .txt files from other servers
-        int target_port = (strcmp(filetype, ".pdf") == 0) ? S2_PORT : S3_PORT;
+        close(sockfd);
+        return;
+    }
+    *slot = sockfd;
+}
 
-        char command[BUFFER_SIZE];
-        snprintf(command, BUFFER_SIZE, "downltar %s", filetype);
+// Function to connect to another server at its configured address
+// Uses getaddrinfo() since gethostbyname() is not safe to call from several worker threads.
+int connect_to_server(int node)
+{
+    struct addrinfo hints, *res, *rp;
+    char port_str[16];
+    int sockfd = -1;
 
-        int sockfd;
-        struct sockaddr_in serv_addr;
-        struct hostent *server;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", dfs_servers[node].port);
 
-        sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sockfd < 0) 
+    if (getaddrinfo(dfs_server_host(node), port_str, &hints, &res) != 0)
+    {
+        return -1;
+    }
+
+    for (rp = res; rp != NULL; rp = rp->ai_next)
+    {
+        sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sockfd < 0)
         {
-            write(client_sock, "ERROR: Socket creation failed", 29);
-            return -1;
+            continue;
         }
-
-        server = gethostbyname("localhost");
-        if (server == NULL) 
+        if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) == 0)
         {
-            close(sockfd);
-            write(client_sock, "ERROR: Host resolution failed", 29);
-            return -1;
+            break;
         }
+        close(sockfd);
+        sockfd = -1;
+    }
+
+    freeaddrinfo(res);
+    return sockfd;
+}
+
+// Function to tell whether an instance was reachable when last tried, or long enough ago to try it again
+int backend_up(int node)
+{
+    time_t down = __atomic_load_n(&backend_down[node], __ATOMIC_RELAXED);
+    return down == 0 || time(NULL) - down >= BACKEND_RETRY;
+}
+
+// Function to find the lock keeping requests for a file apart from the rebalancer placing it
+struct move_lock *move_lock(const char *path)
+{
+    return &move_locks[ns_hash_path(path) % MOVE_LOCKS];
+}
+
+// Function to read the configuration file again after a SIGHUP
+// Instances added at its end and changed weights are routed to at once, and the rebalancer then
+// moves the files whose place changed; a configuration that cannot be applied is ignored.
+void reload_config(void) 
+{
+    struct signalfd_siginfo info;
+    while (read(hangup_fd, &info, sizeof(info)) == sizeof(info)) 
+    {
+    }
 
-        bzero((char *)&serv_addr, sizeof(serv_addr));
-        serv_addr.sin_family = AF_INET;
-        bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-        serv_addr.sin_port = htons(target_port);
+    if (dfs_reload_config(config_path) < 0) 
+    {
+        fprintf(stderr, "WARNING: Configuration not reloaded\n");
+        return;
+    }
+    if (route_init() < 0) 
+    {
+        fprintf(stderr, "WARNING: Out of memory rebuilding the routing table\n");
+    }
+    printf("Configuration reloaded, %d server instances\n", dfs_num_nodes);
+    fflush(stdout);
+    wake_rebalancer();
+}
 
-        if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) 
+// Function to get the instances whose files the rebalancer checks
+// Those of the servers that have several instances; a server with one instance stores all its files.
+unsigned int rebalance_nodes(void)
+{
+    unsigned int nodes = 0;
+    for (int server = DFS_S2; server < DFS_NUM_SERVERS; server++) 
+    {
+        unsigned int servers = route_servers(server);
+        if ((servers & (servers - 1)) != 0) 
         {
-            close(sockfd);
-            write(client_sock, "ERROR: Connection to server failed", 34);
-            return -1;
+            nodes |= servers;
         }
+    }
+    return nodes;
+}
 
-        // Send command to target server
-        if (write(sockfd, command, strlen(command)) < 0) 
+// Function run by the rebalancer thread
+// Walks the index for files whose copies are not on the instances their path is routed to, e.g.
+// after an instance was added or its weight changed or an upload could not reach every replica, and
+// copies, moves or removes them to match. It runs again every REBALANCE_RETRY seconds while files
+// are left that could not be placed or instances have not sent their manifest yet, and once every
+// file is in place waits until an upload leaves one short of copies or the configuration is reloaded.
+void *rebalance_files(void *arg) 
+{
+    (void)arg;
+    while (1) 
+    {
+        pthread_mutex_lock(&rebalance_lock);
+        rebalance_wanted = 0;
+        pthread_mutex_unlock(&rebalance_lock);
+        
+        int placed = 0;
+        unsigned int nodes = rebalance_nodes();
+        int left = (nodes != 0) ? rebalance_pass(nodes, &placed) : 0;
+        if (placed > 0) 
         {
-            close(sockfd);
-            write(client_sock, "ERROR: Command send failed", 26);
-            return -1;
+            printf("Rebalancer placed %d files, %d left\n", placed, left);
+            fflush(stdout);
         }
-
-        // Read tar file size
-        off_t filesize;
-        if (read(sockfd, &filesize, sizeof(off_t)) != sizeof(off_t)) 
+        if (left > 0) 
         {
-            close(sockfd);
-            write(client_sock, "ERROR: Failed to read file size", 31);
-            return -1;
+            sleep(REBALANCE_RETRY);
+            continue;
         }
-
-        // Send file size to client
-        write(client_sock, &filesize, sizeof(off_t));
-
-        // Relay tar file content from target server to client
-        off_t remaining = filesize;
-        char buffer[1024];
-        while (remaining > 0) 
+        
+        pthread_mutex_lock(&rebalance_lock);
+        while (!rebalance_wanted) 
         {
-            ssize_t bytes_read = read(sockfd, buffer, sizeof(buffer));
-            if (bytes_read <= 0) break;
-            write(client_sock, buffer, bytes_read);
-            remaining -= bytes_read;
+            pthread_cond_wait(&rebalance_cond, &rebalance_lock);
         }
+        pthread_mutex_unlock(&rebalance_lock);
+    }
+    return NULL;
+}
 
-        close(sockfd);
-        return 0;
-    } 
-    else 
+// Function to count a worker out of busy_workers once its command is done
+// The rebalancer is only woken when it is waiting for workers to finish. It sets idle_waiting before
+// it looks at busy_workers, and a worker lowers busy_workers before it looks at idle_waiting, so one
+// of them always sees the other's change.
+void finish_work(void) 
+{
+    if (__atomic_sub_fetch(&busy_workers, 1, __ATOMIC_SEQ_CST) <= NUM_WORKERS / 2 && 
+        __atomic_load_n(&idle_waiting, __ATOMIC_SEQ_CST)) 
     {
-        write(client_sock, "ERROR: Unsupported file type for tar", 36);
-        return -1;
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
     }
 }
 
-// Function to display filenames from S1 and other servers
-// Recursively lists files in S1 and sends requests to other servers for their file lists.
-int display_filenames(int client_sock, char *pathname) 
+// Function to wait until no more than half the workers are busy with clients
+void wait_for_idle_workers(void) 
 {
-    // Get the corresponding path in S1
-    char s1_path[MAX_PATH_LEN];
-    snprintf(s1_path, MAX_PATH_LEN, "%s/S1%s", getenv("HOME"), 
-             (strcmp(pathname, "~S1") == 0) ? "" : (pathname + 3)); // Handle root case
-
-    // Check if path exists and is a directory
-    struct stat st;
-    if (stat(s1_path, &st) != 0 || !S_ISDIR(st.st_mode)) 
+    pthread_mutex_lock(&idle_lock);
+    __atomic_store_n(&idle_waiting, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&busy_workers, __ATOMIC_SEQ_CST) > NUM_WORKERS / 2) 
     {
-        write(client_sock, "ERROR: Invalid directory path", 29);
-        return -1;
+        pthread_cond_wait(&idle_cond, &idle_lock);
     }
+    __atomic_store_n(&idle_waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&idle_lock);
+}
 
-    // Get files from S1 (.c files) recursively
-    char file_list[BUFFER_SIZE] = {0};
-    DIR *dir;
-    struct dirent *ent;
+// Function to have the rebalancer look for files to place again
+void wake_rebalancer(void) 
+{
+    pthread_mutex_lock(&rebalance_lock);
+    rebalance_wanted = 1;
+    pthread_cond_signal(&rebalance_cond);
+    pthread_mutex_unlock(&rebalance_lock);
+}
 
-    // Function to recursively list files
-    void list_files_recursive(const char *base_path, const char *relative_path) 
+// Function to place every misplaced file of the instances in nodes once
+// Files are placed one at a time, and not while more than half the workers are busy with clients.
+// Returns the number of files left to place later, counting an instance whose files the index does
+// not hold yet as one.
+int rebalance_pass(unsigned int nodes, int *placed) 
+{
+    size_t size = REBALANCE_BATCH * (PATH_MAX + 4);
+    char *names = malloc(size);
+    if (names == NULL) 
     {
-        char path[MAX_PATH_LEN];
-        struct dirent *dp;
-        DIR *dir = opendir(base_path);
-
-        if (!dir) return;
-
-        while ((dp = readdir(dir)) != NULL) 
+        return 1;
+    }
+    
+    int left = 0;
+    for (int node = 0; node < dfs_num_nodes; node++) 
+    {
+        if ((nodes & (1u << node)) && !index_complete(node)) 
+        {
+            left++;
+        }
+    }
+    
+    char cursor[PATH_MAX] = "";
+    int more = 1;
+    while (more) 
+    {
+        size_t len;
+        int count = ns_list("/", nodes, (cursor[0] != '\0') ? cursor : NULL, names, size, &len, 
+                            REBALANCE_BATCH, &more);
+        if (count <= 0) 
+        {
+            break;
+        }
+        
+        char *name = names;
+        for (int i = 0; i < count; i++) 
         {
-            if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+            char *end = memchr(name, '\n', names + len - name);
+            *end = '\0';
+            snprintf(cursor, sizeof(cursor), "%s", name + 3); // +3 to skip "~S1"
+            name = end + 1;
+            
+            struct ns_file file;
+            if (!ns_lookup(cursor, &file)) 
+            {
                 continue;
-
-            snprintf(path, MAX_PATH_LEN, "%s/%s", base_path, dp->d_name);
-
-            char new_relative_path[MAX_PATH_LEN];
-            if (strcmp(relative_path, "") == 0) 
+            }
+            
+            // The instances the copies belong on
+            int routed[DFS_MAX_NODES];
+            enum dfs_server server = dfs_servers[__builtin_ctz(file.servers)].server;
+            int nrouted = route_replicas(server, cursor, routed);
+            unsigned int want = 0;
+            for (int j = 0; j < nrouted; j++) 
+            {
+                want |= 1u << routed[j];
+            }
+            if (file.servers == want) 
+            {
+                continue;
+            }
+            
+            // Leave the backends to the clients while they are busy
+            wait_for_idle_workers();
+            if (place_file(cursor, &file, want) == 0) 
             {
-                snprintf(new_relative_path, sizeof(new_relative_path), "%s", dp->d_name);
-            } 
+                (*placed)++;
+            }
             else 
             {
-                snprintf(new_relative_path, sizeof(new_relative_path), "%s/%s", relative_path, dp->d_name);
+                left++;
             }
+        }
+    }
+    
+    free(names);
+    return left;
+}
 
-            if (dp->d_type == DT_REG) {
-                char *ext = strrchr(dp->d_name, '.');
-                if (ext && strcmp(ext, ".c") == 0) 
+// Function to put the copies of a file on the instances in the mask want
+// Missing copies are copied from an existing one while uploads, removals and downloads of the file
+// go on. Each copy only replaces the file on its instance, and the index only changes, if no upload
+// or removal of it came in between; otherwise the copies are made again. Downloads that have looked
+// the file up but not started yet finish before the index changes. Copies on instances not in want
+// are then removed, but kept while a wanted copy is still missing, so a file never has fewer copies
+// than before. Returns -1 if the file could not be fully placed now.
+int place_file(const char *path, const struct ns_file *file, unsigned int want) 
+{
+    struct move_lock *lock = move_lock(path);
+    
+    // The file's name as a client gives it and its directory
+    char filename[PATH_MAX], dest_path[PATH_MAX];
+    snprintf(filename, sizeof(filename), "~S1%s", path);
+    snprintf(dest_path, sizeof(dest_path), "%s", filename);
+    *strrchr(dest_path, '/') = '\0';
+    const char *args[] = { filename };
+    char response[BUFFER_SIZE];
+    uint32_t status;
+    
+    for (int attempt = 0; attempt < PLACE_ATTEMPTS; attempt++) 
+    {
+        // Uploaded again or removed since it was listed
+        unsigned int generation = __atomic_load_n(&lock->generation, __ATOMIC_ACQUIRE);
+        struct ns_file current;
+        if (!ns_lookup(path, &current) || (attempt == 0 && current.servers != file->servers)) 
+        {
+            return 0;
+        }
+        
+        // Copy the file to each instance missing it from the first copy that can be read
+        int sources[DFS_MAX_NODES];
+        int nsources = order_replicas(current.servers, sources);
+        unsigned int added = 0;
+        for (int node = 0; node < dfs_num_nodes; node++) 
+        {
+            if (!(want & ~current.servers & (1u << node))) 
+            {
+                continue;
+            }
+            for (int i = 0; i < nsources; i++) 
+            {
+                if (copy_file(sources[i], node, filename, dest_path, lock, generation) == 0) 
+                {
+                    added |= 1u << node;
+                    break;
+                }
+            }
+        }
+        unsigned int servers = current.servers | added;
+        unsigned int dropped = ((servers & want) == want) ? (servers & ~want) : 0;
+        if (added == 0 && dropped == 0 && 
+            __atomic_load_n(&lock->generation, __ATOMIC_ACQUIRE) == generation) 
+        {
+            return -1;
+        }
+        
+        // An upload or removal came in between: copies it did not replace are out of date
+        pthread_rwlock_wrlock(&lock->update);
+        if (__atomic_load_n(&lock->generation, __ATOMIC_ACQUIRE) != generation) 
+        {
+            struct ns_file now;
+            unsigned int stale = added & ~(ns_lookup(path, &now) ? now.servers : 0);
+            for (int node = 0; node < dfs_num_nodes; node++) 
+            {
+                if (stale & (1u << node)) 
+                {
+                    send_to_server(node, DFS_OP_REMOVEF, args, 1, response, &status);
+                }
+            }
+            pthread_rwlock_unlock(&lock->update);
+            continue;
+        }
+        
+        // Switch the index over once no download is between looking the file up and opening it
+        int locked = 0;
+        for (int waited = 0; waited < REBALANCE_COMMIT_WAIT && !locked; waited++) 
+        {
+            locked = (pthread_rwlock_trywrlock(&lock->lookup) == 0);
+            if (!locked) 
+            {
+                usleep(1000);
+            }
+        }
+        if (!locked) 
+        {
+            for (int node = 0; node < dfs_num_nodes; node++) 
+            {
+                if (added & (1u << node)) 
                 {
-                    // Build ~S1-style path
-                    char output_path[MAX_PATH_LEN];
-                    snprintf(output_path, sizeof(output_path), "~S1/%s", new_relative_path);
-                    strncat(file_list, output_path, BUFFER_SIZE - strlen(file_list) - 1);
-                    strncat(file_list, "\n", BUFFER_SIZE - strlen(file_list) - 1);
+                    send_to_server(node, DFS_OP_REMOVEF, args, 1, response, &status);
                 }
-            } 
-            else if (dp->d_type == DT_DIR) 
+            }
+            pthread_rwlock_unlock(&lock->update);
+            return -1;
+        }
+        current.servers = servers & ~dropped;
+        ns_add_file(path, &current);
+        pthread_rwlock_unlock(&lock->lookup);
+        
+        for (int node = 0; node < dfs_num_nodes; node++) 
+        {
+            if ((dropped & (1u << node)) && send_to_server(node, DFS_OP_REMOVEF, args, 1, response, &status) < 0) 
             {
-                list_files_recursive(path, new_relative_path);
+                char name[16];
+                dfs_node_name(node, name, sizeof(name));
+                fprintf(stderr, "WARNING: Could not remove %s from %s after moving it\n", filename, name);
             }
         }
-        closedir(dir);
+        pthread_rwlock_unlock(&lock->update);
+        return (current.servers == want) ? 0 : -1;
     }
+    return -1;
+}
 
-    // Start recursive traversal from the base path
-    list_files_recursive(s1_path, "");
-
-    // Get files from other servers
-    char command[MAX_PATH_LEN];
-    snprintf(command, MAX_PATH_LEN, "dispfnames %s", pathname);
-    char response[BUFFER_SIZE];
-
-    // Get PDF files from S2
-    if (send_to_server(S2_PORT, command, response) == 0) 
+// Function to copy a stored file from one server instance to another
+// The file is downloaded from one and uploaded to the other at the same time, a chunk at a time,
+// at no more than the rebalancer's rate. The new instance keeps the copy, replacing a file it may
+// have, only if the generation of the file's lock has not changed by the end; the lock is held
+// exclusively for that check and the new instance's reply. Returns 0 once the copy is stored.
+int copy_file(int from, int to, const char *filename, const char *dest_path, struct move_lock *lock, 
+              unsigned int generation) 
+{
+    const char *args[] = { filename };
+    struct dfs_header hdr;
+    char msg[BUFFER_SIZE];
+    int in = request_from_server(from, DFS_OP_DOWNLF, 0, args, 1, &hdr, msg, sizeof(msg), NULL);
+    if (in < 0) 
     {
-        strncat(file_list, response, BUFFER_SIZE - strlen(file_list) - 1);
+        return -1;
     }
-
-    // Get TXT files from S3
-    if (send_to_server(S3_PORT, command, response) == 0) 
+    if (hdr.status != DFS_OK) 
     {
-        strncat(file_list, response, BUFFER_SIZE - strlen(file_list) - 1);
+        release_backend(from, in, 1);
+        return -1;
     }
-
-    // Get ZIP files from S4
-    if (send_to_server(S4_PORT, command, response) == 0) 
+    
+    // Send the upload request; a pooled connection the server has dropped is replaced once
+    const char *upload_args[] = { filename, dest_path };
+    int out = -1;
+    for (int attempt = 0; attempt < 2; attempt++) 
     {
-        strncat(file_list, response, BUFFER_SIZE - strlen(file_list) - 1);
+        int reused;
+        out = acquire_backend(to, &reused);
+        if (out < 0 || dfs_send_request(out, DFS_OP_UPLOADF, 0, upload_args, 2) == 0) 
+        {
+            break;
+        }
+        release_backend(to, out, 0);
+        out = -1;
+        if (!reused) 
+        {
+            break;
+        }
     }
-
-    // Send the combined list to client
-    write(client_sock, file_list, strlen(file_list));
-    return 0;
-}
-
-// Function to send a command to another server and receive its response
-// Establishes a connection to the target server, sends the command, and reads the response.
-int send_to_server(int port, char *command, char *response) 
-{
-    int sockfd;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
-    
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) 
+    if (out < 0) 
     {
+        release_backend(from, in, 0);
         return -1;
     }
     
-    server = gethostbyname("localhost");
-    if (server == NULL) 
+    // Pass the body frames on as upload frames
+    char chunk[DFS_CHUNK_SIZE];
+    uint32_t status = DFS_ERR_UNAVAILABLE;
+    int complete = 0;
+    int out_failed = 0;
+    while (!complete && dfs_recv_header(in, &hdr) == 0 && hdr.opcode == DFS_OP_DATA) 
     {
-        close(sockfd);
-        return -1;
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) 
+        {
+            size_t n = (remaining < sizeof(chunk)) ? remaining : sizeof(chunk);
+            if (dfs_read_full(in, chunk, n) < 0) 
+            {
+                break;
+            }
+            if (!out_failed && dfs_send_frame(out, DFS_OP_DATA, 0, 0, DFS_OK, chunk, n) < 0) 
+            {
+                out_failed = 1;
+            }
+            throttle_rebalance(n);
+            remaining -= n;
+        }
+        if (remaining > 0) 
+        {
+            break;
+        }
+        if (hdr.flags & DFS_FLAG_END) 
+        {
+            status = hdr.status;
+            complete = 1;
+        }
     }
+    release_backend(from, in, complete);
     
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(port);
-    
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
+    // An incomplete copy, or one of a file uploaded or removed meanwhile, is dropped by the new instance
+    int current = 0;
+    if (!out_failed && complete) 
     {
-        close(sockfd);
-        return -1;
+        pthread_rwlock_wrlock(&lock->update);
+        current = (__atomic_load_n(&lock->generation, __ATOMIC_ACQUIRE) == generation);
+        if (!current) 
+        {
+            pthread_rwlock_unlock(&lock->update);
+        }
     }
-    
-    // Send command
-    if (write(sockfd, command, strlen(command)) < 0) 
+    int sent = (!out_failed && dfs_send_frame(out, DFS_OP_DATA, DFS_FLAG_END, 0, current ? status : DFS_ERR_IO, NULL, 0) == 0 &&
+                dfs_recv_status(out, &hdr, msg, sizeof(msg), NULL) == 0);
+    if (current) 
     {
-        close(sockfd);
-        return -1;
+        pthread_rwlock_unlock(&lock->update);
     }
+    release_backend(to, out, sent);
+    return (sent && current && status == DFS_OK && hdr.status == DFS_OK) ? 0 : -1;
+}
+
+// Function to hold the rebalancer to its rate after it copied len more bytes
+// Time it spent idle gives it no credit to copy faster later.
+void throttle_rebalance(size_t len) 
+{
+    static int64_t due; // Time at which the bytes copied so far are due, in nanoseconds
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t now_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
     
-    // Read response
-    bzero(response, BUFFER_SIZE);
-    if (read(sockfd, response, BUFFER_SIZE - 1) < 0) 
+    if (due < now_ns) 
     {
-        close(sockfd);
-        return -1;
+        due = now_ns;
+    }
+    due += (int64_t)((double)len * 1e9 / rebalance_rate);
+    if (due > now_ns) 
+    {
+        struct timespec until = { .tv_sec = due / 1000000000, .tv_nsec = due % 1000000000 };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
     }
-    
-    close(sockfd);
-    return 0;
 }
 
 // Function to create a directory tree for a given path
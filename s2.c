@@ -19,30 +19,117 @@
 #include <sys/sendfile.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
-#define PORT 4308
-#define MAX_CLIENTS 5
+#include "config.h"
+#include "dir_cache.h"
+#include "namespace.h"
+#include "protocol.h"
+#include "tar_cache.h"
+#include "tar_stream.h"
+#include "thread_pool.h"
+
+#define SERVER DFS_S2 // The server this program runs
+#define STORAGE_ROOT (dfs_servers[node].root) // Directory holding this instance's files
+#define MAX_CLIENTS SOMAXCONN
 #define BUFFER_SIZE 1024
 #define MAX_PATH_LEN 1024
+#define DEFAULT_POOL_SIZE 8 // Worker threads serving connections from S1
+#define DEFAULT_QUEUE_DEPTH 64 // Requests waiting for a worker
+#define MAX_EVENTS 64 // Events handled per epoll_wait() call
+
+int epoll_fd; // Watches the listening socket and the idle connections from S1
+int node = SERVER; // This instance's entry in the configuration
+int verbose; // Print every request received, set with -v
+int stalled_fd = -1; // Event counter a worker bumps when it finishes while connections are stalled
+pthread_mutex_t stalled_lock = PTHREAD_MUTEX_INITIALIZER; // Guards stalled and queueing connections
+int *stalled; // Connections with a request waiting for a free queue slot, in arrival order
+int nstalled, stalled_size; // Entries used and allocated in stalled
 
 // Function prototypes
-void handle_client(int client_sock);
-int upload_file(int client_sock, char *filename, char *dest_path);
-int download_file(int client_sock, char *filename);
-int remove_file(int client_sock, char *filename);
-int download_tar(int client_sock);
-int display_filenames(int client_sock, char *pathname);
+void queue_connection(struct thread_pool *pool, int client_sock);
+void resume_stalled(struct thread_pool *pool);
+void wake_stalled(void);
+void serve_connection(void *arg);
+int watch_connection(int client_sock, int op);
+int handle_client(int client_sock);
+int handle_frame(int client_sock);
+void dispatch_request(struct dfs_request *req, char *args[], int nargs);
+void reject_upload(struct dfs_request *req, uint32_t status, const char *msg);
+int upload_file(struct dfs_request *req, char *filename, char *dest_path);
+int download_file(struct dfs_request *req, char *filename);
+int remove_file(struct dfs_request *req, char *filename);
+int download_tar(struct dfs_request *req, char *since_arg, int compress);
+int display_filenames(struct dfs_request *req, char *pathname, char *limit_arg, char *after);
 int create_directory_tree(char *path);
 void error(const char *msg);
 
 // Main function initializes the server and listens for connections from S1.
-// It creates a child process for each connection to handle requests concurrently.
-int main() 
+// S1 keeps its connections open between requests. Idle connections are watched with epoll and
+// every request that arrives is queued for a pool of pre-spawned worker threads.
+// Usage: ./S2 [-w pool_size] [-q queue_depth] [-c config_file] [-i instance] [-v]
+int main(int argc, char *argv[]) 
 {
     int sockfd, newsockfd;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
-    pid_t pid;
+    struct sockaddr_in serv_addr;
+    int pool_size = DEFAULT_POOL_SIZE;
+    int queue_depth = DEFAULT_QUEUE_DEPTH;
+    const char *config_path = NULL;
+    int instance = 1;
+    int opt;
+
+    // Parse pool and configuration options
+    while ((opt = getopt(argc, argv, "w:q:c:i:v")) != -1) 
+    {
+        switch (opt) 
+        {
+            case 'w':
+                pool_size = atoi(optarg);
+                break;
+            case 'q':
+                queue_depth = atoi(optarg);
+                break;
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'i':
+                instance = atoi(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w pool_size] [-q queue_depth] [-c config_file] [-i instance] [-v]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    // Address and storage directory of this instance
+    if (dfs_load_config(config_path) < 0) 
+    {
+        exit(1);
+    }
+    node = dfs_find_node(SERVER, instance);
+    if (node < 0) 
+    {
+        fprintf(stderr, "ERROR: Instance %d of S2 is not in the configuration\n", instance);
+        exit(1);
+    }
+
+    // Archives for downltar are cached next to the storage directory
+    char cache_dir[MAX_PATH_LEN];
+    snprintf(cache_dir, sizeof(cache_dir), "%s.cache", STORAGE_ROOT);
+    if (tar_cache_init(cache_dir) < 0) 
+    {
+        fprintf(stderr, "WARNING: Cannot use %s, downltar archives will not be cached\n", cache_dir);
+    }
+
+    // S1 closing a connection mid-transfer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
     // Create socket
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -51,11 +138,15 @@ int main()
         error("ERROR opening socket");
     }
 
+    int reuse = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Initialize socket structure
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(PORT);
+    if (dfs_listen_address(node, &serv_addr) < 0) 
+    {
+        fprintf(stderr, "ERROR resolving %s\n", dfs_servers[node].host);
+        exit(1);
+    }
 
     // Bind the host address
     if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
@@ -65,180 +156,451 @@ int main()
 
     // Start listening for the clients
     listen(sockfd, MAX_CLIENTS);
-    clilen = sizeof(cli_addr);
 
-    printf("S2 server (PDF files) started on port %d\n", PORT);
+    // Start the worker threads
+    struct thread_pool *pool = pool_create(pool_size, queue_depth);
+    if (pool == NULL) 
+    {
+        error("ERROR creating worker pool");
+    }
+
+    printf("S2 server (PDF files) started on port %d (%d workers, queue depth %d)\n", dfs_servers[node].port, pool_size, queue_depth);
+
+    // Watch the listening socket
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) 
+    {
+        error("ERROR creating epoll instance");
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = sockfd };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev) < 0) 
+    {
+        error("ERROR adding listening socket to epoll");
+    }
+
+    // Workers signal through stalled_fd when a queue slot frees up for a stalled connection
+    stalled_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.data.fd = stalled_fd;
+    if (stalled_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stalled_fd, &ev) < 0) 
+    {
+        error("ERROR creating stalled connection event");
+    }
 
-    // Main loop to accept connections from S1
+    // Main loop to accept connections from S1 and pass their requests to the workers
+    struct epoll_event events[MAX_EVENTS];
     while (1) 
     {
-        // Accept connection from S1
-        newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-        if (newsockfd < 0) 
+        int nready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (nready < 0) 
         {
-            error("ERROR on accept");
+            if (errno == EINTR) 
+            {
+                continue;
+            }
+            error("ERROR on epoll_wait");
         }
 
-        // Create child process to handle the connection
-        pid = fork();
-        if (pid < 0) 
+        for (int i = 0; i < nready; i++) 
         {
-            error("ERROR on fork");
+            if (events[i].data.fd == sockfd) 
+            {
+                // Accept connection from S1 and wait for its first request
+                newsockfd = accept(sockfd, NULL, NULL);
+                if (newsockfd < 0) 
+                {
+                    if (errno != EINTR && errno != ECONNABORTED) 
+                    {
+                        perror("ERROR on accept");
+                    }
+                    continue;
+                }
+                if (watch_connection(newsockfd, EPOLL_CTL_ADD) < 0) 
+                {
+                    close(newsockfd);
+                }
+                continue;
+            }
+            if (events[i].data.fd == stalled_fd) 
+            {
+                resume_stalled(pool);
+                continue;
+            }
+
+            // Hand the request to a worker, or hold it back while the queue is full
+            queue_connection(pool, events[i].data.fd);
         }
+    }
 
-        if (pid == 0) 
+    // Close the socket
+    pool_destroy(pool);
+    close(sockfd);
+    return 0;
+}
+
+// Function to queue a connection with a request for a worker thread
+// The main loop never waits for a queue slot: while the queue is full, the connection stays
+// disarmed in the stalled list until a worker finishes and resume_stalled() queues it.
+void queue_connection(struct thread_pool *pool, int client_sock) 
+{
+    pthread_mutex_lock(&stalled_lock);
+    int ret = pool_try_submit(pool, serve_connection, (void *)(intptr_t)client_sock);
+    if (ret > 0 && nstalled == stalled_size) 
+    {
+        int size = (stalled_size > 0) ? stalled_size * 2 : MAX_EVENTS;
+        int *grown = realloc(stalled, size * sizeof(*grown));
+        if (grown == NULL) 
         {
-            // Child process
-            close(sockfd);
-            handle_client(newsockfd);
-            close(newsockfd);
-            exit(0);
-        } 
+            ret = -1;
+        }
         else 
         {
-            // Parent process
-            close(newsockfd);
-            // Clean up zombie processes
-            while (waitpid(-1, NULL, WNOHANG) > 0);
+            stalled = grown;
+            stalled_size = size;
         }
     }
+    if (ret > 0) 
+    {
+        stalled[nstalled++] = client_sock;
+    }
+    pthread_mutex_unlock(&stalled_lock);
 
-    // Close the socket
-    close(sockfd);
-    return 0;
+    if (ret < 0) 
+    {
+        close(client_sock);
+    }
+}
+
+// Function to queue the connections held back while the work queue was full
+// The ones that still find the queue full go back on the list for the next worker to finish.
+void resume_stalled(struct thread_pool *pool) 
+{
+    uint64_t count;
+    while (read(stalled_fd, &count, sizeof(count)) == sizeof(count)) 
+    {
+    }
+
+    pthread_mutex_lock(&stalled_lock);
+    int *socks = stalled;
+    int n = nstalled;
+    stalled = NULL;
+    nstalled = stalled_size = 0;
+    pthread_mutex_unlock(&stalled_lock);
+
+    for (int i = 0; i < n; i++) 
+    {
+        queue_connection(pool, socks[i]);
+    }
+    free(socks);
+}
+
+// Function to have the main loop queue the held back connections, after a worker finished
+// queue_connection() holds stalled_lock from finding the queue full until the connection is
+// listed, and a job is taken off the queue before it runs, so no connection is left waiting.
+void wake_stalled(void) 
+{
+    pthread_mutex_lock(&stalled_lock);
+    int waiting = (nstalled > 0);
+    pthread_mutex_unlock(&stalled_lock);
+
+    if (waiting) 
+    {
+        uint64_t one = 1;
+        write(stalled_fd, &one, sizeof(one));
+    }
+}
+
+// Function run by a worker thread when a request has arrived on a connection
+// Serves the request, then the connection goes back to the main loop to wait for the next one.
+void serve_connection(void *arg) 
+{
+    int client_sock = (int)(intptr_t)arg;
+
+    if (handle_client(client_sock) < 0 || watch_connection(client_sock, EPOLL_CTL_MOD) < 0) 
+    {
+        close(client_sock);
+    }
+    wake_stalled();
+}
+
+// Function to wait for the next request on a connection
+// One-shot, so that a connection is only ever served by one worker at a time.
+int watch_connection(int client_sock, int op) 
+{
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = client_sock };
+    return epoll_ctl(epoll_fd, op, client_sock, &ev);
 }
 
 // Function to handle requests from S1
-// Parses the command received from S1 and calls the appropriate function.
-void handle_client(int client_sock) 
+// Detects the protocol from the first byte and serves one framed request, or the single command of
+// a text connection. Returns 0 if the connection stays open for further requests.
+int handle_client(int client_sock) 
 {
     char buffer[BUFFER_SIZE];
+    char *saveptr;
     int n;
     
+    // Peek at the first byte to tell framed requests from text commands
+    unsigned char first;
+    if (recv(client_sock, &first, 1, MSG_PEEK) <= 0) 
+    {
+        return -1;
+    }
+    if (dfs_is_frame(&first, 1)) 
+    {
+        return handle_frame(client_sock);
+    }
+    
     // Read command from client (S1)
     bzero(buffer, BUFFER_SIZE);
     n = read(client_sock, buffer, BUFFER_SIZE - 1);
     if (n < 0) 
     {
-        error("ERROR reading from socket");
+        perror("ERROR reading from socket");
+        return -1;
     }
     
-    printf("Received command: %s\n", buffer);
+    if (verbose) 
+    {
+        printf("Received command: %s\n", buffer);
+    }
     
     // Parse command
-    char *cmd = strtok(buffer, " ");
+    struct dfs_request req = { .sock = client_sock, .framed = 0, .id = 0 };
+    char *cmd = strtok_r(buffer, " ", &saveptr);
     if (cmd == NULL)
     {
-        write(client_sock, "ERROR: Invalid command", 22);
-        return;
+        dfs_reply_status(&req, DFS_ERR_INVALID, "ERROR: Invalid command");
+        return -1;
     }
     
-    if (strcmp(cmd, "uploadf") == 0) 
+    int opcode = dfs_opcode_from_name(cmd);
+    if (opcode < 0) 
     {
-        // Handle file upload
-        char *filename = strtok(NULL, " ");
-        char *dest_path = strtok(NULL, " ");
-        if (filename == NULL || dest_path == NULL) 
-        {
-            write(client_sock, "ERROR: Invalid uploadf command format", 36);
-            return;
-        }
-        upload_file(client_sock, filename, dest_path);
-    } 
-    else if (strcmp(cmd, "downlf") == 0) 
+        dfs_reply_status(&req, DFS_ERR_INVALID, "ERROR: Unknown command");
+        return -1;
+    }
+    req.opcode = opcode;
+    
+    char *args[DFS_MAX_ARGS];
+    int nargs = 0;
+    char *arg;
+    while (nargs < DFS_MAX_ARGS && (arg = strtok_r(NULL, " ", &saveptr)) != NULL) 
     {
-        // Handle file download
-        char *filename = strtok(NULL, " ");
-        if (filename == NULL) 
-        {
-            write(client_sock, "ERROR: Invalid downlf command format", 34);
-            return;
-        }
-        download_file(client_sock, filename);
-    } 
-    else if (strcmp(cmd, "removef") == 0) 
+        args[nargs++] = arg;
+    }
+    
+    dispatch_request(&req, args, nargs);
+    return -1;
+}
+
+// Function to read and serve one framed request
+// Returns -1 once the connection is closed or unusable.
+int handle_frame(int client_sock) 
+{
+    struct dfs_header hdr;
+    char payload[DFS_MAX_REQUEST_LEN];
+    
+    if (dfs_recv_header(client_sock, &hdr) < 0 || hdr.length > sizeof(payload)) 
     {
-        // Handle file removal
-        char *filename = strtok(NULL, " ");
-        if (filename == NULL) {
-            write(client_sock, "ERROR: Invalid removef command format", 35);
-            return;
-        }
-        remove_file(client_sock, filename);
-    } 
-    else if (strcmp(cmd, "downltar") == 0) 
+        return -1;
+    }
+    if (dfs_read_full(client_sock, payload, hdr.length) < 0) 
     {
-        // Handle tar file download
-        download_tar(client_sock);
-    } 
-    else if (strcmp(cmd, "dispfnames") == 0)
+        return -1;
+    }
+    if (hdr.opcode == DFS_OP_EXIT) 
     {
-        // Handle display filenames request
-        char *pathname = strtok(NULL, " ");
-        if (pathname == NULL) {
-            write(client_sock, "ERROR: Invalid dispfnames command format", 38);
-            return;
-        }
-        display_filenames(client_sock, pathname);
-    } 
-    else 
+        return -1;
+    }
+    
+    struct dfs_request req = { .sock = client_sock, .framed = 1, .id = hdr.request_id, .opcode = hdr.opcode };
+    char *args[DFS_MAX_ARGS];
+    int nargs = dfs_split_args(payload, hdr.length, args, DFS_MAX_ARGS);
+    
+    if (verbose) 
+    {
+        printf("Received request %u: opcode %d\n", hdr.request_id, hdr.opcode);
+    }
+    dispatch_request(&req, args, nargs);
+    return 0;
+}
+
+// Function to call the handler for a parsed request
+void dispatch_request(struct dfs_request *req, char *args[], int nargs) 
+{
+    switch (req->opcode) 
+    {
+        case DFS_OP_UPLOADF:
+            // Handle file upload
+            if (nargs < 2) 
+            {
+                reject_upload(req, DFS_ERR_INVALID, "ERROR: Invalid uploadf command format");
+                return;
+            }
+            if (!dfs_valid_path(args[1])) 
+            {
+                reject_upload(req, DFS_ERR_INVALID, "ERROR: Path must be below ~S1");
+                return;
+            }
+            upload_file(req, args[0], args[1]);
+            break;
+        case DFS_OP_DOWNLF:
+            // Handle file download
+            if (nargs < 1) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid downlf command format");
+                return;
+            }
+            if (!dfs_valid_path(args[0])) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Path must be below ~S1");
+                return;
+            }
+            download_file(req, args[0]);
+            break;
+        case DFS_OP_REMOVEF:
+            // Handle file removal
+            if (nargs < 1) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid removef command format");
+                return;
+            }
+            if (!dfs_valid_path(args[0])) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Path must be below ~S1");
+                return;
+            }
+            remove_file(req, args[0]);
+            break;
+        case DFS_OP_DOWNLTAR:
+            // Handle tar file download, of the files changed since args[1] if given
+            download_tar(req, (nargs > 1) ? args[1] : NULL, nargs > 2 && strcmp(args[2], TAR_ARG_GZIP) == 0);
+            break;
+        case DFS_OP_DISPFNAMES:
+            // Handle display filenames request, of at most args[1] names after args[2] if given
+            if (nargs < 1) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid dispfnames command format");
+                return;
+            }
+            if (!dfs_valid_path(args[0])) 
+            {
+                dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Path must be below ~S1");
+                return;
+            }
+            display_filenames(req, args[0], (nargs > 1) ? args[1] : NULL, (nargs > 2) ? args[2] : NULL);
+            break;
+        case DFS_OP_MANIFEST:
+            // Handle S1 asking for every stored file to build its namespace index
+            ns_manifest_reply(req, STORAGE_ROOT, ".pdf");
+            break;
+        default:
+            // Handle unknown command
+            dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Unknown command");
+            break;
+    }
+}
+
+// Function to refuse an upload
+// S1 sends the file right behind a framed request, so it is drained first to keep the connection
+// in sync.
+void reject_upload(struct dfs_request *req, uint32_t status, const char *msg) 
+{
+    if (req->framed) 
     {
-        // Handle unknown command
-        write(client_sock, "ERROR: Unknown command", 21);
+        dfs_recv_upload(req, -1);
     }
+    dfs_reply_status(req, status, msg);
 }
 
 // Function to upload a PDF file to S2
-// Receives the file from S1 and stores it in the appropriate directory.
-int upload_file(int client_sock, char *filename, char *dest_path) 
+// Stores the file data S1 streams after the request under the destination path.
+int upload_file(struct dfs_request *req, char *filename, char *dest_path) 
 {
-    // First, check if the file is a PDF
+    // First, check if the file is a PDF file
     char *ext = strrchr(filename, '.');
     if (ext == NULL || strcmp(ext, ".pdf") != 0) 
     {
-        write(client_sock, "ERROR: S2 only handles PDF files", 31);
+        reject_upload(req, DFS_ERR_UNSUPPORTED, "ERROR: S2 only handles PDF files");
         return -1;
     }
     
     // Create destination path in S2
     char s2_path[MAX_PATH_LEN];
-    snprintf(s2_path, MAX_PATH_LEN, "%s/S2%s", getenv("HOME"), dest_path + 3); // +3 to skip "~S1"
+    snprintf(s2_path, MAX_PATH_LEN, "%s%s", STORAGE_ROOT, dest_path + 3); // +3 to skip "~S1"
     
     // Create directory tree if needed
     if (create_directory_tree(s2_path) < 0) 
     {
-        write(client_sock, "ERROR: Failed to create directory", 32);
+        reject_upload(req, DFS_ERR_IO, "ERROR: Failed to create directory");
         return -1;
     }
     
     // Construct full file path
     char *base_name = basename(filename);
     char full_path[MAX_PATH_LEN];
-    snprintf(full_path, MAX_PATH_LEN, "%s/%s", s2_path, base_name);
+    if (snprintf(full_path, MAX_PATH_LEN, "%s/%s", s2_path, base_name) >= MAX_PATH_LEN) 
+    {
+        reject_upload(req, DFS_ERR_INVALID, "ERROR: Destination path too long");
+        return -1;
+    }
+    
+    // Older versions of S1 send a text command naming a file S1 has already stored;
+    // rename/move it from that temporary location to the final destination
+    if (!req->framed) 
+    {
+        if (rename(filename, full_path) < 0) 
+        {
+            dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to move file to destination");
+            return -1;
+        }
+        tar_cache_invalidate();
+        dir_cache_invalidate(full_path);
+        dfs_reply_status(req, DFS_OK, "SUCCESS: PDF file stored in S2");
+        return 0;
+    }
     
-    // Rename/move the file from temporary location (sent by S1) to final destination
-    if (rename(filename, full_path) < 0) 
+    // Receive the file data S1 streams after the request into a temporary file next to it, which
+    // replaces the file only once complete; until then readers see the old file
+    char tmp_path[MAX_PATH_LEN];
+    int fd = -1;
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.XXXXXX", s2_path, base_name) < (int)sizeof(tmp_path)) 
     {
-        write(client_sock, "ERROR: Failed to move file to destination", 38);
+        fd = mkstemp(tmp_path);
+    }
+    if (fd < 0) 
+    {
+        reject_upload(req, DFS_ERR_IO, "ERROR: Failed to create file");
+        return -1;
+    }
+    fchmod(fd, 0644);
+    int received = dfs_recv_upload(req, fd);
+    close(fd);
+    if (received < 0 || rename(tmp_path, full_path) < 0) 
+    {
+        unlink(tmp_path);
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: File transfer failed");
         return -1;
     }
+    tar_cache_invalidate();
+    dir_cache_invalidate(full_path);
     
-    write(client_sock, "SUCCESS: PDF file stored in S2", 30);
+    dfs_reply_status(req, DFS_OK, "SUCCESS: PDF file stored in S2");
     return 0;
 }
 
 // Function to download a PDF file from S2
 // Sends the requested file to S1 if it exists.
-int download_file(int client_sock, char *filename) 
+int download_file(struct dfs_request *req, char *filename) 
 {
     // Check if file exists in S2
     char s2_path[MAX_PATH_LEN];
-    snprintf(s2_path, MAX_PATH_LEN, "%s/S2%s", getenv("HOME"), filename + 3); // +3 to skip "~S1"
+    snprintf(s2_path, MAX_PATH_LEN, "%s%s", STORAGE_ROOT, filename + 3); // +3 to skip "~S1"
     
     struct stat st;
     if (stat(s2_path, &st) != 0) 
     {
-        write(client_sock, "ERROR: PDF file not found in S2", 30);
+        dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: PDF file not found in S2");
         return -1;
     }
     
@@ -246,197 +608,66 @@ int download_file(int client_sock, char *filename)
     int fd = open(s2_path, O_RDONLY);
     if (fd < 0) 
     {
-        write(client_sock, "ERROR: Failed to open PDF file", 29);
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to open PDF file");
         return -1;
     }
     
-    // Send file size
-    if (write(client_sock, &st.st_size, sizeof(off_t)) != sizeof(off_t)) 
-    {
-        close(fd);
-        write(client_sock, "ERROR: Failed to send file size", 31);
-        return -1;
-    }
-    
-    // Send file data
-    off_t remaining = st.st_size;
-    char buffer[BUFFER_SIZE];
-    while (remaining > 0) 
-    {
-        ssize_t n = read(fd, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-        if (n <= 0)
-        {
-            close(fd);
-            write(client_sock, "ERROR: File transfer failed", 27);
-            return -1;
-        }
-        if (write(client_sock, buffer, n) != n) 
-        {
-            close(fd);
-            write(client_sock, "ERROR: File transfer failed", 27);
-            return -1;
-        }
-        remaining -= n;
-    }
+    // Send file size and data
+    int ret = dfs_reply_file_body(req, fd, st.st_size);
     close(fd);
-    return 0;
+    return ret;
 }
 
 // Function to remove a PDF file from S2
 // Deletes the specified file if it exists.
-int remove_file(int client_sock, char *filename)
+int remove_file(struct dfs_request *req, char *filename)
 {
     // Check if file exists in S2
     char s2_path[MAX_PATH_LEN];
-    snprintf(s2_path, MAX_PATH_LEN, "%s/S2%s", getenv("HOME"), filename + 3); // +3 to skip "~S1"
+    snprintf(s2_path, MAX_PATH_LEN, "%s%s", STORAGE_ROOT, filename + 3); // +3 to skip "~S1"
     
     if (unlink(s2_path) == 0) 
     {
-        write(client_sock, "SUCCESS: PDF file deleted from S2", 32);
+        tar_cache_invalidate();
+        dir_cache_invalidate(s2_path);
+        dfs_reply_status(req, DFS_OK, "SUCCESS: PDF file deleted from S2");
         return 0;
     }
     
-    write(client_sock, "ERROR: PDF file not found in S2", 30);
+    dfs_reply_status(req, DFS_ERR_NOT_FOUND, "ERROR: PDF file not found in S2");
     return -1;
 }
 
-// Function to create a tar file containing all PDF files in S2
-// Finds all .pdf files and creates a tar archive to send to S1.
-int download_tar(int client_sock) 
+// Function to send a tar archive containing all PDF files in S2
+// The last archive built is kept in the cache directory and sent again with sendfile() until a
+// file is uploaded or removed. With since_arg only the files modified at or after that time
+// (seconds since the epoch) are included. With compress set the archive is gzip compressed on
+// several threads.
+int download_tar(struct dfs_request *req, char *since_arg, int compress) 
 {
-    char s2_dir[MAX_PATH_LEN];
-    snprintf(s2_dir, MAX_PATH_LEN, "%s/S2", getenv("HOME"));
-    
-    // Create tar file for .pdf files
-    char tar_cmd[MAX_PATH_LEN + 50];
-    snprintf(tar_cmd, sizeof(tar_cmd),
-             "find %s -type f -name \"*.pdf\" | tar -cf /tmp/pdffiles.tar -T -", s2_dir);
-
-    // Execute the tar command
-    if (system(tar_cmd) != 0)
+    time_t since;
+    if (tar_parse_since(since_arg, &since) < 0) 
     {
-        write(client_sock, "ERROR: Failed to create tar file", 32);
+        dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid downltar command format");
         return -1;
     }
-    
-    // Check if the tar file was created successfully
-    struct stat st;
-    if (stat("/tmp/pdffiles.tar", &st) != 0) 
-    {
-        write(client_sock, "ERROR: Tar file not found", 25);
-        return -1;
-    }
-    
-    // Open the tar file for reading
-    int fd = open("/tmp/pdffiles.tar", O_RDONLY);
-    if (fd < 0) 
-    {
-        write(client_sock, "ERROR: Failed to open tar file", 30);
-        return -1;
-    }
-    
-    // Send the tar file size to the client
-    write(client_sock, &st.st_size, sizeof(off_t));
-    
-    // Send the tar file data to the client
-    off_t remaining = st.st_size;
-    while (remaining > 0) 
-    {
-        ssize_t sent = sendfile(client_sock, fd, NULL, remaining);
-        if (sent <= 0) 
-        {
-            close(fd);
-            write(client_sock, "ERROR: File transfer failed", 27);
-            return -1;
-        }
-        remaining -= sent;
-    }
-    close(fd);
-    
-    // Clean up the tar file
-    unlink("/tmp/pdffiles.tar");
-    
-    return 0;
+    return tar_cache_reply(req, STORAGE_ROOT, ".pdf", since, compress);
 }
 
 // Function to display filenames of PDF files in S2
-// Recursively lists all .pdf files in the S2 directory.
-int display_filenames(int client_sock, char *pathname) 
+// Lists the .pdf files below the directory from the cached directory listings, streamed while the
+// directories are walked.
+int display_filenames(struct dfs_request *req, char *pathname, char *limit_arg, char *after) 
 {
-    // Get the corresponding path in S2
-    char s2_path[MAX_PATH_LEN];
-    snprintf(s2_path, MAX_PATH_LEN, "%s/S2%s", getenv("HOME"), 
-             (strcmp(pathname, "~S1") == 0) ? "" : (pathname + 3)); // Handle root case
-    
-    // Check if path exists and is a directory
-    struct stat st;
-    if (stat(s2_path, &st) != 0 || !S_ISDIR(st.st_mode)) 
+    size_t limit;
+    if (ns_parse_limit(limit_arg, &limit) < 0 || (after != NULL && strncmp(after, "~S1/", 4) != 0)) 
     {
-        write(client_sock, "", 0); // Send empty response if directory doesn't exist
-        return 0;
-    }
-    
-    // Get PDF files from S2 recursively
-    char file_list[BUFFER_SIZE] = {0};
-    
-    // Recursive directory traversal function
-    void list_pdf_files(const char *base_path, const char *relative_path) 
-    {
-        DIR *dir = opendir(base_path);
-        if (!dir) return;
-        
-        struct dirent *ent;
-        while ((ent = readdir(dir)) != NULL) 
-        {
-            // Skip . and .. directories
-            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) 
-            {
-                continue;
-            }
-            
-            char full_path[MAX_PATH_LEN];
-            snprintf(full_path, sizeof(full_path), "%s/%s", base_path, ent->d_name);
-            
-            char new_relative_path[MAX_PATH_LEN];
-            if (strcmp(relative_path, "") == 0) 
-            {
-                snprintf(new_relative_path, sizeof(new_relative_path), "%s", ent->d_name);
-            } 
-            else 
-            {
-                snprintf(new_relative_path, sizeof(new_relative_path), "%s/%s", relative_path, ent->d_name);
-            }
-            
-            if (ent->d_type == DT_REG) 
-            {
-                // Check if it's a PDF file
-                char *ext = strrchr(ent->d_name, '.');
-                if (ext && strcmp(ext, ".pdf") == 0) 
-                {
-                    // Convert to ~S1-style path
-                    char output_path[MAX_PATH_LEN];
-                    snprintf(output_path, sizeof(output_path), "~S1/%s", new_relative_path);
-
-                    
-                    strncat(file_list, output_path, BUFFER_SIZE - strlen(file_list) - 1);
-                    strncat(file_list, "\n", BUFFER_SIZE - strlen(file_list) - 1);
-                }
-            } 
-            else if (ent->d_type == DT_DIR) 
-            {
-                // Recursively process subdirectory
-                list_pdf_files(full_path, new_relative_path);
-            }
-        }
-        closedir(dir);
+        dfs_reply_status(req, DFS_ERR_INVALID, "ERROR: Invalid dispfnames command format");
+        return -1;
     }
     
-    // Start recursive traversal from the base path
-    list_pdf_files(s2_path, "");
-    
-    // Send the list to S1
-    write(client_sock, file_list, strlen(file_list));
-    return 0;
+    // +3 to skip "~S1"; a directory that doesn't exist here gives an empty listing
+    return dir_cache_reply(req, STORAGE_ROOT, ".pdf", pathname + 3, (after != NULL) ? after + 3 : NULL, limit);
 }
 
 // Function to create a directory tree for a given path
@@ -462,7 +693,11 @@ int create_directory_tree(char *path)
     while ((p = strchr(p, '/'))) 
     {
         *p = '\0';
-        if (mkdir(tmp, 0755) && errno != EEXIST) 
+        if (mkdir(tmp, 0755) == 0) 
+        {
+            dir_cache_invalidate(tmp);
+        }
+        else if (errno != EEXIST) 
         {
             return -1;
         }
@@ -471,7 +706,11 @@ int create_directory_tree(char *path)
     }
     
     // Create the final directory
-    if (mkdir(tmp, 0755) && errno != EEXIST) 
+    if (mkdir(tmp, 0755) == 0) 
+    {
+        dir_cache_invalidate(tmp);
+    }
+    else if (errno != EEXIST) 
     {
         return -1;
     }
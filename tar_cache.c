@@ -0,0 +1,190 @@
+// Distributed File System - Archive Cache Implementation
+// One slot for plain and one for compressed archives, each a file in the cache directory guarded by
+// a mutex that is held while the archive is checked or rebuilt, but not while it is sent.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h> // for PATH_MAX
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "tar_cache.h"
+#include "gzip_stream.h"
+#include "tar_stream.h"
+
+#define SUFFIX_LEN 16 // Longest file type suffix remembered for a cached archive
+#define CACHE_NAME_MAX 32 // Longest "/name" of an archive in the cache directory
+
+// A cached archive and what it was built from
+struct cache_slot
+{
+    pthread_mutex_t lock;
+    const char *name; // File name in the cache directory
+    int valid; // The file holds a complete archive built in generation
+    uint64_t generation;
+    char suffix[SUFFIX_LEN];
+    time_t since;
+};
+
+static char cache_dir[PATH_MAX]; // Empty until tar_cache_init() succeeds
+static struct cache_slot slots[2] = {
+    { .lock = PTHREAD_MUTEX_INITIALIZER, .name = "archive.tar" },
+    { .lock = PTHREAD_MUTEX_INITIALIZER, .name = "archive.tar.gz" }
+};
+
+// Number of changes made to the stored files
+static uint64_t generation;
+static pthread_mutex_t generation_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to set the directory the archives are kept in
+int tar_cache_init(const char *dir)
+{
+    if (strlen(dir) >= sizeof(cache_dir) - SUFFIX_LEN)
+    {
+        return -1;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+    strcpy(cache_dir, dir);
+    return 0;
+}
+
+// Function to mark the cached archives stale
+void tar_cache_invalidate(void)
+{
+    pthread_mutex_lock(&generation_lock);
+    generation++;
+    pthread_mutex_unlock(&generation_lock);
+}
+
+// Function to read the generation counter
+static uint64_t current_generation(void)
+{
+    pthread_mutex_lock(&generation_lock);
+    uint64_t gen = generation;
+    pthread_mutex_unlock(&generation_lock);
+    return gen;
+}
+
+// Function to write an archive to path
+// The archive goes to a temporary file first and replaces path only once it is complete.
+static int build_archive(const char *path, const char *root, const char *suffix, time_t since, int compress)
+{
+    char tmp[sizeof(cache_dir) + CACHE_NAME_MAX + sizeof(".tmp")];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    struct tar_list list;
+    if (tar_collect(&list, root, suffix, since) < 0)
+    {
+        tar_free(&list);
+        return -1;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        tar_free(&list);
+        return -1;
+    }
+
+    struct tar_sink out;
+    tar_file_sink(&fd, &out);
+
+    int ret;
+    if (compress)
+    {
+        struct gzip_stream *gz = gzip_open(&out);
+        ret = -1;
+        if (gz != NULL)
+        {
+            struct tar_sink sink;
+            gzip_sink(gz, &sink);
+            ret = tar_send(&sink, &list, 1);
+            if (gzip_close(gz) < 0)
+            {
+                ret = -1;
+            }
+        }
+    }
+    else
+    {
+        ret = tar_send(&out, &list, 1);
+    }
+    tar_free(&list);
+
+    if (close(fd) < 0)
+    {
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmp, path) < 0)
+    {
+        ret = -1;
+    }
+    if (ret < 0)
+    {
+        unlink(tmp);
+    }
+    return ret;
+}
+
+// Function to answer a request with a cached archive
+// The file is opened before the slot is unlocked, so a rebuild replacing it does not affect the reply.
+// If the archive cannot be written to the cache it is streamed to the requester instead.
+int tar_cache_reply(struct dfs_request *req, const char *root, const char *suffix, time_t since, int compress)
+{
+    struct cache_slot *slot = &slots[compress ? 1 : 0];
+    int fd = -1;
+
+    if (cache_dir[0] != '\0' && strlen(suffix) < SUFFIX_LEN)
+    {
+        char path[sizeof(cache_dir) + CACHE_NAME_MAX];
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, slot->name);
+
+        pthread_mutex_lock(&slot->lock);
+        uint64_t gen = current_generation();
+        if (slot->valid && slot->generation == gen && slot->since == since && strcmp(slot->suffix, suffix) == 0)
+        {
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+        if (fd < 0)
+        {
+            // Files changed while the archive is built make the generation move on, so such an
+            // archive is stale as soon as it is finished
+            slot->valid = 0;
+            if (build_archive(path, root, suffix, since, compress) == 0)
+            {
+                slot->valid = 1;
+                slot->generation = gen;
+                slot->since = since;
+                strcpy(slot->suffix, suffix);
+                fd = open(path, O_RDONLY | O_CLOEXEC);
+            }
+        }
+        pthread_mutex_unlock(&slot->lock);
+    }
+
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        if (compress)
+        {
+            return gzip_tar_reply(req, root, suffix, since);
+        }
+        return tar_reply(req, root, suffix, since);
+    }
+
+    int ret = dfs_reply_file_body(req, fd, st.st_size);
+    close(fd);
+    return ret;
+}
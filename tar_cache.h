@@ -0,0 +1,33 @@
+// Distributed File System - Archive Cache
+// Keeps the last downltar archive a storage server built on disk and answers repeated requests for
+// it with sendfile(). Used by S2, S3 and S4.
+//
+// Every change to the stored files (an upload or a removal) bumps a generation counter. An archive
+// is tagged with the generation it was built in and is served for as long as the counter has not
+// moved past it. There is one archive for plain and one for compressed requests, each replaced by
+// the next request asking for different files (another type or since time) or finding it stale.
+// Requests arriving while an archive is being built wait for it instead of building their own, so
+// many clients pulling the same bundle cost a single build.
+//
+// Archives are written under a temporary name and renamed into place, so a reply already being
+// sent from the previous one keeps reading a complete file.
+
+#ifndef TAR_CACHE_H
+#define TAR_CACHE_H
+
+#include <time.h>
+
+#include "protocol.h"
+
+// Sets the directory the archives are kept in, creating it if needed. Without it every request is
+// answered with a freshly built archive. Returns -1 if the directory cannot be used.
+int tar_cache_init(const char *dir);
+
+// Marks the cached archives stale; called after every change to the stored files
+void tar_cache_invalidate(void);
+
+// Answers req with an archive of the files below root whose names end in suffix, modified at or
+// after since, gzip compressed if compress is set. Built if no valid cached archive matches.
+int tar_cache_reply(struct dfs_request *req, const char *root, const char *suffix, time_t since, int compress);
+
+#endif
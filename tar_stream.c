@@ -0,0 +1,571 @@
+// Distributed File System - Streaming Tar Archives Implementation
+// ustar encoding of the collected files, sent with the reply helpers of the framed protocol.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h> // for offsetof()
+#include <unistd.h>
+#include <limits.h> // for PATH_MAX
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h> // for sendfile()
+#include <zlib.h> // for gzopen()
+#include <sys/socket.h> // for setsockopt()
+#include <netinet/in.h> // for IPPROTO_TCP
+#include <netinet/tcp.h> // for TCP_CORK
+
+#include "tar_stream.h"
+
+#define LONG_NAME_ENTRY "././@LongLink" // Name of the GNU entries carrying long member names
+#define MAX_STAGED (TAR_BLOCK_SIZE * 12) // Padding, long name entry and header sent ahead of a file
+#define NAME_LEN 100 // Size of the name field of a header
+#define PREFIX_LEN 155 // Size of the prefix field, holding the leading directories of longer names
+
+// ustar header block
+struct ustar_header
+{
+    char name[NAME_LEN];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[PREFIX_LEN];
+    char pad[12];
+};
+
+// Zeros written in place of the missing part of a file that shrank
+static const char zeros[DFS_CHUNK_SIZE];
+
+// Function to round a size up to whole blocks
+static off_t padded(off_t size)
+{
+    return (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+}
+
+// Function to find where a member name is split between the prefix and name fields
+// Returns 0 if the name fits the name field alone, the index of the separating '/' if it has to be
+// split, or -1 if it does not fit a ustar header at all.
+static int split_name(const char *name)
+{
+    size_t len = strlen(name);
+    if (len <= NAME_LEN)
+    {
+        return 0;
+    }
+
+    for (size_t i = (len - 1 < PREFIX_LEN) ? len - 1 : PREFIX_LEN; i > 0; i--)
+    {
+        if (name[i] == '/')
+        {
+            return (len - i - 1 <= NAME_LEN) ? (int)i : -1;
+        }
+    }
+    return -1;
+}
+
+// Function to store a number in a header field
+// Numbers too large for the octal digits of the field use the GNU base-256 encoding.
+static void put_number(char *field, size_t width, uint64_t value)
+{
+    if (value < (1ULL << (3 * (width - 1))))
+    {
+        field[width - 1] = '\0';
+        for (size_t i = width - 1; i > 0; i--)
+        {
+            field[i - 1] = (char)('0' + (value & 7));
+            value >>= 3;
+        }
+        return;
+    }
+
+    for (size_t i = width - 1; i > 0; i--)
+    {
+        field[i] = (char)(value & 0xFF);
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+// Function to read a number from a header field, in octal digits or base-256
+static uint64_t get_number(const char *field, size_t width)
+{
+    uint64_t value = 0;
+
+    if ((unsigned char)field[0] & 0x80)
+    {
+        for (size_t i = 1; i < width; i++)
+        {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < width && field[i] == ' ')
+    {
+        i++;
+    }
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; i++)
+    {
+        value = (value << 3) | (uint64_t)(field[i] - '0');
+    }
+    return value;
+}
+
+// Function to fill in a header block
+static void build_header(unsigned char *block, const char *name, int split, char typeflag,
+                         mode_t mode, off_t size, time_t mtime)
+{
+    struct ustar_header *hdr = (struct ustar_header *)block;
+    memset(hdr, 0, sizeof(*hdr));
+
+    // The fields are not terminated when the name fills them; a name too long for a ustar header is
+    // cut off, its 'L' entry giving it in full
+    const char *base = (split > 0) ? name + split + 1 : name;
+    size_t base_len = strlen(base);
+    if (split > 0)
+    {
+        memcpy(hdr->prefix, name, split);
+    }
+    memcpy(hdr->name, base, (base_len < sizeof(hdr->name)) ? base_len : sizeof(hdr->name));
+    put_number(hdr->mode, sizeof(hdr->mode), mode & 07777);
+    put_number(hdr->uid, sizeof(hdr->uid), 0);
+    put_number(hdr->gid, sizeof(hdr->gid), 0);
+    put_number(hdr->size, sizeof(hdr->size), size);
+    put_number(hdr->mtime, sizeof(hdr->mtime), (mtime > 0) ? mtime : 0);
+    hdr->typeflag = typeflag;
+    memcpy(hdr->magic, "ustar", 6);
+    memcpy(hdr->version, "00", 2);
+
+    // The checksum is computed with the checksum field taken as spaces
+    unsigned int sum = 0;
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+    for (size_t i = 0; i < sizeof(*hdr); i++)
+    {
+        sum += block[i];
+    }
+    snprintf(hdr->chksum, sizeof(hdr->chksum), "%06o", sum);
+    hdr->chksum[7] = ' ';
+}
+
+// Function to add a file to the list
+static int add_entry(struct tar_list *list, const char *path, size_t name_off, const struct stat *st)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = (list->capacity > 0) ? list->capacity * 2 : 64;
+        struct tar_entry *entries = realloc(list->entries, capacity * sizeof(*entries));
+        if (entries == NULL)
+        {
+            return -1;
+        }
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+
+    struct tar_entry *e = &list->entries[list->count];
+    e->path = strdup(path);
+    if (e->path == NULL)
+    {
+        return -1;
+    }
+    e->name = e->path + name_off;
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->mode = st->st_mode;
+    list->count++;
+    return 0;
+}
+
+// Function to recursively collect the matching files below the directory in path
+// path holds len characters and is extended in place for the entries of the directory.
+static int collect_dir(struct tar_list *list, char *path, size_t len, size_t name_off, const char *suffix,
+                       time_t since)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    size_t suffix_len = strlen(suffix);
+    struct dirent *ent;
+    int ret = 0;
+    while (ret == 0 && (ent = readdir(dir)) != NULL)
+    {
+        // Skip . and .. directories
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        size_t name_len = strlen(ent->d_name);
+        if (len + 1 + name_len >= PATH_MAX)
+        {
+            continue;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, ent->d_name, name_len + 1);
+
+        struct stat st;
+        if (lstat(path, &st) != 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            ret = collect_dir(list, path, len + 1 + name_len, name_off, suffix, since);
+        }
+        else if (S_ISREG(st.st_mode) && st.st_mtime >= since && name_len >= suffix_len &&
+                 strcmp(ent->d_name + name_len - suffix_len, suffix) == 0)
+        {
+            ret = add_entry(list, path, name_off, &st);
+        }
+    }
+
+    path[len] = '\0';
+    closedir(dir);
+    return ret;
+}
+
+// Function to collect the files of an archive
+int tar_collect(struct tar_list *list, const char *root, const char *suffix, time_t since)
+{
+    char path[PATH_MAX];
+    size_t len = strlen(root);
+
+    memset(list, 0, sizeof(*list));
+    while (len > 1 && root[len - 1] == '/')
+    {
+        len--;
+    }
+    if (len >= PATH_MAX)
+    {
+        return 0;
+    }
+    memcpy(path, root, len);
+    path[len] = '\0';
+
+    // Member names start after the root and its '/'
+    return collect_dir(list, path, len, len + 1, suffix, since);
+}
+
+// Function to compute the archive size
+off_t tar_archive_size(const struct tar_list *list)
+{
+    off_t size = TAR_END_SIZE;
+
+    for (size_t i = 0; i < list->count; i++)
+    {
+        const struct tar_entry *e = &list->entries[i];
+        if (split_name(e->name) < 0)
+        {
+            size += TAR_BLOCK_SIZE + padded(strlen(e->name) + 1);
+        }
+        size += TAR_BLOCK_SIZE + padded(e->size);
+    }
+    return size;
+}
+
+// Function to append bytes to a reply body
+static int reply_data(void *ctx, const void *buf, size_t len)
+{
+    return dfs_reply_data(ctx, buf, len);
+}
+
+// Function to append the contents of a file or socket to a reply body
+// Files go out with sendfile(), data arriving on a socket is spliced through.
+static int reply_copy(void *ctx, int fd, uint64_t len)
+{
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        return dfs_reply_relay(ctx, fd, len);
+    }
+    return dfs_reply_file(ctx, fd, len);
+}
+
+// Function to make a sink that writes into the body of a reply
+void tar_reply_sink(struct dfs_request *req, struct tar_sink *sink)
+{
+    sink->data = reply_data;
+    sink->copy = reply_copy;
+    sink->ctx = req;
+}
+
+// Function to append bytes to a file
+static int file_data(void *ctx, const void *buf, size_t len)
+{
+    return dfs_write_full(*(int *)ctx, buf, len);
+}
+
+// Function to append the contents of another file to a file
+// sendfile() copies between regular files inside the kernel.
+static int file_copy(void *ctx, int fd, uint64_t len)
+{
+    while (len > 0)
+    {
+        size_t chunk = (len < DFS_FILE_CHUNK_SIZE) ? (size_t)len : DFS_FILE_CHUNK_SIZE;
+        ssize_t sent = sendfile(*(int *)ctx, fd, NULL, chunk);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        len -= sent;
+    }
+    return 0;
+}
+
+// Function to make a sink that writes into a file
+void tar_file_sink(int *fd, struct tar_sink *sink)
+{
+    sink->data = file_data;
+    sink->copy = file_copy;
+    sink->ctx = fd;
+}
+
+// Function to stream the archive
+// The padding of each file, the next header and, for long names, its GNU long name entry are sent
+// together in one piece, so every entry costs a single write ahead of its file data.
+int tar_send(const struct tar_sink *sink, const struct tar_list *list, int end)
+{
+    unsigned char staged[MAX_STAGED];
+    size_t nstaged = 0;
+
+    for (size_t i = 0; i < list->count; i++)
+    {
+        const struct tar_entry *e = &list->entries[i];
+        int split = split_name(e->name);
+
+        if (split < 0)
+        {
+            size_t name_len = strlen(e->name) + 1;
+            build_header(staged + nstaged, LONG_NAME_ENTRY, 0, 'L', 0644, name_len, 0);
+            nstaged += TAR_BLOCK_SIZE;
+            memset(staged + nstaged, 0, padded(name_len));
+            memcpy(staged + nstaged, e->name, name_len);
+            nstaged += padded(name_len);
+            split = 0;
+        }
+        build_header(staged + nstaged, e->name, split, '0', e->mode, e->size, e->mtime);
+        nstaged += TAR_BLOCK_SIZE;
+
+        if (sink->data(sink->ctx, staged, nstaged) < 0)
+        {
+            return -1;
+        }
+
+        // Contents as collected, even if the file changed in the meantime
+        off_t sent = 0;
+        int fd = open(e->path, O_RDONLY);
+        if (fd >= 0)
+        {
+            struct stat st;
+            if (fstat(fd, &st) == 0)
+            {
+                sent = (st.st_size < e->size) ? st.st_size : e->size;
+            }
+            if (sent > 0 && sink->copy(sink->ctx, fd, sent) < 0)
+            {
+                close(fd);
+                return -1;
+            }
+            close(fd);
+        }
+        for (off_t left = e->size - sent; left > 0; )
+        {
+            size_t n = (left < (off_t)sizeof(zeros)) ? (size_t)left : sizeof(zeros);
+            if (sink->data(sink->ctx, zeros, n) < 0)
+            {
+                return -1;
+            }
+            left -= n;
+        }
+
+        // The padding goes out with the next header
+        nstaged = padded(e->size) - e->size;
+        memset(staged, 0, nstaged);
+    }
+
+    if (end)
+    {
+        memset(staged + nstaged, 0, TAR_END_SIZE);
+        nstaged += TAR_END_SIZE;
+    }
+    return (nstaged > 0) ? sink->data(sink->ctx, staged, nstaged) : 0;
+}
+
+// Function to decode a header block of an archive
+int tar_read_header(const unsigned char *block, off_t *size, int *extension)
+{
+    const struct ustar_header *hdr = (const struct ustar_header *)block;
+    unsigned int sum = 0, expected = 0;
+    int zero = 1;
+
+    for (size_t i = 0; i < sizeof(*hdr); i++)
+    {
+        zero &= (block[i] == 0);
+        sum += (i >= offsetof(struct ustar_header, chksum) &&
+                i < offsetof(struct ustar_header, chksum) + sizeof(hdr->chksum)) ? ' ' : block[i];
+    }
+    if (zero)
+    {
+        return 0;
+    }
+    if (sscanf(hdr->chksum, "%o", &expected) != 1 || expected != sum)
+    {
+        return -1;
+    }
+
+    // Directories and links have no data whatever their size field says
+    char type = hdr->typeflag;
+    *size = (type == '0' || type == '\0' || type == '7' || type == 'L' || type == 'K' ||
+             type == 'x' || type == 'g') ? padded((off_t)get_number(hdr->size, sizeof(hdr->size))) : 0;
+    *extension = (type == 'L' || type == 'K' || type == 'x');
+    return 1;
+}
+
+// Function to read the member name of a header block
+// A name split between the prefix and name fields is joined again.
+int tar_entry_name(const unsigned char *block, char *name, size_t size)
+{
+    const struct ustar_header *hdr = (const struct ustar_header *)block;
+
+    if (hdr->typeflag == 'L')
+    {
+        return 1;
+    }
+    int prefix_len = (int)strnlen(hdr->prefix, sizeof(hdr->prefix));
+    int name_len = (int)strnlen(hdr->name, sizeof(hdr->name));
+    if (prefix_len > 0)
+    {
+        snprintf(name, size, "%.*s/%.*s", prefix_len, hdr->prefix, name_len, hdr->name);
+    }
+    else
+    {
+        snprintf(name, size, "%.*s", name_len, hdr->name);
+    }
+    return 0;
+}
+
+// Function to find the newest modification time recorded in an archive
+// zlib reads compressed archives and passes plain ones through unchanged.
+time_t tar_newest_mtime(const char *path)
+{
+    unsigned char block[TAR_BLOCK_SIZE];
+    time_t newest = 0;
+    time_t result = -1; // Only an archive read up to its end marker counts
+
+    gzFile file = gzopen(path, "rb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    while (gzread(file, block, sizeof(block)) == (int)sizeof(block))
+    {
+        const struct ustar_header *hdr = (const struct ustar_header *)block;
+        off_t size;
+        int extension;
+        int entry = tar_read_header(block, &size, &extension);
+        if (entry <= 0)
+        {
+            result = (entry == 0) ? newest : -1;
+            break;
+        }
+
+        time_t mtime = (time_t)get_number(hdr->mtime, sizeof(hdr->mtime));
+        if (!extension && mtime > newest)
+        {
+            newest = mtime;
+        }
+        if (gzseek(file, size, SEEK_CUR) < 0)
+        {
+            break;
+        }
+    }
+
+    gzclose(file);
+    return result;
+}
+
+// Function to parse the since argument of a downltar request
+int tar_parse_since(const char *arg, time_t *since)
+{
+    char *end;
+
+    *since = 0;
+    if (arg == NULL)
+    {
+        return 0;
+    }
+    long long value = strtoll(arg, &end, 10);
+    if (end == arg || *end != '\0' || value < 0)
+    {
+        return -1;
+    }
+    *since = (time_t)value;
+    return 0;
+}
+
+// Function to free a list of files
+void tar_free(struct tar_list *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->entries[i].path);
+    }
+    free(list->entries);
+    memset(list, 0, sizeof(*list));
+}
+
+// Function to answer a request with an archive
+// The socket is corked while the archive is sent, so headers and small files fill whole packets.
+int tar_reply(struct dfs_request *req, const char *root, const char *suffix, time_t since)
+{
+    struct tar_list list;
+    if (tar_collect(&list, root, suffix, since) < 0)
+    {
+        tar_free(&list);
+        dfs_reply_status(req, DFS_ERR_IO, "ERROR: Failed to create tar file");
+        return -1;
+    }
+
+    int on = 1, off = 0;
+    setsockopt(req->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+
+    struct tar_sink sink;
+    tar_reply_sink(req, &sink);
+
+    int ret = dfs_reply_begin(req, tar_archive_size(&list));
+    if (ret == 0)
+    {
+        ret = tar_send(&sink, &list, 1);
+    }
+    if (ret == 0)
+    {
+        ret = dfs_reply_end(req, DFS_OK);
+    }
+
+    setsockopt(req->sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    tar_free(&list);
+    return ret;
+}
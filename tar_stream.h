@@ -0,0 +1,100 @@
+// Distributed File System - Streaming Tar Archives
+// Builds ustar archives of a server's files in-process and streams them as the body of a reply.
+// Used by S1 for .c files and by S2, S3, S4 for their own types.
+//
+// The matching files are collected first, so the size of the archive is known before any of it is
+// sent. Each entry is then written as a 512-byte header followed by the file contents, which go to
+// the socket with sendfile(); tar_stream itself stages nothing on disk, though S2, S3 and S4 may
+// have it write into an on-disk file that tar_cache keeps for repeated requests. Member names are
+// relative to the storage directory; names that do not fit a ustar header are carried in GNU long
+// name entries.
+
+#ifndef TAR_STREAM_H
+#define TAR_STREAM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "protocol.h"
+
+#define TAR_BLOCK_SIZE 512 // Headers, file data and the end marker come in blocks of this size
+#define TAR_END_SIZE (2 * TAR_BLOCK_SIZE) // Zero blocks marking the end of an archive
+
+// A file to be archived
+struct tar_entry
+{
+    char *path; // Full path on disk
+    const char *name; // Member name, points into path
+    off_t size; // Size when collected, the number of bytes archived
+    time_t mtime;
+    mode_t mode;
+};
+
+// Destination of the bytes of an archive: the reply body itself, or a filter such as compression
+struct tar_sink
+{
+    int (*data)(void *ctx, const void *buf, size_t len); // Appends bytes
+    int (*copy)(void *ctx, int fd, uint64_t len); // Appends len bytes read from a file or socket
+    void *ctx;
+};
+
+// Files that make up one archive
+struct tar_list
+{
+    struct tar_entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+// Collects the regular files below root whose names end in suffix and that were modified at or after
+// since (0 for all of them) into list. A missing root gives an empty list. Returns -1 if memory runs out.
+int tar_collect(struct tar_list *list, const char *root, const char *suffix, time_t since);
+
+// Size of the archive tar_send() produces for list, including the end marker
+off_t tar_archive_size(const struct tar_list *list);
+
+// Sets up sink to write into the body of req, started with dfs_reply_begin()
+void tar_reply_sink(struct dfs_request *req, struct tar_sink *sink);
+
+// Sets up sink to write into the file open on *fd, which must stay valid while the sink is used
+void tar_file_sink(int *fd, struct tar_sink *sink);
+
+// Writes the archive of list to sink.
+// The end marker is only added if end is set, so that more entries can follow in a merged archive.
+// A file that shrank since it was collected is padded with zeros, one that grew is cut at its
+// collected size. Returns -1 if writing failed.
+int tar_send(const struct tar_sink *sink, const struct tar_list *list, int end);
+
+// Decodes a header block of an archive being merged into another. Returns 0 for a zero block (the
+// end marker), -1 if the checksum is wrong, or 1 for an entry header. *size is then the number of
+// bytes of data following it, padding included, and *extension is set if the entry only carries
+// metadata (such as a long name) of the entry after it.
+int tar_read_header(const unsigned char *block, off_t *size, int *extension);
+
+// Copies the member name of an entry header into name (at most size bytes) and returns 0, or returns
+// 1 without touching name if the header is a GNU long name entry, whose data is the name of the
+// entry after it.
+int tar_entry_name(const unsigned char *block, char *name, size_t size);
+
+// Newest modification time of the entries in the archive at path, plain or gzip compressed, 0 if it
+// has none, or -1 if it is not a tar archive. Used to ask only for the files that changed after a
+// previous archive.
+time_t tar_newest_mtime(const char *path);
+
+// downltar arguments are the file types, optionally the since time and then TAR_ARG_GZIP to ask for
+// a gzip compressed archive (the since time is "0" if only compression is wanted)
+#define TAR_ARG_GZIP "gzip"
+
+// Parses the optional since argument of a downltar request, seconds since the epoch.
+// NULL gives 0 (every file). Returns -1 if the argument is not a number.
+int tar_parse_since(const char *arg, time_t *since);
+
+// Frees the entries of list
+void tar_free(struct tar_list *list);
+
+// Answers req with an archive of the files below root whose names end in suffix, modified at or
+// after since
+int tar_reply(struct dfs_request *req, const char *root, const char *suffix, time_t since);
+
+#endif
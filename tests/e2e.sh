@@ -0,0 +1,231 @@
+#!/bin/bash
+# Distributed File System - End-to-end test
+# Builds S1-S4 and the client, starts the servers from a configuration in a temporary directory and
+# drives them through the client: uploads, pipelined downloads, removals, full, incremental and
+# compressed downltar archives, paged dispfnames listings and a restart of S1 from its saved index.
+# S2 runs as three instances keeping two copies of every .pdf file, so the placement of the files on
+# the ring and their replication are checked on disk as well.
+#
+# Usage: tests/e2e.sh [first_port]
+# The servers listen on first_port (default 14307) and the five ports after it. Prints one line per
+# check and exits with 1 if any failed; the temporary directory is kept then, for its server logs.
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PORT=${1:-14307}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/dfs-e2e.XXXXXX")
+BIN=$WORK/bin
+CONF=$WORK/dfs.conf
+CLIENT=$WORK/client
+PDFS=30
+failed=0
+pids=()
+
+# Function to stop the servers, and remove the temporary directory unless a check failed
+cleanup()
+{
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    if [ "$failed" -eq 0 ]; then
+        rm -rf "$WORK"
+    else
+        echo "Server logs kept in $WORK"
+    fi
+}
+trap cleanup EXIT
+
+# Function to report a check: check <description> <command...>
+check()
+{
+    local what=$1
+    shift
+    if "$@"; then
+        echo "PASS: $what"
+    else
+        echo "FAIL: $what"
+        failed=1
+    fi
+}
+
+# Function to wait until a server accepts connections on a port
+wait_for_port()
+{
+    for _ in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Server on port $1 did not start"
+    exit 1
+}
+
+# Function to start a server: start <name> <log> <args...>
+start()
+{
+    local name=$1 log=$2
+    shift 2
+    "$BIN/$name" -c "$CONF" "$@" > "$WORK/$log.log" 2>&1 &
+    pids+=($!)
+}
+
+# Function to run client commands read from stdin in one session, saving the output in $WORK/out
+client()
+{
+    (cat; echo exit) | (cd "$CLIENT" && "$BIN/w25clients" -c "$CONF") > "$WORK/out" 2>&1
+}
+
+# Function to list every name of a directory, following dispfnames pages of a few names each
+list_pages()
+{
+    local after="" pages=0
+    : > "$WORK/names"
+    while true; do
+        echo "dispfnames $1 7 $after" | client
+        grep '^~S1/' "$WORK/out" >> "$WORK/names"
+        pages=$((pages + 1))
+        after=$(sed -n 's/^More files may follow: dispfnames [^ ]* [0-9]* //p' "$WORK/out")
+        [ -n "$after" ] && [ "$pages" -lt 100 ] || break
+    done
+    echo "$pages" > "$WORK/pages"
+}
+
+# Function to count the S2 instances holding a copy of a file below their storage directories
+copies()
+{
+    local n=0
+    for dir in "$WORK"/S2-*; do
+        [ -f "$dir/$1" ] && n=$((n + 1))
+    done
+    echo "$n"
+}
+
+# Build
+mkdir -p "$BIN" "$CLIENT" "$WORK/src"
+cd "$ROOT" || exit 1
+gcc -Wall -O2 -o "$BIN/S1" s1.c config.c gzip_stream.c namespace.c protocol.c routing.c tar_stream.c thread_pool.c -lpthread -lz || exit 1
+for s in s2 s3 s4; do
+    gcc -Wall -O2 -o "$BIN/${s^^}" $s.c config.c dir_cache.c gzip_stream.c namespace.c protocol.c tar_cache.c tar_stream.c thread_pool.c -lpthread -lz || exit 1
+done
+gcc -Wall -O2 -o "$BIN/w25clients" w25clients.c config.c protocol.c tar_stream.c -lpthread -lz || exit 1
+
+cat > "$CONF" <<EOF
+replicas 2
+S1  127.0.0.1:$PORT        $WORK/S1
+S2  127.0.0.1:$((PORT + 1))  $WORK/S2-1
+S3  127.0.0.1:$((PORT + 2))  $WORK/S3
+S4  127.0.0.1:$((PORT + 3))  $WORK/S4
+S2  127.0.0.1:$((PORT + 4))  $WORK/S2-2
+S2  127.0.0.1:$((PORT + 5))  $WORK/S2-3
+EOF
+
+# Files of every type, the .pdf files of different sizes
+head -c 2000 /dev/urandom | base64 > "$WORK/src/main.c"
+head -c 50000 /dev/urandom | base64 > "$WORK/src/notes.txt"
+head -c 70000 /dev/urandom > "$WORK/src/bundle.zip"
+for i in $(seq $PDFS); do
+    head -c $((i * 3001)) /dev/urandom > "$WORK/src/p$i.pdf"
+done
+
+for i in 1 2 3; do
+    start S2 "S2-$i" -i "$i"
+done
+start S3 S3
+start S4 S4
+for p in 1 2 3 4 5; do
+    wait_for_port $((PORT + p))
+done
+start S1 S1
+wait_for_port "$PORT"
+
+# Upload everything in one session
+for f in "$WORK"/src/*; do
+    echo "uploadf $f ~S1/e2e/sub/"
+done | client
+check "all $((PDFS + 3)) uploads succeed" test "$(grep -c SUCCESS "$WORK/out")" -eq $((PDFS + 3))
+
+# Each .pdf file has two copies, spread over all three S2 instances by the ring
+bad=0
+for i in $(seq $PDFS); do
+    [ "$(copies "e2e/sub/p$i.pdf")" -eq 2 ] || bad=$((bad + 1))
+done
+check "every .pdf file is stored on exactly two S2 instances" test "$bad" -eq 0
+for i in 1 2 3; do
+    check "S2 instance $i holds a share of the .pdf files" test -n "$(ls "$WORK/S2-$i/e2e/sub" 2>/dev/null)"
+done
+check ".c files stay on S1" test -f "$WORK/S1/e2e/sub/main.c"
+check ".txt and .zip files go to S3 and S4" test -f "$WORK/S3/e2e/sub/notes.txt" -a -f "$WORK/S4/e2e/sub/bundle.zip"
+
+# Piped downloads are pipelined over the session
+for f in "$WORK"/src/*; do
+    echo "downlf ~S1/e2e/sub/$(basename "$f")"
+done | client
+bad=0
+for f in "$WORK"/src/*; do
+    cmp -s "$f" "$CLIENT/$(basename "$f")" || bad=$((bad + 1))
+done
+check "pipelined downloads return every file intact" test "$bad" -eq 0
+
+# A listing in pages of 7 names returns every name once
+list_pages "~S1/e2e/sub/"
+check "paged dispfnames lists every file once" test "$(sort -u "$WORK/names" | wc -l)" -eq $((PDFS + 3)) -a "$(wc -l < "$WORK/names")" -eq $((PDFS + 3))
+check "paged dispfnames takes several pages" test "$(cat "$WORK/pages")" -gt 1
+check "dispfnames lists .c files first" test "$(head -1 "$WORK/names")" = "~S1/e2e/sub/main.c"
+
+# A full archive, then one of what changed since it. Archives since a time include the files of
+# its second, so the newest file of the full archive is stored a second after the others and comes
+# again with the file stored a second after it.
+sleep 1.1
+cp "$WORK/src/p1.pdf" "$WORK/src/newest.pdf"
+echo "uploadf $WORK/src/newest.pdf ~S1/e2e/sub/" | client
+echo "downltar all" | client
+check "downltar all holds every file once" test "$(tar -tf "$CLIENT/allfiles.tar" | sort -u | wc -l)" -eq $((PDFS + 4)) -a "$(tar -tf "$CLIENT/allfiles.tar" | wc -l)" -eq $((PDFS + 4))
+mv "$CLIENT/allfiles.tar" "$CLIENT/full.tar"
+sleep 1.1
+cp "$WORK/src/p1.pdf" "$WORK/src/late.pdf"
+echo "uploadf $WORK/src/late.pdf ~S1/e2e/sub/" | client
+echo "downltar all $CLIENT/full.tar" | client
+check "downltar since an archive holds only the files changed since" test "$(tar -tf "$CLIENT/allfiles.tar" 2>/dev/null | sort | tr '\n' ' ')" = "e2e/sub/late.pdf e2e/sub/newest.pdf "
+echo "downltar -z .txt" | client
+check "compressed downltar holds the .txt file" test "$(tar -tzf "$CLIENT/txtfiles.tar.gz" 2>/dev/null)" = "e2e/sub/notes.txt"
+
+# Paths outside ~S1 are refused before any server maps them into its storage directory
+printf 'downlf ~S1/../S1/e2e/sub/main.c\nremovef ~S1/e2e/../../S3/e2e/sub/notes.txt\n' | client
+check "paths outside ~S1 are refused" test "$(grep -c 'Path must be below ~S1' "$WORK/out")" -eq 2
+check "a refused removal leaves the file" test -f "$WORK/S3/e2e/sub/notes.txt"
+
+# Text commands arriving in one write are served one after the other
+exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+printf 'removef ~S1/e2e/sub/p3.pdf\nremovef ~S1/e2e/sub/p4.pdf\n' > "$WORK/text"
+cat "$WORK/text" >&3
+timeout 2 cat <&3 > "$WORK/out" 2>/dev/null
+exec 3<&-
+check "text commands sent together each get a reply" test "$(grep -o SUCCESS "$WORK/out" | wc -l)" -eq 2
+check "text commands sent together each take effect" test "$(copies e2e/sub/p3.pdf)$(copies e2e/sub/p4.pdf)" = "00"
+
+# Removal takes every copy and the index entry
+echo "removef ~S1/e2e/sub/p2.pdf" | client
+check "removef succeeds" grep -q SUCCESS "$WORK/out"
+check "removef deletes every copy" test "$(copies e2e/sub/p2.pdf)" -eq 0
+rm -f "$CLIENT/p2.pdf"
+echo "downlf ~S1/e2e/sub/p2.pdf" | client
+check "a removed file cannot be downloaded" test ! -f "$CLIENT/p2.pdf"
+list_pages "~S1/e2e/sub/"
+sort "$WORK/names" > "$WORK/before"
+check "dispfnames no longer lists the removed files" test "$(grep -c 'p[234]\.pdf$' "$WORK/before")" -eq 0
+
+# A restarted S1 replays its journal instead of listing the servers again
+{ kill -9 "${pids[-1]}"; wait "${pids[-1]}"; } 2>/dev/null
+unset 'pids[-1]'
+check "S1 saved its index" test -f "$WORK/S1.meta/snapshot"
+start S1 S1-restart
+wait_for_port "$PORT"
+list_pages "~S1/e2e/sub/"
+check "the restarted S1 lists the same files" cmp -s "$WORK/before" <(sort "$WORK/names")
+check "the restarted S1 restored its index" test "$(grep -c WARNING "$WORK/S1-restart.log")" -eq 0
+rm -f "$CLIENT/late.pdf"
+echo "downlf ~S1/e2e/sub/late.pdf" | client
+check "the restarted S1 serves a file uploaded before the restart" cmp -s "$WORK/src/late.pdf" "$CLIENT/late.pdf"
+
+exit $failed
@@ -0,0 +1,178 @@
+// Distributed File System - Worker Thread Pool Implementation
+// Jobs are kept in a fixed-size ring buffer protected by a mutex.
+// Submitters wait on not_full, workers wait on not_empty.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+struct pool_job
+{
+    pool_job_fn fn;
+    void *arg;
+};
+
+struct thread_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty; // Signalled when a job is queued
+    pthread_cond_t not_full; // Signalled when a job is taken off the queue
+    struct pool_job *queue; // Ring buffer of pending jobs
+    int queue_depth;
+    int head; // Next job to run
+    int count; // Number of queued jobs
+    int shutdown;
+    int num_workers;
+    pthread_t *workers;
+};
+
+// Worker thread main loop
+// Takes jobs off the queue and runs them until the pool is shut down and drained.
+static void *pool_worker(void *data)
+{
+    struct thread_pool *pool = data;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->shutdown)
+        {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+
+        if (pool->count == 0 && pool->shutdown)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        struct pool_job job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_depth;
+        pool->count--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        job.fn(job.arg);
+    }
+
+    return NULL;
+}
+
+// Function to create a thread pool
+// Allocates the job queue and starts the worker threads.
+struct thread_pool *pool_create(int num_workers, int queue_depth)
+{
+    if (num_workers <= 0 || queue_depth <= 0)
+    {
+        return NULL;
+    }
+
+    struct thread_pool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    pool->queue = calloc(queue_depth, sizeof(struct pool_job));
+    pool->workers = calloc(num_workers, sizeof(pthread_t));
+    if (pool->queue == NULL || pool->workers == NULL)
+    {
+        free(pool->queue);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    pool->queue_depth = queue_depth;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        if (pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0)
+        {
+            perror("ERROR creating worker thread");
+            break;
+        }
+        pool->num_workers++;
+    }
+
+    if (pool->num_workers == 0)
+    {
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+// Function to add a job to the queue, with the pool locked and a slot free
+static void enqueue_job(struct thread_pool *pool, pool_job_fn fn, void *arg)
+{
+    int tail = (pool->head + pool->count) % pool->queue_depth;
+    pool->queue[tail].fn = fn;
+    pool->queue[tail].arg = arg;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+}
+
+// Function to queue a job
+// Waits for a free slot when the queue is full so producers are throttled to the workers' pace.
+int pool_submit(struct thread_pool *pool, pool_job_fn fn, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == pool->queue_depth && !pool->shutdown)
+    {
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+
+    if (pool->shutdown)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    enqueue_job(pool, fn, arg);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Function to queue a job without waiting
+// For producers that must not block, such as an event loop; they hold the job back themselves.
+int pool_try_submit(struct thread_pool *pool, pool_job_fn fn, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    int ret = pool->shutdown ? -1 : (pool->count == pool->queue_depth) ? 1 : 0;
+    if (ret == 0)
+    {
+        enqueue_job(pool, fn, arg);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+// Function to destroy a thread pool
+// Lets the workers finish the queued jobs, then releases all resources.
+void pool_destroy(struct thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_cond_broadcast(&pool->not_full);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_workers; i++)
+    {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+    free(pool->queue);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,27 @@
+// Distributed File System - Worker Thread Pool
+// A fixed set of pre-spawned worker threads pulling jobs from a bounded queue.
+// Used by S1 to run client commands and by S2, S3, S4 to serve connections from S1.
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// Job function executed by a worker thread
+typedef void (*pool_job_fn)(void *arg);
+
+struct thread_pool;
+
+// Creates a pool with num_workers threads and a queue holding up to queue_depth pending jobs.
+// Returns NULL on failure.
+struct thread_pool *pool_create(int num_workers, int queue_depth);
+
+// Queues a job for the workers. Blocks while the queue is full.
+// Returns 0 on success, -1 if the pool is shutting down.
+int pool_submit(struct thread_pool *pool, pool_job_fn fn, void *arg);
+
+// Queues a job like pool_submit(), but returns 1 instead of waiting when the queue is full.
+int pool_try_submit(struct thread_pool *pool, pool_job_fn fn, void *arg);
+
+// Stops accepting jobs, waits for queued jobs to finish and joins the workers.
+void pool_destroy(struct thread_pool *pool);
+
+#endif
@@ -13,40 +13,107 @@
 #include <fcntl.h> // for open()
 #include <libgen.h> // for basename()
 #include <errno.h> // for errno
+#include <signal.h> // for signal()
+#include <poll.h> // for poll()
+#include <netinet/tcp.h> // for TCP_NODELAY
+
+#include "config.h"
+#include "namespace.h"
+#include "protocol.h"
+#include "tar_stream.h"
 
-#define PORT 4307 // S1 server port
 #define BUFFER_SIZE 1024 // Buffer size for file transfer
 #define MAX_PATH_LEN 1024 // Maximum path length
+#define MAX_PIPELINE 32 // downlf requests sent before waiting for their replies
+
+// A downlf request waiting for its reply
+struct download 
+{
+    uint32_t id; // Request id the replies carry
+    char name[MAX_PATH_LEN]; // Local file the download is saved to
+    int fd; // Open local file, -1 before the server accepted the request
+    int created; // Local file was created and must be removed if the download fails
+    int failed; // Writing the local file failed
+};
 
 // Function prototypes
 void error(const char *msg); // Error handling function
 int connect_to_server(); // Function to connect to the server
+int ensure_connected(int sockfd); // Function to reuse or re-open the session connection
 void handle_uploadf(int sockfd, char *filename, char *dest_path); // Function to handle file upload
-void handle_downlf(int sockfd, char *filename);
+void handle_downlf(int sockfd, char *filename, struct download *batch, int *count);
 void handle_removef(int sockfd, char *filename);
-void handle_downltar(int sockfd, char *filetype);
-void handle_dispfnames(int sockfd, char *pathname);
-int send_file(int sockfd, char *filename);
+void handle_downltar(int sockfd, char *filetype, char *since, int compress);
+void handle_dispfnames(int sockfd, char *pathname, char *limit, char *after, const char *order);
+int send_request(int sockfd, uint8_t opcode, const char *const args[], int nargs);
+int receive_status(int sockfd, int print);
+int send_file(int sockfd, int fd);
 int receive_file(int sockfd, char *filename);
+void receive_downloads(int sockfd, struct download *batch, int count);
+
+uint32_t request_id; // Id of the most recent request sent to S1
 
-int main() {
-    int sockfd;
+// Usage: ./w25clients [-o] [-c config_file]
+// By default all commands share one connection to S1 (a session) until exit.
+// With -o a new connection is opened for every command.
+// With -c the address of S1 is taken from the server configuration file instead of localhost:4307.
+// When commands are piped in rather than typed, consecutive downlf commands are pipelined: their
+// requests are all sent before the replies are collected, so the downloads run concurrently.
+int main(int argc, char *argv[]) {
+    int sockfd = -1;
+    int one_shot = 0;
+    const char *config_path = NULL;
+    int opt;
     char buffer[BUFFER_SIZE]; // Buffer for user input
+    struct download downloads[MAX_PIPELINE]; // downlf requests in flight
+    int ndownloads = 0;
+    
+    // Parse options
+    while ((opt = getopt(argc, argv, "oc:")) != -1) 
+    {
+        switch (opt) 
+        {
+            case 'o':
+                one_shot = 1;
+                break;
+            case 'c':
+                config_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-o] [-c config_file]\n", argv[0]);
+                exit(1);
+        }
+    }
+    
+    // Address of S1
+    if (dfs_load_config(config_path) < 0) 
+    {
+        exit(1);
+    }
+    
+    int pipelined = !one_shot && !isatty(STDIN_FILENO);
+    
+    // A session dropped by the server is detected and reopened, not fatal
+    signal(SIGPIPE, SIG_IGN);
     
     printf("Distributed File System Client\n");
     printf("Available commands:\n");
     printf("  uploadf <filename> <destination_path> (example: uploadf test1.txt ~S1/folder1/)\n");
     printf("  downlf <filename> (example: downlf ~S1/folder1/test1.txt)\n");
     printf("  removef <filename> (example: removef ~S1/folder1/test1.txt)\n");
-    printf("  downltar <filetype> (example: downltar .txt)\n");
-    printf("  dispfnames <pathname> (example: dispfnames ~S1/)\n");
+    printf("  downltar [-z] <filetype>[,<filetype>...] | all [since] (example: downltar .txt txtfiles.tar)\n");
+    printf("  dispfnames [-n | -a] <pathname> [limit [after]] (example: dispfnames ~S1/)\n");
     printf("  exit\n\n");
     
     while (1) 
     {
         printf("w25clients$ ");
+        fflush(stdout);
         bzero(buffer, BUFFER_SIZE); 
-        fgets(buffer, BUFFER_SIZE - 1, stdin);
+        if (fgets(buffer, BUFFER_SIZE - 1, stdin) == NULL) 
+        {
+            break; // End of input (e.g. a script piped into the client)
+        }
         
         // Remove newline
         buffer[strcspn(buffer, "\n")] = 0;
@@ -63,8 +130,19 @@ int main() {
             break;
         }
         
-        // Connect to server
-        sockfd = connect_to_server();
+        // Any other command waits for the pipelined downloads to complete
+        if (ndownloads > 0 && strncmp(buffer, "downlf ", 7) != 0) 
+        {
+            receive_downloads(sockfd, downloads, ndownloads);
+            ndownloads = 0;
+        }
+        
+        // Connect to server, reusing the session connection when it is still open
+        // (replies to pipelined downloads may be waiting on it, which is not a closed session)
+        if (ndownloads == 0) 
+        {
+            sockfd = one_shot ? connect_to_server() : ensure_connected(sockfd);
+        }
         if (sockfd < 0) 
         {
             printf("Failed to connect to server\n");
@@ -82,7 +160,10 @@ int main() {
             if (filename == NULL || dest_path == NULL) 
             {
                 printf("Invalid command format. Usage: uploadf <filename> <destination_path>\n"); // Example: uploadf test1.txt ~S1/folder1/
-                close(sockfd);
+                if (one_shot) 
+                {
+                    close(sockfd);
+                }
                 continue;
             }
             handle_uploadf(sockfd, filename, dest_path); // Upload file
@@ -95,10 +176,18 @@ int main() {
             if (filename == NULL) 
             {
                 printf("Invalid command format. Usage: downlf <filename>\n");
-                close(sockfd);
+                if (one_shot) 
+                {
+                    close(sockfd);
+                }
                 continue;
             }
-            handle_downlf(sockfd, filename);
+            handle_downlf(sockfd, filename, downloads, &ndownloads);
+            if (!pipelined && ndownloads > 0) 
+            {
+                receive_downloads(sockfd, downloads, ndownloads);
+                ndownloads = 0;
+            }
         }
 		// task 3 removef
         else if (strcmp(cmd, "removef") == 0) 
@@ -107,7 +196,10 @@ int main() {
             if (filename == NULL) 
             {
                 printf("Invalid command format. Usage: removef <filename>\n");
-                close(sockfd);
+                if (one_shot) 
+                {
+                    close(sockfd);
+                }
                 continue;
             }
             handle_removef(sockfd, filename);
@@ -116,33 +208,68 @@ int main() {
         else if (strcmp(cmd, "downltar") == 0) 
         {
             char *filetype = strtok(NULL, " ");
+            int compress = (filetype != NULL && strcmp(filetype, "-z") == 0);
+            if (compress) 
+            {
+                filetype = strtok(NULL, " ");
+            }
+            char *since = strtok(NULL, " ");
             if (filetype == NULL) 
             {
-                printf("Invalid command format. Usage: downltar <filetype>\n");
-                close(sockfd);
+                printf("Invalid command format. Usage: downltar [-z] <filetype> [since]\n");
+                if (one_shot) 
+                {
+                    close(sockfd);
+                }
                 continue;
             }
-            handle_downltar(sockfd, filetype);
+            handle_downltar(sockfd, filetype, since, compress);
         }
 
 		// task 5 dispfnames
         else if (strcmp(cmd, "dispfnames") == 0)
         {
             char *pathname = strtok(NULL, " ");
-            if (pathname == NULL) 
+            const char *order = NULL;
+            if (pathname != NULL && (strcmp(pathname, "-n") == 0 || strcmp(pathname, "-a") == 0)) 
             {
-                printf("Invalid command format. Usage: dispfnames <pathname>\n");
-                close(sockfd);
+                order = (pathname[1] == 'n') ? NS_ORDER_NAME : NS_ORDER_ARRIVAL;
+                pathname = strtok(NULL, " ");
+            }
+            char *limit = strtok(NULL, " ");
+            char *after = (limit != NULL) ? strtok(NULL, " ") : NULL;
+            if (pathname == NULL || (limit != NULL && strspn(limit, "0123456789") != strlen(limit))) 
+            {
+                printf("Invalid command format. Usage: dispfnames [-n | -a] <pathname> [limit [after]]\n");
+                if (one_shot) 
+                {
+                    close(sockfd);
+                }
                 continue;
             }
-            handle_dispfnames(sockfd, pathname);
+            handle_dispfnames(sockfd, pathname, limit, after, order);
         } 
         else 
         {
             printf("Unknown command: %s\n", cmd);
         }
         
-        close(sockfd); // Close the socket after each command
+        if (one_shot) 
+        {
+            close(sockfd); // Close the socket after each command
+            sockfd = -1;
+        }
+    }
+    
+    // End the session
+    if (ndownloads > 0) 
+    {
+        receive_downloads(sockfd, downloads, ndownloads);
+    }
+    if (sockfd >= 0) 
+    {
+        send_request(sockfd, DFS_OP_EXIT, NULL, 0);
+        close(sockfd);
     }
     
     return 0;
@@ -162,7 +289,7 @@ int connect_to_server() // Function to connect to the server
     }
     
     // Get server address
-    server = gethostbyname("localhost");
+    server = gethostbyname(dfs_server_host(DFS_S1));
     if (server == NULL) 
     {
         fprintf(stderr, "ERROR, no such host\n"); // Host resolution failed
@@ -173,18 +300,41 @@ int connect_to_server() // Function to connect to the server
     bzero((char *) &serv_addr, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET; // Address family
     bcopy((char *)server->h_addr, (char *)&serv_addr.sin_addr.s_addr, server->h_length); // Copy host address
-    serv_addr.sin_port = htons(PORT); // Port number
+    serv_addr.sin_port = htons(dfs_servers[DFS_S1].port); // Port number
     
     // Connect to server
     if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
     {
         error("ERROR connecting");
+        close(sockfd);
         return -1;
     }
     
+    // Commands are small request/response exchanges, don't let Nagle delay them
+    int nodelay = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    
     return sockfd; // Return the socket file descriptor
 }
 
+// Function to get a usable session connection
+// Reuses sockfd unless the server has closed it (e.g. after a failed transfer), then reconnects.
+int ensure_connected(int sockfd) 
+{
+    if (sockfd >= 0) 
+    {
+        // An idle session should have nothing to read; readable means EOF or an error
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) == 0) 
+        {
+            return sockfd;
+        }
+        close(sockfd);
+    }
+    
+    return connect_to_server();
+}
+
 // Error handling function
 void handle_uploadf(int sockfd, char *filename, char *dest_path) 
 {
@@ -218,48 +368,30 @@ void handle_uploadf(int sockfd, char *filename, char *dest_path)
         return;
     }
     
-    // Send command to server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "uploadf %s %s", filename, dest_path);
-    if (write(sockfd, command, strlen(command)) < 0) 
+    // Open file
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) 
     {
-        error("ERROR writing to socket");
+        printf("ERROR: Failed to open file '%s'\n", filename);
         return;
     }
     
-    // Wait for server response
-    char response[BUFFER_SIZE];
-    bzero(response, BUFFER_SIZE);
-    if (read(sockfd, response, BUFFER_SIZE - 1) < 0) 
+    // Send command to server, immediately followed by the file data
+    const char *args[] = { filename, dest_path };
+    if (send_request(sockfd, DFS_OP_UPLOADF, args, 2) < 0 || send_file(sockfd, fd) < 0) 
     {
-        error("ERROR reading from socket");
+        close(fd);
         return;
     }
+    close(fd);
     
-    // Check server response
-    if (strcmp(response, "READY") == 0) 
-    {
-        // Server is ready to receive file
-        if (send_file(sockfd, filename) == 0) 
-        {
-            // Wait for final response
-            bzero(response, BUFFER_SIZE);
-            if (read(sockfd, response, BUFFER_SIZE - 1) < 0) 
-            {
-                error("ERROR reading from socket");
-                return;
-            }
-            printf("%s\n", response);
-        }
-    } 
-    else 
-    {
-        printf("%s\n", response);
-    }
+    // Wait for server response
+    receive_status(sockfd, 1);
 }
 
 // Error handling function
-void handle_downlf(int sockfd, char *filename) 
+// Sends the request and adds it to the batch of downloads in flight; the caller collects the replies.
+void handle_downlf(int sockfd, char *filename, struct download *batch, int *count) 
 {
     // Check if filename starts with ~S1/
     if (strncmp(filename, "~S1/", 4) != 0) 
@@ -284,23 +416,36 @@ void handle_downlf(int sockfd, char *filename)
         return;
     }
     
-    // Send command to server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "downlf %s", filename);
-    if (write(sockfd, command, strlen(command)) < 0) 
+    // Get the base name for saving locally
+    char name[MAX_PATH_LEN];
+    snprintf(name, sizeof(name), "%s", filename);
+    char *base_name = basename(name);
+    
+    // A full batch, or one already downloading to the same local file, has to complete first
+    int busy = (*count == MAX_PIPELINE);
+    for (int i = 0; i < *count && !busy; i++) 
     {
-        error("ERROR writing to socket");
-        return;
+        busy = (strcmp(batch[i].name, base_name) == 0);
+    }
+    if (busy) 
+    {
+        receive_downloads(sockfd, batch, *count);
+        *count = 0;
     }
     
-    // Get the base name for saving locally
-    char *base_name = basename(filename);
-    
-    // Receive file from server
-    if (receive_file(sockfd, base_name) == 0) 
+    // Send command to server
+    const char *args[] = { filename };
+    if (send_request(sockfd, DFS_OP_DOWNLF, args, 1) < 0) 
     {
-        printf("File '%s' downloaded successfully\n", base_name);
+        return;
     }
+    
+    struct download *dl = &batch[(*count)++];
+    dl->id = request_id;
+    snprintf(dl->name, sizeof(dl->name), "%s", base_name);
+    dl->fd = -1;
+    dl->created = 0;
+    dl->failed = 0;
 }
 
 // Error handling function
@@ -328,56 +473,87 @@ void handle_removef(int sockfd, char *filename)
     }
     
     // Send command to server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "removef %s", filename);
-    if (write(sockfd, command, strlen(command)) < 0) 
+    const char *args[] = { filename };
+    if (send_request(sockfd, DFS_OP_REMOVEF, args, 1) < 0) 
     {
-        error("ERROR writing to socket");
         return;
     }
     
     // Get server response
-    char response[BUFFER_SIZE];
-    bzero(response, BUFFER_SIZE);
-    if (read(sockfd, response, BUFFER_SIZE - 1) < 0) 
-    {
-        error("ERROR reading from socket");
-        return;
-    }
-    
-    printf("%s\n", response);
+    receive_status(sockfd, 1);
 }
 
 // Error handling function
-void handle_downltar(int sockfd, char *filetype) 
+// filetype is one type, a comma-separated set such as .c,.pdf, or all for every type.
+// since limits the archive to the files modified at or after a time, given in seconds since the
+// epoch or as a previous archive: then the newest file in that archive sets the time.
+// With compress the archive arrives gzip compressed and is saved as a .tar.gz file.
+void handle_downltar(int sockfd, char *filetype, char *since, int compress) 
 {
-    // Check file type
-    if (strcmp(filetype, ".c") != 0 && strcmp(filetype, ".pdf") != 0 && strcmp(filetype, ".txt") != 0) 
+    static const char *const names[][2] = {
+        { ".c", "cfiles.tar" }, { ".pdf", "pdfiles.tar" }, { ".txt", "txtfiles.tar" }, { ".zip", "zipfiles.tar" }
+    };
+    char output_file[MAX_PATH_LEN] = "";
+    char types[MAX_PATH_LEN];
+    char *saveptr;
+    int ntypes = 0;
+
+    // Check file types and determine output filename
+    snprintf(types, sizeof(types), "%s", (strcmp(filetype, "all") == 0) ? ".c,.pdf,.txt,.zip" : filetype);
+    for (char *type = strtok_r(types, ",", &saveptr); type != NULL; type = strtok_r(NULL, ",", &saveptr)) 
+    {
+        int i = 0;
+        while (i < 4 && strcmp(type, names[i][0]) != 0) 
+        {
+            i++;
+        }
+        if (i == 4) 
+        {
+            ntypes = 0;
+            break;
+        }
+        snprintf(output_file, sizeof(output_file), "%s", names[i][1]);
+        ntypes++;
+    }
+    if (ntypes == 0) 
     {
-        printf("ERROR: Unsupported file type for tar. Only .c, .pdf, .txt allowed\n");
+        printf("ERROR: Unsupported file type for tar. Only .c, .pdf, .txt, .zip allowed, or all\n");
         return;
     }
-    
-    // Determine output filename
-    char output_file[50];
-    if (strcmp(filetype, ".c") == 0) 
+    if (ntypes > 1) 
     {
-        strcpy(output_file, "cfiles.tar");
-    } 
-    else if (strcmp(filetype, ".pdf") == 0) 
+        // S1 merges the files of several types into one archive
+        strcpy(output_file, (strcmp(filetype, "all") == 0) ? "allfiles.tar" : "files.tar");
+    }
+    if (compress) 
     {
-        strcpy(output_file, "pdfiles.tar");
-    } else 
+        strcat(output_file, ".gz");
+    }
+    
+    // Turn a previous archive into the time of its newest file. An archive without files carries
+    // the time it was asked for as its own modification time instead.
+    char since_time[32];
+    if (since != NULL && since[strspn(since, "0123456789")] != '\0') 
     {
-        strcpy(output_file, "txtfiles.tar");
+        struct stat st;
+        time_t newest = tar_newest_mtime(since);
+        if (newest == 0 && stat(since, &st) == 0) 
+        {
+            newest = st.st_mtime;
+        }
+        if (newest < 0) 
+        {
+            printf("ERROR: %s is neither a time nor a tar archive\n", since);
+            return;
+        }
+        snprintf(since_time, sizeof(since_time), "%lld", (long long)newest);
+        since = since_time;
     }
     
     // Send command to server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "downltar %s", filetype);
-    if (write(sockfd, command, strlen(command)) < 0) 
+    const char *args[] = { filetype, (since != NULL) ? since : "0", TAR_ARG_GZIP };
+    if (send_request(sockfd, DFS_OP_DOWNLTAR, args, compress ? 3 : (since != NULL) ? 2 : 1) < 0) 
     {
-        error("ERROR writing to socket");
         return;
     }
     
@@ -385,11 +561,18 @@ void handle_downltar(int sockfd, char *filetype)
     if (receive_file(sockfd, output_file) == 0) 
     {
         printf("Tar file '%s' downloaded successfully\n", output_file);
+        
+        // Nothing changed: keep the time for the next incremental download of this archive
+        if (since != NULL && tar_newest_mtime(output_file) == 0) 
+        {
+            struct timespec times[2] = { { .tv_sec = atoll(since) }, { .tv_sec = atoll(since) } };
+            utimensat(AT_FDCWD, output_file, times, 0);
+        }
     }
 }
 
 // Error handling function
-void handle_dispfnames(int sockfd, char *pathname) 
+void handle_dispfnames(int sockfd, char *pathname, char *limit, char *after, const char *order) 
 {
     // Check if pathname starts with ~S1/
     if (strncmp(pathname, "~S1/", 4) != 0) 
@@ -398,162 +581,311 @@ void handle_dispfnames(int sockfd, char *pathname)
         return;
     }
     
-    // Send command to server
-    char command[BUFFER_SIZE];
-    snprintf(command, BUFFER_SIZE, "dispfnames %s", pathname);
-    if (write(sockfd, command, strlen(command)) < 0) 
+    // Send command to server; an order other than by type comes last, after an empty cursor if none
+    // is given
+    const char *args[] = { pathname, (limit != NULL) ? limit : "0", (after != NULL) ? after : "", order };
+    int nargs = (order != NULL) ? 4 : (after != NULL) ? 3 : (limit != NULL) ? 2 : 1;
+    if (send_request(sockfd, DFS_OP_DISPFNAMES, args, nargs) < 0) 
     {
-        error("ERROR writing to socket");
         return;
     }
     
     // Get server response
-    char response[BUFFER_SIZE];
-    bzero(response, BUFFER_SIZE);
-    if (read(sockfd, response, BUFFER_SIZE - 1) < 0) 
+    if (receive_status(sockfd, 0) != DFS_OK) 
     {
-        error("ERROR reading from socket");
         return;
     }
     
-    printf("Files in %s:\n%s", pathname, response);
+    // The listing is streamed straight to the terminal, however long it is. The names are counted
+    // and the last one kept, to tell how to ask for the rest of a limited listing.
+    printf("Files in %s:\n", pathname);
+    fflush(stdout);
+    
+    char chunk[DFS_CHUNK_SIZE];
+    char line[MAX_PATH_LEN], last[MAX_PATH_LEN] = "";
+    size_t line_len = 0;
+    unsigned long count = 0;
+    struct dfs_header hdr;
+    int status = -1;
+    while (dfs_recv_header(sockfd, &hdr) == 0 && hdr.opcode == DFS_OP_DATA) 
+    {
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) 
+        {
+            size_t n = (remaining < sizeof(chunk)) ? remaining : sizeof(chunk);
+            if (dfs_read_full(sockfd, chunk, n) < 0) 
+            {
+                break;
+            }
+            dfs_write_full(STDOUT_FILENO, chunk, n);
+            for (size_t i = 0; i < n; i++) 
+            {
+                if (chunk[i] == '\n') 
+                {
+                    line[line_len] = '\0';
+                    strcpy(last, line);
+                    line_len = 0;
+                    count++;
+                }
+                else if (line_len < sizeof(line) - 1) 
+                {
+                    line[line_len++] = chunk[i];
+                }
+            }
+            remaining -= n;
+        }
+        if (remaining > 0) 
+        {
+            break;
+        }
+        if (hdr.flags & DFS_FLAG_END) 
+        {
+            status = (int)hdr.status;
+            break;
+        }
+    }
+    if (status < 0) 
+    {
+        printf("ERROR: Failed to read from socket\n");
+        shutdown(sockfd, SHUT_RDWR);
+        return;
+    }
+    
+    // A listing that filled its limit may have more names after it
+    if (limit != NULL && strtoul(limit, NULL, 10) > 0 && count == strtoul(limit, NULL, 10)) 
+    {
+        if (order == NULL) 
+        {
+            printf("More files may follow: dispfnames %s %s %s\n", pathname, limit, last);
+        }
+        else if (strcmp(order, NS_ORDER_NAME) == 0) 
+        {
+            printf("More files may follow: dispfnames -n %s %s %s\n", pathname, limit, last);
+        }
+        else 
+        {
+            printf("More files may follow\n"); // Names listed as they arrived cannot be continued
+        }
+    }
 }
 
-// Function to send a file to the server
-int send_file(int sockfd, char *filename) 
+// Function to send a request frame to the server
+// Each request gets the next request id; a failed send closes the session so it is reopened.
+int send_request(int sockfd, uint8_t opcode, const char *const args[], int nargs) 
 {
-    int fd;
-    char buffer[BUFFER_SIZE];
-    ssize_t n;
-    
-    // Open file
-    fd = open(filename, O_RDONLY);
-    if (fd < 0) 
+    request_id++;
+    if (dfs_send_request(sockfd, opcode, request_id, args, nargs) < 0) 
     {
-        printf("ERROR: Failed to open file '%s'\n", filename);
+        error("ERROR writing to socket");
+        shutdown(sockfd, SHUT_RDWR);
         return -1;
     }
+    return 0;
+}
+
+// Function to receive the server's status reply to the last request
+// Prints the message if print is set or the request failed. Returns the status, -1 if the
+// connection broke.
+int receive_status(int sockfd, int print) 
+{
+    struct dfs_header hdr;
+    char msg[BUFFER_SIZE];
     
-    // Get file size
-    struct stat st;
-    if (fstat(fd, &st) < 0) 
+    if (dfs_recv_status(sockfd, &hdr, msg, sizeof(msg), NULL) < 0 || hdr.request_id != request_id) 
     {
-        printf("ERROR: Failed to get file size\n");
-        close(fd);
+        printf("ERROR: Failed to read from socket\n");
+        shutdown(sockfd, SHUT_RDWR);
         return -1;
     }
     
-    // Send file size
-    if (write(sockfd, &st.st_size, sizeof(off_t)) < 0) 
+    if (print || hdr.status != DFS_OK) 
     {
-        error("ERROR writing file size to socket");
-        close(fd);
-        return -1;
+        printf("%s\n", msg);
     }
+    return (int)hdr.status;
+}
+
+// Function to send a file to the server
+// The file follows the upload request as DATA frames; the last one is flagged END.
+int send_file(int sockfd, int fd) 
+{
+    char buffer[DFS_CHUNK_SIZE];
+    ssize_t n;
     
     // Send file data
-    off_t remaining = st.st_size;
-    while (remaining > 0) 
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) 
     {
-        n = read(fd, buffer, BUFFER_SIZE);
-        if (n <= 0) // Error or end of file
-        {
-            printf("ERROR: Failed to read from file\n");
-            close(fd);
-            return -1;
-        }
-        // Send data to server
-        if (write(sockfd, buffer, n) < 0) 
+        if (dfs_send_frame(sockfd, DFS_OP_DATA, 0, request_id, DFS_OK, buffer, n) < 0) 
         {
             error("ERROR writing to socket");
-            close(fd);
+            shutdown(sockfd, SHUT_RDWR);
             return -1;
         }
-        
-        remaining -= n;
     }
     
-    close(fd);
+    // Error or end of file: finish the upload either way so the session stays in sync
+    uint32_t status = (n < 0) ? DFS_ERR_IO : DFS_OK;
+    if (n < 0) 
+    {
+        printf("ERROR: Failed to read from file\n");
+    }
+    if (dfs_send_frame(sockfd, DFS_OP_DATA, DFS_FLAG_END, request_id, status, NULL, 0) < 0) 
+    {
+        error("ERROR writing to socket");
+        shutdown(sockfd, SHUT_RDWR);
+        return -1;
+    }
     return 0;
 }
+
 // Function to receive a file from the server
 int receive_file(int sockfd, char *filename) 
 {
-    int fd;
-    char buffer[BUFFER_SIZE];
-    ssize_t n;
-
-    // Peek into the socket to check if response starts with "ERROR"
-    char peek_buf[6] = {0}; // 5 + null terminator
-    n = recv(sockfd, peek_buf, 5, MSG_PEEK);  // Look at first 5 bytes without removing them from buffer
-
-    // Check for error in peeking
-    if (n <= 0) 
+    // Check the reply; errors come back as a status message instead of file data
+    if (receive_status(sockfd, 0) != DFS_OK) 
     {
-        printf("ERROR: Failed to read from socket\n");
         return -1;
     }
 
-    // Check if the response starts with "ERROR"
-    if (strncmp(peek_buf, "ERROR", 5) == 0) 
-    {
-        // Read full error message now
-        char error_msg[BUFFER_SIZE] = {0};
-        read(sockfd, error_msg, BUFFER_SIZE - 1);
-        printf("%s\n", error_msg);
-        return -1;
-    }
-
-    // Read file size
-    off_t file_size;
-    if (read(sockfd, &file_size, sizeof(off_t)) != sizeof(off_t)) 
+    // Create file
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) 
     {
-        printf("ERROR: Failed to read file size\n");
+        printf("ERROR: Failed to create file '%s'\n", filename);
+        dfs_skip_body(sockfd);
         return -1;
     }
 
-    // Check if file size is valid
-    if (file_size <= 0) 
+    // Receive file data
+    int status = dfs_recv_body(sockfd, fd, NULL, 0, NULL);
+    close(fd); // Close the file
+    if (status != DFS_OK) 
     {
-        printf("ERROR: Invalid file size received: %ld\n", (long)file_size);
+        printf("ERROR: File transfer failed\n");
+        unlink(filename);  // Delete partially written file
+        if (status < 0) 
+        {
+            shutdown(sockfd, SHUT_RDWR);
+        }
         return -1;
     }
 
-    // Create file
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) {
-        printf("ERROR: Failed to create file '%s'\n", filename);
-        return -1;
-    }
+    return 0; // Success
+}
 
-    // Receive file data
-    off_t remaining = file_size;
+// Function to receive the replies to a batch of downlf requests
+// S1 completes pipelined requests in any order and interleaves their frames, so every frame is
+// matched to its download by request id.
+void receive_downloads(int sockfd, struct download *batch, int count) 
+{
+    char buffer[DFS_CHUNK_SIZE];
+    int remaining = count;
+    
     while (remaining > 0) 
     {
-        // Read data from socket
-        n = read(sockfd, buffer, (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE);
-        if (n <= 0) 
+        struct dfs_header hdr;
+        struct download *dl = NULL;
+        if (dfs_recv_header(sockfd, &hdr) < 0) 
         {
-            printf("ERROR: File transfer failed\n");
-            close(fd);
-            unlink(filename);  // Delete partially written file
-            return -1;
+            break;
         }
-
-        // Write data to file
-        if (write(fd, buffer, n) < 0) 
+        for (int i = 0; i < count; i++) 
         {
-            printf("ERROR: Failed to write to file\n");
-            close(fd);
-            unlink(filename);
-            return -1;
+            if (batch[i].id == hdr.request_id) 
+            {
+                dl = &batch[i];
+            }
+        }
+        if (dl == NULL) 
+        {
+            break; // Reply to no request of ours, the session is out of sync
+        }
+        
+        if (hdr.opcode == DFS_OP_STATUS) 
+        {
+            // Status message, or the file size when the download is starting
+            if (hdr.length >= sizeof(buffer) || dfs_read_full(sockfd, buffer, hdr.length) < 0) 
+            {
+                break;
+            }
+            buffer[hdr.length] = '\0';
+            if (hdr.status != DFS_OK) 
+            {
+                printf("%s\n", buffer);
+                dl->id = 0;
+                remaining--;
+                continue;
+            }
+            
+            dl->fd = open(dl->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (dl->fd < 0) 
+            {
+                printf("ERROR: Failed to create file '%s'\n", dl->name);
+                dl->failed = 1;
+            }
+            dl->created = (dl->fd >= 0);
+        } 
+        else if (hdr.opcode == DFS_OP_DATA) 
+        {
+            // Piece of the file, written to the download it belongs to
+            uint64_t left = hdr.length;
+            while (left > 0) 
+            {
+                size_t n = (left < sizeof(buffer)) ? left : sizeof(buffer);
+                if (dfs_read_full(sockfd, buffer, n) < 0) 
+                {
+                    break;
+                }
+                if (dl->fd >= 0 && dfs_write_full(dl->fd, buffer, n) < 0) 
+                {
+                    dl->failed = 1;
+                }
+                left -= n;
+            }
+            if (left > 0) 
+            {
+                break;
+            }
+            
+            if (hdr.flags & DFS_FLAG_END) 
+            {
+                if (dl->fd >= 0) 
+                {
+                    close(dl->fd);
+                }
+                if (hdr.status == DFS_OK && !dl->failed) 
+                {
+                    printf("File '%s' downloaded successfully\n", dl->name);
+                } 
+                else if (dl->created) 
+                {
+                    printf("ERROR: File transfer failed\n");
+                    unlink(dl->name);  // Delete partially written file
+                }
+                dl->id = 0;
+                remaining--;
+            }
+        } 
+        else 
+        {
+            break;
         }
-
-        remaining -= n; // Update remaining bytes
     }
-
-    close(fd); // Close the file
-    return 0; // Success
+    
+    if (remaining > 0) 
+    {
+        // Connection lost or out of sync, the downloads still in flight are lost with it
+        printf("ERROR: Failed to read from socket\n");
+        for (int i = 0; i < count; i++) 
+        {
+            if (batch[i].id != 0 && batch[i].created) 
+            {
+                close(batch[i].fd);
+                unlink(batch[i].name);
+            }
+        }
+        shutdown(sockfd, SHUT_RDWR);
+    }
 }
 
 // Error handling function